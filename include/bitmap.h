@@ -1,153 +1,245 @@
-#ifndef BITMAP_H__
-#define BITMAP_H__
-
-#ifdef __cplusplus
-extern "C" 
-{
-#endif
-
-#include <stdint.h>
-#include <stdlib.h>
-#include <stddef.h>
-#include <stdbool.h>
-
-typedef struct bitmap bitmap_t;
-
-// WARNING: Bit requests outside the bitmap and NULL pointers WILL result in a segfault
-// This was originally a high performance C++ library, so the C translation assumes you're using it right.
-
-// But is there really such a thing as a high-performance shared library?
-
-///
-/// Sets requested bit in bitmap
-/// \param bitmap The bitmap
-/// \param bit The bit to set
-///
-void bitmap_set(bitmap_t *const bitmap, const size_t bit);
-
-///
-/// Clears requested bit in bitmap
-/// \param bitmap The bitmap
-/// \param bit The bit to clear
-///
-void bitmap_reset(bitmap_t *const bitmap, const size_t bit);
-
-///
-/// Returns bit in bitmap
-/// \param bitmap The bitmap
-/// \param bit The bit to query
-/// \return State of requested bit
-///
-bool bitmap_test(const bitmap_t *const bitmap, const size_t bit);
-
-///
-/// Flips bit in bitmap
-/// \param bitmap The bitmap
-/// \param bit The bit to flip
-///
-void bitmap_flip(bitmap_t *const bitmap, const size_t bit);
-
-///
-/// Flips all bits in the bitmap
-/// \param bitmap The bitmap to invert
-///
-void bitmap_invert(bitmap_t *const bitmap);
-
-///
-/// Find first set
-/// \param bitmap The bitmap
-/// \return The first one bit address, SIZE_MAX on error/not found
-///
-size_t bitmap_ffs(const bitmap_t *const bitmap);
-
-///
-/// Find first zero
-/// \param bitmap The bitmap
-/// \return The first zero bit address, SIZE_MAX on error/not found
-///
-size_t bitmap_ffz(const bitmap_t *const bitmap);
-
-///
-/// Count all bits set
-/// \param bitmap the bitmap
-/// \return the total number of bits that are set in the bitmap
-///
-size_t bitmap_total_set(const bitmap_t *const bitmap);
-///
-/// For each loop for all set bits
-///  (Arguments passed to func are saved across calls)
-/// \param bitmap The bitmap
-/// \param func The function to apply (first parameter will be size_t with the bit number)
-/// \param args A generic pointer to pass to the called function
-///
-void bitmap_for_each(const bitmap_t *const bitmap, void (*func)(size_t, void *), void *arg);
-
-///
-/// Resets bitmap contents to the desired pattern
-/// (pattern not guarenteed accurate for final bits
-/// 		if bit_count is not a multiple of 8)
-/// \param bitmap The bitmap
-/// \param pattern The pattern to apply to all bytes
-///
-void bitmap_format(bitmap_t *const bitmap, const uint8_t pattern);
-
-///
-/// Gets total number of bits in bitmap
-/// \param bitmap The bitmap
-/// \return The number of bits in the bitmap
-///
-size_t bitmap_get_bits(const bitmap_t *const bitmap);
-
-///
-/// Gets total number of bytes in bitmap
-/// \param bitmap The bitmap
-/// \return number of bytes used by bitmap storage array
-///
-size_t bitmap_get_bytes(const bitmap_t *const bitmap);
-
-///
-/// Creates a bitmap to contain n bits (zero initialized)
-/// \param n_bits
-/// \return New bitmap pointer, NULL on error
-///
-bitmap_t *bitmap_create(const size_t n_bits);
-
-///
-/// Gets pointer to the internal data for exporting
-///  Be sure to query the bit and byte size if it's unknown
-/// \param bitmap The bitmap
-/// \return Pointer for writing
-///
-const uint8_t *bitmap_export(const bitmap_t *const bitmap);
-
-///
-/// Creates a new bitmap with the provided data
-/// Note: This does not use the buffer but copies the data
-///  to an internal buffer
-/// \param n_bits The number of bits in the bitmap
-/// \param bitmap_data The data to import
-/// \return New bitmap pointer, NULL on error
-///
-bitmap_t *bitmap_import(const size_t n_bits, const void *const bitmap_data);
-
-///
-/// Creates a new bitmap using the provided data
-/// Note: This uses the given block of memory
-///  and does not free this pointer on destruction
-/// \param n_bits The number of bits in the bitmap
-/// \param bitmap_data The data to import
-/// \return New bitmap pointer, NULL on error
-///
-bitmap_t *bitmap_overlay(const size_t n_bits, void *const bitmap_data);
-
-///
-/// Destructs and destroys bitmap object
-/// \param bitmap The bitmap
-///
-void bitmap_destroy(bitmap_t *bitmap);
-
-#ifdef __cplusplus
-}
-#endif
-
-#endif
+#ifndef BITMAP_H__
+#define BITMAP_H__
+
+#ifdef __cplusplus
+extern "C" 
+{
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+typedef struct bitmap bitmap_t;
+
+// WARNING: Bit requests outside the bitmap and NULL pointers WILL result in a segfault
+// This was originally a high performance C++ library, so the C translation assumes you're using it right.
+
+// But is there really such a thing as a high-performance shared library?
+
+///
+/// Sets requested bit in bitmap
+/// \param bitmap The bitmap
+/// \param bit The bit to set
+///
+void bitmap_set(bitmap_t *const bitmap, const size_t bit);
+
+///
+/// Clears requested bit in bitmap
+/// \param bitmap The bitmap
+/// \param bit The bit to clear
+///
+void bitmap_reset(bitmap_t *const bitmap, const size_t bit);
+
+///
+/// Returns bit in bitmap
+/// \param bitmap The bitmap
+/// \param bit The bit to query
+/// \return State of requested bit
+///
+bool bitmap_test(const bitmap_t *const bitmap, const size_t bit);
+
+///
+/// Atomically sets requested bit in bitmap
+///  The atomic calls (bitmap_test_and_set, bitmap_test_and_reset,
+///  bitmap_claim_first_zero, bitmap_claim_range and the range calls) are safe to
+///  make from several threads at once, alongside any of the read-only calls.
+///  The other modifying calls are not.
+/// \param bitmap The bitmap
+/// \param bit The bit to set
+/// \return State of the bit before the call
+///
+bool bitmap_test_and_set(bitmap_t *const bitmap, const size_t bit);
+
+///
+/// Atomically clears requested bit in bitmap
+/// \param bitmap The bitmap
+/// \param bit The bit to clear
+/// \return State of the bit before the call
+///
+bool bitmap_test_and_reset(bitmap_t *const bitmap, const size_t bit);
+
+///
+/// Atomically finds and sets the first zero at or after a starting bit,
+///  wrapping around like bitmap_ffz_from. Lock-free: losing a race for a
+///  bit just moves the search on to the next zero.
+/// \param bitmap The bitmap
+/// \param start The bit to start searching from (out of range means 0)
+/// \return The bit that was claimed, SIZE_MAX on error/not found
+///
+size_t bitmap_claim_first_zero(bitmap_t *const bitmap, const size_t start);
+
+///
+/// Atomically sets a range of bits, but only if all of them are clear
+///  (all or nothing, a word at a time with rollback)
+/// \param bitmap The bitmap
+/// \param start The first bit to claim
+/// \param count The number of bits to claim
+/// \return true if the whole range was claimed, false on error or if any bit was set
+///
+bool bitmap_claim_range(bitmap_t *const bitmap, const size_t start, const size_t count);
+
+///
+/// Flips bit in bitmap
+/// \param bitmap The bitmap
+/// \param bit The bit to flip
+///
+void bitmap_flip(bitmap_t *const bitmap, const size_t bit);
+
+///
+/// Flips all bits in the bitmap
+/// \param bitmap The bitmap to invert
+///
+void bitmap_invert(bitmap_t *const bitmap);
+
+///
+/// Find first set
+/// \param bitmap The bitmap
+/// \return The first one bit address, SIZE_MAX on error/not found
+///
+size_t bitmap_ffs(const bitmap_t *const bitmap);
+
+///
+/// Find first zero
+/// \param bitmap The bitmap
+/// \return The first zero bit address, SIZE_MAX on error/not found
+///
+size_t bitmap_ffz(const bitmap_t *const bitmap);
+
+///
+/// Find first zero at or after a starting bit, wrapping around to the
+///  start of the bitmap if there is none past it
+/// \param bitmap The bitmap
+/// \param start The bit to start searching from (out of range means 0)
+/// \return The first zero bit address, SIZE_MAX on error/not found
+///
+size_t bitmap_ffz_from(const bitmap_t *const bitmap, const size_t start);
+
+///
+/// Find the first run of count zero bits starting at or after start
+///  (does not wrap around)
+/// \param bitmap The bitmap
+/// \param start The bit to start searching from
+/// \param count The length of the run
+/// \return The address of the first bit of the run, SIZE_MAX on error/not found
+///
+size_t bitmap_find_zero_run(const bitmap_t *const bitmap, const size_t start, const size_t count);
+
+///
+/// Sets a range of bits in bitmap, a word at a time
+///  (each word atomically; ranges that don't fit in the bitmap are ignored)
+/// \param bitmap The bitmap
+/// \param start The first bit to set
+/// \param count The number of bits to set
+///
+void bitmap_set_range(bitmap_t *const bitmap, const size_t start, const size_t count);
+
+///
+/// Clears a range of bits in bitmap, a word at a time
+///  (each word atomically; ranges that don't fit in the bitmap are ignored)
+/// \param bitmap The bitmap
+/// \param start The first bit to clear
+/// \param count The number of bits to clear
+///
+void bitmap_reset_range(bitmap_t *const bitmap, const size_t start, const size_t count);
+
+///
+/// Count all bits set
+///  (constant time, the count is kept up to date as bits change)
+/// \param bitmap the bitmap
+/// \return the total number of bits that are set in the bitmap
+///
+size_t bitmap_total_set(const bitmap_t *const bitmap);
+///
+/// For each loop for all set bits
+///  (Arguments passed to func are saved across calls)
+/// \param bitmap The bitmap
+/// \param func The function to apply (first parameter will be size_t with the bit number)
+/// \param args A generic pointer to pass to the called function
+///
+void bitmap_for_each(const bitmap_t *const bitmap, void (*func)(size_t, void *), void *arg);
+
+///
+/// Resets bitmap contents to the desired pattern
+/// (pattern not guarenteed accurate for final bits
+/// 		if bit_count is not a multiple of 8)
+/// \param bitmap The bitmap
+/// \param pattern The pattern to apply to all bytes
+///
+void bitmap_format(bitmap_t *const bitmap, const uint8_t pattern);
+
+///
+/// Gets total number of bits in bitmap
+/// \param bitmap The bitmap
+/// \return The number of bits in the bitmap
+///
+size_t bitmap_get_bits(const bitmap_t *const bitmap);
+
+///
+/// Gets total number of bytes in bitmap
+/// \param bitmap The bitmap
+/// \return number of bytes used by bitmap storage array
+///
+size_t bitmap_get_bytes(const bitmap_t *const bitmap);
+
+///
+/// Creates a bitmap to contain n bits (zero initialized)
+/// \param n_bits
+/// \return New bitmap pointer, NULL on error
+///
+bitmap_t *bitmap_create(const size_t n_bits);
+
+///
+/// Gets pointer to the internal data for exporting
+///  Be sure to query the bit and byte size if it's unknown
+/// \param bitmap The bitmap
+/// \return Pointer for writing
+///
+const uint8_t *bitmap_export(const bitmap_t *const bitmap);
+
+///
+/// Creates a new bitmap with the provided data
+/// Note: This does not use the buffer but copies the data
+///  to an internal buffer
+/// \param n_bits The number of bits in the bitmap
+/// \param bitmap_data The data to import
+/// \return New bitmap pointer, NULL on error
+///
+bitmap_t *bitmap_import(const size_t n_bits, const void *const bitmap_data);
+
+///
+/// Creates a new bitmap using the provided data
+/// Note: This uses the given block of memory
+///  and does not free this pointer on destruction
+///  The memory must be 8-byte aligned and padded out to a whole number of
+///  64-bit words; any padding bits past n_bits are cleared
+///  Changes made to the memory directly (not through this API) are not
+///  reflected in bitmap_total_set or the summary levels
+/// \param n_bits The number of bits in the bitmap
+/// \param bitmap_data The data to import
+/// \return New bitmap pointer, NULL on error
+///
+bitmap_t *bitmap_overlay(const size_t n_bits, void *const bitmap_data);
+
+///
+/// Adds summary levels on top of the bitmap, one bit per word below saying
+///  whether that word is full or empty. bitmap_ffs/bitmap_ffz then take
+///  O(log64 n) instead of O(n). The levels are maintained by every modifying
+///  call and are not part of the exported data.
+/// \param bitmap The bitmap
+/// \return true on success (or if already enabled), false on error
+///
+bool bitmap_enable_summary(bitmap_t *const bitmap);
+
+///
+/// Destructs and destroys bitmap object
+/// \param bitmap The bitmap
+///
+void bitmap_destroy(bitmap_t *bitmap);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,122 +1,466 @@
-#ifndef BLOCK_STORAGE_H__
-#define BLOCK_STORAGE_H__
-
-#ifdef __cplusplus
-extern "C" 
-{
-#endif
-
-#include <stdlib.h>
-#include <stdbool.h>
-
-// Constants
-#define BITMAP_SIZE_BYTES 32         //  
-#define BLOCK_STORE_NUM_BLOCKS 256   // 2^ blocks. 
-#define BLOCK_STORE_AVAIL_BLOCKS (BLOCK_STORE_NUM_BLOCKS - 1) // First block consumed by the FBM
-#define BLOCK_SIZE_BYTES 256         // 2^8 BYTES per block
-#define BLOCK_SIZE_BITS (BLOCK_SIZE_BYTES*8)
-#define BLOCK_STORE_NUM_BYTES (BLOCK_STORE_NUM_BLOCKS * BLOCK_SIZE_BYTES)
-
-
-
-	// Declaring the struct but not implementing in the header allows us to prevent users
-	// from using the object directly and monkeying with the contents
-	// They can only create pointers to the struct, which must be given out by us
-	// This enforces a black box device, but it can be restricting
-	typedef struct block_store block_store_t;
-
-	///
-	/// This creates a new BS device, ready to go
-	/// \return Pointer to a new block storage device, NULL on error
-	///
-	block_store_t *block_store_create();
-
-	///
-	/// Destroys the provided block storage device
-	/// This is an idempotent operation, so there is no return value
-	/// \param bs BS device
-	///
-	void block_store_destroy(block_store_t *const bs);
-
-	///
-	/// Searches for a free block, marks it as in use, and returns the block's id
-	/// \param bs BS device
-	/// \return Allocated block's id, SIZE_MAX on error
-	///
-	size_t block_store_allocate(block_store_t *const bs);
-
-	///
-	/// Attempts to allocate the requested block id
-	/// \param bs the block store object
-	/// \block_id the requested block identifier
-	/// \return boolean indicating succes of operation
-	///
-	bool block_store_request(block_store_t *const bs, const size_t block_id);
-
-	///
-	/// Frees the specified block
-	/// \param bs BS device
-	/// \param block_id The block to free
-	///
-	void block_store_release(block_store_t *const bs, const size_t block_id);
-
-	///
-	/// Counts the number of blocks marked as in use
-	/// \param bs BS device
-	/// \return Total blocks in use, SIZE_MAX on error
-	///
-	size_t block_store_get_used_blocks(const block_store_t *const bs);
-
-	///
-	/// Counts the number of blocks marked free for use
-	/// \param bs BS device
-	/// \return Total blocks free, SIZE_MAX on error
-	///
-	size_t block_store_get_free_blocks(const block_store_t *const bs);
-
-	///
-	/// Returns the total number of user-addressable blocks
-	///  (since this is constant, you don't even need the bs object)
-	/// \return Total blocks
-	///
-	size_t block_store_get_total_blocks();
-
-	///
-	/// Reads data from the specified block and writes it to the designated buffer
-	/// \param bs BS device
-	/// \param block_id Source block id
-	/// \param buffer Data buffer to write to
-	/// \return Number of bytes read, 0 on error
-	///
-	size_t block_store_read(const block_store_t *const bs, const size_t block_id, void *buffer);
-
-	///
-	/// Reads data from the specified buffer and writes it to the designated block
-	/// \param bs BS device
-	/// \param block_id Destination block id
-	/// \param buffer Data buffer to read from
-	/// \return Number of bytes written, 0 on error
-	///
-	size_t block_store_write(block_store_t *const bs, const size_t block_id, const void *buffer);
-
-	///
-	/// Imports BS device from the given file - for grads/bonus
-	/// \param filename The file to load
-	/// \return Pointer to new BS device, NULL on error
-	///
-	block_store_t *block_store_deserialize(const char *const filename);
-
-	///
-	/// Writes the entirety of the BS device to file, overwriting it if it exists - for grads/bonus
-	/// \param bs BS device
-	/// \param filename The file to write to
-	/// \return Number of bytes written, 0 on error
-	///
-	size_t block_store_serialize(const block_store_t *const bs, const char *const filename);
-
-#ifdef __cplusplus
-}
-#endif
-
-
-#endif
+#ifndef BLOCK_STORAGE_H__
+#define BLOCK_STORAGE_H__
+
+#ifdef __cplusplus
+extern "C" 
+{
+#endif
+
+#include <stdlib.h>
+#include <stdbool.h>
+
+// Constants
+#define BITMAP_SIZE_BYTES 32         //  
+#define BLOCK_STORE_NUM_BLOCKS 256   // 2^ blocks. 
+#define BLOCK_STORE_AVAIL_BLOCKS (BLOCK_STORE_NUM_BLOCKS - 1) // Last block consumed by the FBM
+#define BLOCK_SIZE_BYTES 256         // 2^8 BYTES per block
+#define BLOCK_SIZE_BITS (BLOCK_SIZE_BYTES*8)
+#define BLOCK_STORE_NUM_BYTES (BLOCK_STORE_NUM_BLOCKS * BLOCK_SIZE_BYTES)
+
+// Geometry limits for block_store_create_ex
+// (block sizes must also be a power of two)
+#define BLOCK_STORE_MIN_BLOCK_SIZE 256
+#define BLOCK_STORE_MAX_BLOCK_SIZE 65536  // 64 KiB
+#define BLOCK_STORE_MAX_NUM_BLOCKS (1UL << 26) // 64M blocks
+
+// Largest per-thread cache, see block_store_set_thread_cache
+#define BLOCK_STORE_MAX_THREAD_CACHE 4096
+
+
+
+	// Declaring the struct but not implementing in the header allows us to prevent users
+	// from using the object directly and monkeying with the contents
+	// They can only create pointers to the struct, which must be given out by us
+	// This enforces a black box device, but it can be restricting
+	typedef struct block_store block_store_t;
+
+	// Every function taking a store is safe to call from several threads at once, 
+	// apart from create/destroy and the setup-only setters block_store_set_thread_cache 
+	// and block_store_set_dedup, which need the store to themselves. Pinned payload 
+	// pointers are not synchronized.
+
+	// How block_store_allocate picks among the free blocks
+	typedef enum 
+	{
+		BLOCK_STORE_FIRST_FIT = 0,  // Lowest free id (the default)
+		BLOCK_STORE_NEXT_FIT        // First free id after the previous allocation, wrapping around
+	} block_store_alloc_policy_t;
+
+	// What the caller intends to do with a pinned block
+	typedef enum 
+	{
+		BLOCK_STORE_PIN_READ = 0,  // Only looks at the payload
+		BLOCK_STORE_PIN_WRITE      // May modify the payload in place
+	} block_store_pin_mode_t;
+
+	// Options for block_store_serialize_ex, or'd together
+	typedef enum 
+	{
+		BLOCK_STORE_SERIALIZE_SPARSE = 0x1,    // Free blocks are left as holes instead of written out
+		BLOCK_STORE_SERIALIZE_CHECKSUMS = 0x2, // A CRC32C of every block in use (and the FBM) follows the image
+		BLOCK_STORE_SERIALIZE_COMPRESSED = 0x4 // Blocks are run-length encoded and free ones left out (sparse doesn't apply)
+	} block_store_serialize_flags_t;
+
+	///
+	/// This creates a new BS device, ready to go
+	/// \return Pointer to a new block storage device, NULL on error
+	///
+	block_store_t *block_store_create();
+
+	///
+	/// This creates a new BS device with the requested geometry
+	///  The FBM is kept in the last block(s) of the device, so slightly fewer
+	///  than num_blocks will be available (see block_store_get_total_blocks_ex)
+	/// \param num_blocks Total number of blocks in the device, FBM included
+	/// \param block_size Bytes per block, a power of two between
+	///  BLOCK_STORE_MIN_BLOCK_SIZE and BLOCK_STORE_MAX_BLOCK_SIZE
+	/// \return Pointer to a new block storage device, NULL on error
+	///
+	block_store_t *block_store_create_ex(const size_t num_blocks, const size_t block_size);
+
+	///
+	/// Destroys the provided block storage device
+	/// This is an idempotent operation, so there is no return value
+	/// \param bs BS device
+	///
+	void block_store_destroy(block_store_t *const bs);
+
+	///
+	/// Searches for a free block, marks it as in use, and returns the block's id
+	/// \param bs BS device
+	/// \return Allocated block's id, SIZE_MAX on error
+	///
+	size_t block_store_allocate(block_store_t *const bs);
+
+	///
+	/// Searches for a free block at or after the hint (wrapping around),
+	///  marks it as in use, and returns the block's id
+	///  Handy for keeping blocks of one file or tree close together
+	/// \param bs BS device
+	/// \param hint The block id to start looking from
+	/// \return Allocated block's id, SIZE_MAX on error
+	///
+	size_t block_store_allocate_near(block_store_t *const bs, const size_t hint);
+
+	///
+	/// Selects the policy block_store_allocate uses to pick a free block
+	/// \param bs BS device
+	/// \param policy The allocation policy
+	///
+	void block_store_set_alloc_policy(block_store_t *const bs, const block_store_alloc_policy_t policy);
+
+	///
+	/// Puts per-thread caches of free block ids in front of block_store_allocate 
+	///  and block_store_release, so small allocate/release cycles don't all hit the
+	///  shared FBM. Caches refill from and drain back to the FBM half a cache at a time.
+	///  Cached blocks still count as free. Not safe to call while other threads use the store.
+	///  Not available for block_store_open_mmap devices: cached blocks are still marked in the
+	///  FBM, and the file would be left with them in use if the process died.
+	/// \param bs BS device
+	/// \param capacity Blocks each cache can hold (at most BLOCK_STORE_MAX_THREAD_CACHE), 0 to turn caching off
+	/// \return true on success, false on error or for an open_mmap device
+	///
+	bool block_store_set_thread_cache(block_store_t *const bs, const size_t capacity);
+
+	///
+	/// Attempts to allocate the requested block id
+	/// \param bs the block store object
+	/// \block_id the requested block identifier
+	/// \return boolean indicating succes of operation
+	///
+	bool block_store_request(block_store_t *const bs, const size_t block_id);
+
+	///
+	/// Frees the specified block
+	/// \param bs BS device
+	/// \param block_id The block to free
+	///
+	void block_store_release(block_store_t *const bs, const size_t block_id);
+
+	///
+	/// Searches for count adjacent free blocks, marks them as in use,
+	///  and returns the id of the first one
+	/// \param bs BS device
+	/// \param count Number of blocks in the extent
+	/// \param first_id Where to store the first block's id
+	/// \return boolean indicating success of operation
+	///
+	bool block_store_allocate_extent(block_store_t *const bs, const size_t count, size_t *const first_id);
+
+	///
+	/// Frees count adjacent blocks starting with first_id
+	/// \param bs BS device
+	/// \param first_id The first block to free
+	/// \param count Number of blocks to free
+	///
+	void block_store_release_extent(block_store_t *const bs, const size_t first_id, const size_t count);
+
+	///
+	/// Allocates n free blocks in one pass over the FBM, picking them the same
+	///  way n calls to block_store_allocate would
+	///  Nothing is allocated unless all n can be
+	/// \param bs BS device
+	/// \param n Number of blocks to allocate
+	/// \param ids_out Array of at least n entries that receives the block ids
+	/// \return Number of blocks allocated (n, or 0 on error)
+	///
+	size_t block_store_allocate_many(block_store_t *const bs, const size_t n, size_t *const ids_out);
+
+	///
+	/// Attempts to allocate all of the requested block ids
+	///  Nothing is allocated unless all of them can be
+	/// \param bs BS device
+	/// \param ids The requested block ids
+	/// \param n Number of ids
+	/// \return boolean indicating success of operation
+	///
+	bool block_store_request_many(block_store_t *const bs, const size_t *const ids, const size_t n);
+
+	///
+	/// Frees all of the given blocks
+	/// \param bs BS device
+	/// \param ids The blocks to free
+	/// \param n Number of ids
+	///
+	void block_store_release_many(block_store_t *const bs, const size_t *const ids, const size_t n);
+
+	///
+	/// Counts the number of blocks marked as in use
+	/// \param bs BS device
+	/// \return Total blocks in use, SIZE_MAX on error
+	///
+	size_t block_store_get_used_blocks(const block_store_t *const bs);
+
+	///
+	/// Counts the number of blocks marked free for use
+	/// \param bs BS device
+	/// \return Total blocks free, SIZE_MAX on error
+	///
+	size_t block_store_get_free_blocks(const block_store_t *const bs);
+
+	///
+	/// Returns the total number of user-addressable blocks
+	///  (since this is constant, you don't even need the bs object)
+	/// \return Total blocks
+	///
+	size_t block_store_get_total_blocks();
+
+	///
+	/// Returns the total number of user-addressable blocks of the given device
+	/// \param bs BS device
+	/// \return Total blocks, SIZE_MAX on error
+	///
+	size_t block_store_get_total_blocks_ex(const block_store_t *const bs);
+
+	///
+	/// Returns the size of each block of the given device
+	/// \param bs BS device
+	/// \return Bytes per block, 0 on error
+	///
+	size_t block_store_get_block_size(const block_store_t *const bs);
+
+	///
+	/// Reads data from the specified block and writes it to the designated buffer
+	///  Blocks loaded from an image with checksums are checked against them the first time they're read
+	/// \param bs BS device
+	/// \param block_id Source block id
+	/// \param buffer Data buffer to write to
+	/// \return Number of bytes read, 0 on error or if the block failed its checksum
+	///
+	size_t block_store_read(const block_store_t *const bs, const size_t block_id, void *buffer);
+
+	///
+	/// Reads data from the specified buffer and writes it to the designated block
+	/// \param bs BS device
+	/// \param block_id Destination block id
+	/// \param buffer Data buffer to read from
+	/// \return Number of bytes written, 0 on error
+	///
+	size_t block_store_write(block_store_t *const bs, const size_t block_id, const void *buffer);
+
+	///
+	/// Reads part of the specified block into the designated buffer
+	/// \param bs BS device
+	/// \param block_id Source block id
+	/// \param offset Byte offset within the block to start at
+	/// \param len Number of bytes to read, offset + len must not exceed the block size
+	/// \param buffer Data buffer to write to
+	/// \return Number of bytes read, 0 on error
+	///
+	size_t block_store_pread(const block_store_t *const bs, const size_t block_id, const size_t offset, const size_t len, void *buffer);
+
+	///
+	/// Writes the designated buffer to part of the specified block, leaving the rest alone
+	/// \param bs BS device
+	/// \param block_id Destination block id
+	/// \param offset Byte offset within the block to start at
+	/// \param len Number of bytes to write, offset + len must not exceed the block size
+	/// \param buffer Data buffer to read from
+	/// \return Number of bytes written, 0 on error
+	///
+	size_t block_store_pwrite(block_store_t *const bs, const size_t block_id, const size_t offset, const size_t len, const void *buffer);
+
+	///
+	/// Reads a list of blocks into one contiguous buffer, block ids[i] landing at
+	///  buffer + i * block size. Runs of adjacent ids are copied in one go.
+	/// \param bs BS device
+	/// \param ids Source block ids
+	/// \param n Number of ids
+	/// \param buffer Data buffer of at least n blocks to write to
+	/// \return Number of bytes read, 0 on error
+	///
+	size_t block_store_readv(const block_store_t *const bs, const size_t *const ids, const size_t n, void *buffer);
+
+	///
+	/// Writes one contiguous buffer out to a list of blocks, buffer + i * block size
+	///  going to block ids[i]. Runs of adjacent ids are copied in one go.
+	/// \param bs BS device
+	/// \param ids Destination block ids
+	/// \param n Number of ids
+	/// \param buffer Data buffer of at least n blocks to read from
+	/// \return Number of bytes written, 0 on error
+	///
+	size_t block_store_writev(block_store_t *const bs, const size_t *const ids, const size_t n, const void *buffer);
+
+	///
+	/// Gives direct access to a block's payload, without copying it
+	///  The block can't be released until every pin on it is dropped with
+	///  block_store_unpin. Only modify the payload through a BLOCK_STORE_PIN_WRITE pin.
+	/// \param bs BS device
+	/// \param block_id The block to pin, must be in use
+	/// \param mode Whether the payload will be read or modified
+	/// \return Pointer to the block's payload (block size bytes), NULL on error
+	///
+	void *block_store_pin(block_store_t *const bs, const size_t block_id, const block_store_pin_mode_t mode);
+
+	///
+	/// Drops one pin taken with block_store_pin
+	///  The pointer it returned must not be used afterwards
+	/// \param bs BS device
+	/// \param block_id The pinned block
+	///
+	void block_store_unpin(block_store_t *const bs, const size_t block_id);
+
+	///
+	/// Imports BS device from the given file - for grads/bonus
+	///  If the image has checksums, the FBM has to match its checksum to load at all
+	///  The FBM is in the last block(s) of the image, zero past its last bit. Images written before
+	///  it moved there (with the FBM in block 127) are the same size but are refused
+	/// \param filename The file to load
+	/// \return Pointer to new BS device, NULL on error
+	///
+	block_store_t *block_store_deserialize(const char *const filename);
+
+	///
+	/// Imports BS device with the given geometry from the given file
+	///  (the image format does not record the geometry, so it must match the one serialized)
+	/// \param filename The file to load
+	/// \param num_blocks Total number of blocks in the device
+	/// \param block_size Bytes per block
+	/// \return Pointer to new BS device, NULL on error
+	///
+	block_store_t *block_store_deserialize_ex(const char *const filename, const size_t num_blocks, const size_t block_size);
+
+	///
+	/// Opens a BS device backed directly by a file mapping. The file uses the same
+	///  image format as block_store_serialize, payloads are served from the mapping
+	///  and the FBM is read and updated in place, so opening costs the same at any size.
+	///  Changes reach the file as the page cache writes them back, or on block_store_sync
+	///  Existing images are checked the same way as by block_store_deserialize
+	/// \param filename The device file
+	/// \param create true to create (or wipe) the file as an empty device, false to open an existing image
+	/// \return Pointer to new BS device, NULL on error
+	///
+	block_store_t *block_store_open_mmap(const char *const filename, const bool create);
+
+	///
+	/// Opens a file-backed BS device with the given geometry
+	///  (an existing image must be exactly num_blocks * block_size bytes)
+	/// \param filename The device file
+	/// \param create true to create (or wipe) the file as an empty device, false to open an existing image
+	/// \param num_blocks Total number of blocks in the device
+	/// \param block_size Bytes per block
+	/// \return Pointer to new BS device, NULL on error
+	///
+	block_store_t *block_store_open_mmap_ex(const char *const filename, const bool create, const size_t num_blocks, const size_t block_size);
+
+	///
+	/// Writes a file-backed BS device's changes out to its file and waits for them
+	/// \param bs BS device
+	/// \return true on success, false on error or if the device isn't file-backed
+	///
+	bool block_store_sync(block_store_t *const bs);
+
+	///
+	/// When a file-backed BS device's background writeback kicks in. Either limit can be 0 for none
+	///
+	typedef struct
+	{
+		size_t max_dirty_blocks;  // Write back once this many blocks are dirty
+		unsigned max_age_ms;      // Write back at least this often while anything is dirty
+	} block_store_writeback_policy_t;
+
+	///
+	/// Starts, retunes or stops a worker thread that writes a file-backed BS device's dirty blocks back to
+	/// its file in the background, so they're on disk without anyone waiting on a sync
+	/// \param bs BS device
+	/// \param policy When to write back, NULL or no limits at all stops the worker
+	/// \return true on success, false on error or if the device isn't file-backed
+	///
+	bool block_store_set_writeback_policy(block_store_t *const bs, const block_store_writeback_policy_t *const policy);
+
+	///
+	/// Writes back everything dirtied on a file-backed BS device so far and waits for it to reach the file
+	/// \param bs BS device
+	/// \return true on success, false on error or if the device isn't file-backed
+	///
+	bool block_store_barrier(block_store_t *const bs);
+
+	///
+	/// Turns a file-backed BS device's write-ahead journal (<device file>.journal) on or off. While it's on,
+	/// writes only return once they're logged and the log is on disk, with concurrent writers sharing a
+	/// single sync; allocations and releases are logged too and are on disk once a later write or sync is.
+	/// Whatever is in the journal is redone when the device is next opened, so a crash never loses a write
+	/// that returned. Writes through a pin are logged when the block's last pin goes.
+	/// block_store_sync (and background writeback) empty the journal once the file has caught up with it
+	/// \param bs BS device
+	/// \param enable Whether to journal from here on
+	/// \return true on success, false on error or if the device isn't file-backed
+	///
+	bool block_store_set_journal(block_store_t *const bs, const bool enable);
+
+	///
+	/// Turns content-addressed deduplication on or off for an in-memory BS device. While it's on, blocks
+	/// written with identical contents share one copy of the payload, which a later write to any of them
+	/// leaves for a copy of its own. Compressed images store each shared payload once. Only devices whose
+	/// blocks are at least a page can deduplicate, smaller blocks share pages that can't be given back.
+	/// Not safe to call while other threads use the device
+	/// \param bs BS device
+	/// \param enable Whether to deduplicate from here on
+	/// \return true on success, false on error, if the device is file-backed or its blocks are smaller than a page
+	///
+	bool block_store_set_dedup(block_store_t *const bs, const bool enable);
+
+	///
+	/// Counts the copies of block contents the BS device holds for itself: the blocks in use, less
+	/// those sharing theirs through deduplication or with a snapshot or clone, plus each deduplicated copy
+	/// \param bs BS device
+	/// \return Payload copies held, SIZE_MAX on error
+	///
+	size_t block_store_get_payload_copies(const block_store_t *const bs);
+
+	///
+	/// Takes a read-only point-in-time view of an in-memory BS device. The view shares every block's
+	/// contents with the device, and a block is only copied once the device writes it. The view can
+	/// be read, serialized and flushed, but not changed; destroy it when done
+	/// \param bs BS device
+	/// \return Pointer to the new view, NULL on error, if the device is file-backed or any block is pinned
+	///
+	block_store_t *block_store_snapshot(block_store_t *const bs);
+
+	///
+	/// Forks an in-memory BS device into a new writable one with the same blocks. The two share the
+	/// contents of every block until one of them writes it, and are independent of each other after that
+	/// \param bs BS device
+	/// \return Pointer to the new BS device, NULL on error, if the device is file-backed or any block is pinned
+	///
+	block_store_t *block_store_clone(block_store_t *const bs);
+
+	///
+	/// Writes the entirety of the BS device to file, overwriting it if it exists - for grads/bonus
+	/// \param bs BS device
+	/// \param filename The file to write to
+	/// \return Number of bytes written, 0 on error
+	///
+	size_t block_store_serialize(const block_store_t *const bs, const char *const filename);
+
+	///
+	/// Writes the entirety of the BS device to file with the given options
+	///  A sparse image only takes disk space for the blocks in use; free blocks
+	///  read back as zeros instead of '0's. Checksums go after the image. A compressed image has its
+	///  own format, blocks in it still decompress one at a time. block_store_deserialize loads them all
+	/// \param bs BS device
+	/// \param filename The file to write to
+	/// \param flags block_store_serialize_flags_t values or'd together, 0 for a plain image
+	/// \return Number of bytes written, 0 on error
+	///
+	size_t block_store_serialize_ex(const block_store_t *const bs, const char *const filename, const unsigned flags);
+
+	///
+	/// Brings an image written earlier up to date by writing only the blocks changed
+	///  since the device was loaded from it or last flushed to it, plus the FBM. Any other
+	///  file (a new or empty one, or an image the device didn't come from) gets the full image, as does
+	///  every flush of a device opened with block_store_open_mmap, whose own file sync and writeback look after.
+	///  Checksums after the image are dropped, they would be out of date. Compressed images can't be flushed to
+	/// \param bs BS device
+	/// \param filename The image to update, created if it doesn't exist
+	/// \return Number of bytes written, 0 on error
+	///
+	size_t block_store_flush(block_store_t *const bs, const char *const filename);
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif
@@ -1,16 +1,40 @@
 #include "bitmap.h"
+#include "bitmap_simd.h"
 #include <string.h>
 
-// Just the one for now. Indicates we're an overlay and should not free
+// OVERLAY indicates we're an overlay and should not free
+// SUMMARY indicates the summary levels are allocated and kept up to date
 // (also, make sure that ALL is as wide as ll of the flags)
-typedef enum { NONE = 0x00, OVERLAY = 0x01, ALL = 0xFF } BITMAP_FLAGS;
+typedef enum { NONE = 0x00, OVERLAY = 0x01, SUMMARY = 0x02, ALL = 0xFF } BITMAP_FLAGS;
+
+// 64^10 words is more bits than a size_t can address, so this is plenty
+#define SUMMARY_MAX_LEVELS 10
+
+// The data is stored as native 64-bit words so scans can skip a whole word at a time.
+// Word w holds bits [64w, 64w + 63], lowest bit first. On a little-endian host that is
+// byte-for-byte the same layout as the old uint8_t array, so export/import/overlay
+// keep their byte-level format for free.
+#if !defined(__BYTE_ORDER__) || __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "bitmap word storage assumes a little-endian host"
+#endif
 
 struct bitmap 
 {
     unsigned leftover_bits;  // Packing will increase this to an int anyway
     BITMAP_FLAGS flags;      // Generic place to store flags. Not enough flags to worry about width yet.
-    uint8_t *data;
-    size_t bit_count, byte_count;
+    uint64_t *data;
+    size_t bit_count, byte_count, word_count;
+    const bitmap_kernels_t *kernels;  // Scalar/SSE4.2/AVX2 word loops, picked at initialize
+    size_t set_count;                 // Bits currently set, kept up to date by every modifying call
+
+    // Optional summary levels (see bitmap_enable_summary). Level 0 is data itself,
+    // level l has one bit per word of level l - 1:
+    //   full[l]:     word below is all ones  (padding bits past the last word are 1)
+    //   nonempty[l]: word below is not zero  (padding bits past the last word are 0)
+    unsigned levels;
+    size_t level_words[SUMMARY_MAX_LEVELS + 1];
+    uint64_t *full[SUMMARY_MAX_LEVELS + 1];
+    uint64_t *nonempty[SUMMARY_MAX_LEVELS + 1];
 };
 
 
@@ -19,84 +43,433 @@ struct bitmap
 // #define FLAG_SET(bitmap, flag) bitmap->flags |= flag
 // #define FLAG_UNSET(bitmap, flag) bitmap->flags &= ~flag
 
-// lookup instead of always shifting bits. Should be faster? Confirmed: 10% faster
-// Also, using native int width because it should be faster as well? - Negligible/indeterminate
-//  Won't help until bitmap uses native width for the array
-static const uint8_t mask[8] = {0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80};
-
-// Mask for all bits at index i and lower
-static const uint8_t mask_down_inclusive[8] = {0x01, 0x03, 0x07, 0x0F, 0x1F, 0x3F, 0x7F, 0xFF};
-
-// Inverted mask
-static const uint8_t invert_mask[8] = {0xFE, 0xFD, 0xFB, 0xF7, 0xEF, 0xDF, 0xBF, 0x7F};
-
-// Way more testing than I should waste my time on suggested uint8_t was faster
-// but it may still be negligible/indeterminate.
-// Since the data store is uint8_t, we already get punished for our bad alignment
-// so this doesn't really matter until everything gets moved to generic int
-
-// Total bits set in the given byte in a handy lookup table
-// Macros, man...
-// http://graphics.stanford.edu/~seander/bithacks.html#CountBitsSetTable
-#define B2(n) n, n + 1, n + 1, n + 2
-#define B4(n) B2(n), B2(n + 1), B2(n + 1), B2(n + 2)
-#define B6(n) B4(n), B4(n + 1), B4(n + 1), B4(n + 2)
-static const uint8_t bit_totals[256] = {B6(0), B6(1), B6(1), B6(2)};
-#undef B6
-#undef B4
-#undef B2
-// There is an alternative for getting bit count that only loops as many times as there are bits set
-// but that's still a loop and this table is 256B.
-/*
-   unsigned int v; // count the number of bits set in v
-   unsigned int c; // c accumulates the total bits set in v
-
-   for (c = 0; v; v >>= 1)
-   {
-   c += v & 1;
-   }
- */
+#define WORD_BITS 64
+#define WORD_INDEX(bit) ((bit) >> 6)
+#define WORD_MASK(bit) (UINT64_C(1) << ((bit) & 0x3F))
+
+// Words can be changed under our feet by the atomic calls, so the searches read
+// them through this. It's a plain load on anything we care about.
+#define LOAD(word) __atomic_load_n(&(word), __ATOMIC_ACQUIRE)
+
+// Mask of the bits in use in the last word. Bits past bit_count are kept at zero
+// at all times so the scans and counts never have to special-case the tail.
+static inline uint64_t tail_mask(const bitmap_t *const bitmap) 
+{
+    const unsigned used = bitmap->bit_count & 0x3F;
+    return used ? (UINT64_C(1) << used) - 1 : ~UINT64_C(0);
+}
+
+// Is data word w full? The padding in the last word counts as set.
+static inline bool data_word_full(const bitmap_t *const bitmap, const size_t w, const uint64_t value) 
+{
+    return (value | (w == bitmap->word_count - 1 ? ~tail_mask(bitmap) : 0)) == ~UINT64_C(0);
+}
+
+// Sets/clears bit c of summary level l (full or nonempty tree) and walks up
+// for as long as the word it lives in changes its own full/empty state.
+static void summary_propagate(const bitmap_t *const bitmap, uint64_t *const *tree, const bool full_tree,
+                              unsigned level, size_t child, bool value) 
+{
+    for (; level <= bitmap->levels; ++level, child >>= 6) 
+    {
+        uint64_t *word = &tree[level][WORD_INDEX(child)];
+        const uint64_t old = *word;
+        *word = value ? old | WORD_MASK(child) : old & ~WORD_MASK(child);
+        const bool was = full_tree ? old == ~UINT64_C(0) : old != 0;
+        const bool now = full_tree ? *word == ~UINT64_C(0) : *word != 0;
+        if (was == now) 
+        {
+            return;
+        }
+        value = now;
+    }
+}
+
+// Called after data word w went from old to new to keep the summary levels in sync
+static inline void summary_update(bitmap_t *const bitmap, const size_t w, const uint64_t old, const uint64_t new) 
+{
+    if (FLAG_CHECK(bitmap, SUMMARY)) 
+    {
+        const bool was_full = data_word_full(bitmap, w, old), now_full = data_word_full(bitmap, w, new);
+        if (was_full != now_full) 
+        {
+            summary_propagate(bitmap, bitmap->full, true, 1, w, now_full);
+        }
+        if ((old != 0) != (new != 0)) 
+        {
+            summary_propagate(bitmap, bitmap->nonempty, false, 1, w, new != 0);
+        }
+    }
+}
+
+// Recomputes every summary level from scratch, for the bulk operations
+static void summary_rebuild(bitmap_t *const bitmap) 
+{
+    if (!FLAG_CHECK(bitmap, SUMMARY)) 
+    {
+        return;
+    }
+    for (unsigned level = 1; level <= bitmap->levels; ++level) 
+    {
+        const size_t children = bitmap->level_words[level - 1];
+        for (size_t w = 0; w < bitmap->level_words[level]; ++w) 
+        {
+            uint64_t full = ~UINT64_C(0), nonempty = 0;
+            for (size_t c = w * WORD_BITS; c < children && c < (w + 1) * WORD_BITS; ++c) 
+            {
+                bool child_full, child_nonempty;
+                if (level == 1) 
+                {
+                    child_full     = data_word_full(bitmap, c, bitmap->data[c]);
+                    child_nonempty = bitmap->data[c] != 0;
+                } 
+                else 
+                {
+                    child_full     = bitmap->full[level - 1][c] == ~UINT64_C(0);
+                    child_nonempty = bitmap->nonempty[level - 1][c] != 0;
+                }
+                full &= child_full ? ~UINT64_C(0) : ~WORD_MASK(c);
+                nonempty |= child_nonempty ? WORD_MASK(c) : 0;
+            }
+            bitmap->full[level][w]     = full;
+            bitmap->nonempty[level][w] = nonempty;
+        }
+    }
+}
+
+// Atomic counterpart of summary_update. Another thread may have moved word w on
+// since we changed it, so rather than trusting old/new, each summary bit is
+// re-derived from what is below it now, then checked again after the write. If
+// it changed meanwhile, whoever changed it is racing us to the same bit, so go
+// round again: the last one to look always leaves it right.
+static void summary_resync(bitmap_t *const bitmap, size_t child) 
+{
+    if (!FLAG_CHECK(bitmap, SUMMARY)) 
+    {
+        return;
+    }
+    for (unsigned level = 1; level <= bitmap->levels; ++level, child >>= 6) 
+    {
+        uint64_t *const full = &bitmap->full[level][WORD_INDEX(child)];
+        uint64_t *const nonempty = &bitmap->nonempty[level][WORD_INDEX(child)];
+        bool changed = false, child_full, child_nonempty, again;
+        do 
+        {
+            if (level == 1) 
+            {
+                const uint64_t value = __atomic_load_n(&bitmap->data[child], __ATOMIC_SEQ_CST);
+                child_full     = data_word_full(bitmap, child, value);
+                child_nonempty = value != 0;
+            } 
+            else 
+            {
+                child_full     = __atomic_load_n(&bitmap->full[level - 1][child], __ATOMIC_SEQ_CST) == ~UINT64_C(0);
+                child_nonempty = __atomic_load_n(&bitmap->nonempty[level - 1][child], __ATOMIC_SEQ_CST) != 0;
+            }
+            const uint64_t old_full = child_full ? __atomic_fetch_or(full, WORD_MASK(child), __ATOMIC_SEQ_CST)
+                                                 : __atomic_fetch_and(full, ~WORD_MASK(child), __ATOMIC_SEQ_CST);
+            const uint64_t old_nonempty = child_nonempty ? __atomic_fetch_or(nonempty, WORD_MASK(child), __ATOMIC_SEQ_CST)
+                                                         : __atomic_fetch_and(nonempty, ~WORD_MASK(child), __ATOMIC_SEQ_CST);
+            const uint64_t new_full = child_full ? old_full | WORD_MASK(child) : old_full & ~WORD_MASK(child);
+            const uint64_t new_nonempty = child_nonempty ? old_nonempty | WORD_MASK(child) : old_nonempty & ~WORD_MASK(child);
+            changed |= (old_full == ~UINT64_C(0)) != (new_full == ~UINT64_C(0)) || (old_nonempty != 0) != (new_nonempty != 0);
+
+            if (level == 1) 
+            {
+                const uint64_t value = __atomic_load_n(&bitmap->data[child], __ATOMIC_SEQ_CST);
+                again = child_full != data_word_full(bitmap, child, value) || child_nonempty != (value != 0);
+            } 
+            else 
+            {
+                again = child_full != (__atomic_load_n(&bitmap->full[level - 1][child], __ATOMIC_SEQ_CST) == ~UINT64_C(0))
+                     || child_nonempty != (__atomic_load_n(&bitmap->nonempty[level - 1][child], __ATOMIC_SEQ_CST) != 0);
+            }
+        } while (again);
+        // Our word of this level kept its own full/empty state, so nothing above needs us
+        if (!changed) 
+        {
+            return;
+        }
+    }
+}
+
+// Finds the first word at or after data word idx that is not full (full_tree)
+// or not empty (!full_tree): climb until some summary word has a candidate
+// to the right of where we are, then walk back down. SIZE_MAX if there is none.
+static size_t summary_next(const bitmap_t *const bitmap, uint64_t *const *tree, const bool full_tree, size_t idx) 
+{
+    unsigned level = 1;
+    for (; level <= bitmap->levels; ++level, idx = (idx >> 6) + 1) 
+    {
+        if (idx >= bitmap->level_words[level - 1]) 
+        {
+            return SIZE_MAX;
+        }
+        uint64_t word = full_tree ? ~LOAD(tree[level][WORD_INDEX(idx)]) : LOAD(tree[level][WORD_INDEX(idx)]);
+        word &= ~UINT64_C(0) << (idx & 0x3F);
+        if (word) 
+        {
+            idx = (idx & ~(size_t) 0x3F) + __builtin_ctzll(word);
+            break;
+        }
+    }
+    if (level > bitmap->levels) 
+    {
+        return SIZE_MAX;
+    }
+    // idx now names a qualifying word of level - 1. Under concurrent updates the 
+    // summary can briefly point at a word that no longer qualifies; the caller
+    // copes with a miss, but don't walk off the end of a word that's gone blank.
+    for (--level; level > 0; --level) 
+    {
+        const uint64_t word = full_tree ? ~LOAD(tree[level][idx]) : LOAD(tree[level][idx]);
+        idx = idx * WORD_BITS + (word ? __builtin_ctzll(word) : 0);
+    }
+    return idx;
+}
+
+// First bit at or after start (which must be in range) that is set (want_set)
+// or clear (!want_set), bit_count if there is none. Doesn't wrap.
+static size_t next_bit(const bitmap_t *const bitmap, const size_t start, const bool want_set) 
+{
+    // XOR with flip turns "looking for a zero" into "looking for a one"
+    const uint64_t flip = want_set ? 0 : ~UINT64_C(0);
+    const size_t first = WORD_INDEX(start);
+    const uint64_t bits = (LOAD(bitmap->data[first]) ^ flip) & (~UINT64_C(0) << (start & 0x3F));
+    size_t word = first;
+    if (!bits) 
+    {
+        // Rest of the starting word is no good, go through whole words up to the end
+        if (FLAG_CHECK(bitmap, SUMMARY)) 
+        {
+            word = summary_next(bitmap, want_set ? bitmap->nonempty : bitmap->full, !want_set, first + 1);
+        } 
+        else 
+        {
+            const size_t rest = bitmap->word_count - first - 1;
+            const size_t found = want_set ? bitmap->kernels->find_nonzero(bitmap->data + first + 1, rest)
+                                          : bitmap->kernels->find_nonfull(bitmap->data + first + 1, rest);
+            word = (found < rest ? first + 1 + found : SIZE_MAX);
+        }
+        if (word == SIZE_MAX) 
+        {
+            return bitmap->bit_count;
+        }
+    }
+    const uint64_t hit = (word == first ? bits : LOAD(bitmap->data[word]) ^ flip);
+    if (!hit) 
+    {
+        // Raced with an atomic update that emptied/filled the word after the summary 
+        // sent us there, just look again past it
+        return (word + 1 < bitmap->word_count ? next_bit(bitmap, (word + 1) * WORD_BITS, want_set) : bitmap->bit_count);
+    }
+    const size_t result = word * WORD_BITS + __builtin_ctzll(hit);
+    // The zero padding in the last word can look like a hit when hunting for zeros
+    return (result < bitmap->bit_count ? result : bitmap->bit_count);
+}
 
 // A place to generalize the creation process and setup
 bitmap_t *bitmap_initialize(size_t n_bits, BITMAP_FLAGS flags);
 
+// The count is read without any lock held (e.g. by a block store's free block query), 
+// so it's only ever touched atomically. Relaxed is enough, it's a statistic.
+static inline void count_add(bitmap_t *const bitmap, const size_t delta) 
+{
+    __atomic_fetch_add(&bitmap->set_count, delta, __ATOMIC_RELAXED);
+}
+
+static inline void count_store(bitmap_t *const bitmap, const size_t count) 
+{
+    __atomic_store_n(&bitmap->set_count, count, __ATOMIC_RELAXED);
+}
+
+// Recounts after a bulk change
+static inline void recount(bitmap_t *const bitmap) 
+{
+    count_store(bitmap, bitmap->kernels->popcount(bitmap->data, bitmap->word_count));
+}
+
+// Mask of the bits of [bit, end) that live in bit's word
+static inline uint64_t range_mask(const size_t bit, const size_t end) 
+{
+    const size_t lo = bit & 0x3F, hi = (end - bit < WORD_BITS - lo ? lo + (end - bit) : WORD_BITS);
+    return (hi == WORD_BITS ? ~UINT64_C(0) : (UINT64_C(1) << hi) - 1) & (~UINT64_C(0) << lo);
+}
+
+// Sets or clears [start, start + count) a word at a time
+static void change_range(bitmap_t *const bitmap, const size_t start, const size_t count, const bool set) 
+{
+    if (!bitmap || start >= bitmap->bit_count || count > bitmap->bit_count - start) 
+    {
+        return;
+    }
+    const size_t end = start + count;
+    for (size_t bit = start; bit < end; bit = (WORD_INDEX(bit) + 1) * WORD_BITS) 
+    {
+        const size_t w = WORD_INDEX(bit);
+        const uint64_t mask = range_mask(bit, end);
+        const uint64_t old = set ? __atomic_fetch_or(&bitmap->data[w], mask, __ATOMIC_ACQ_REL)
+                                 : __atomic_fetch_and(&bitmap->data[w], ~mask, __ATOMIC_ACQ_REL);
+        const uint64_t new = set ? old | mask : old & ~mask;
+        if (old != new) 
+        {
+            count_add(bitmap, (size_t) __builtin_popcountll(new) - (size_t) __builtin_popcountll(old));
+            summary_resync(bitmap, w);
+        }
+    }
+}
+
 void bitmap_set(bitmap_t *const bitmap, const size_t bit) 
 {
-    bitmap->data[bit >> 3] |= mask[bit & 0x07];
+    const size_t w = WORD_INDEX(bit);
+    const uint64_t old = bitmap->data[w];
+    if (!(old & WORD_MASK(bit))) 
+    {
+        bitmap->data[w] = old | WORD_MASK(bit);
+        count_add(bitmap, 1);
+        summary_update(bitmap, w, old, bitmap->data[w]);
+    }
 }
 
 void bitmap_reset(bitmap_t *const bitmap, const size_t bit) 
 {
-    bitmap->data[bit >> 3] &= invert_mask[bit & 0x07];
+    const size_t w = WORD_INDEX(bit);
+    const uint64_t old = bitmap->data[w];
+    if (old & WORD_MASK(bit)) 
+    {
+        bitmap->data[w] = old & ~WORD_MASK(bit);
+        count_add(bitmap, (size_t) -1);
+        summary_update(bitmap, w, old, bitmap->data[w]);
+    }
 }
 
 bool bitmap_test(const bitmap_t *const bitmap, const size_t bit) 
 {
-    return bitmap->data[bit >> 3] & mask[bit & 0x07];
+    return LOAD(bitmap->data[WORD_INDEX(bit)]) & WORD_MASK(bit);
 }
 
-void bitmap_flip(bitmap_t *const bitmap, const size_t bit) 
+bool bitmap_test_and_set(bitmap_t *const bitmap, const size_t bit) 
 {
-    bitmap->data[bit >> 3] ^= mask[bit & 0x07];
+    const size_t w = WORD_INDEX(bit);
+    const uint64_t old = __atomic_fetch_or(&bitmap->data[w], WORD_MASK(bit), __ATOMIC_ACQ_REL);
+    if (old & WORD_MASK(bit)) 
+    {
+        return true;
+    }
+    count_add(bitmap, 1);
+    summary_resync(bitmap, w);
+    return false;
 }
 
-void bitmap_invert(bitmap_t *const bitmap) 
+bool bitmap_test_and_reset(bitmap_t *const bitmap, const size_t bit) 
 {
-    for (size_t byte = 0; byte < bitmap->byte_count; ++byte) 
+    const size_t w = WORD_INDEX(bit);
+    const uint64_t old = __atomic_fetch_and(&bitmap->data[w], ~WORD_MASK(bit), __ATOMIC_ACQ_REL);
+    if (!(old & WORD_MASK(bit))) 
     {
-        bitmap->data[byte] = ~bitmap->data[byte];
+        return false;
     }
+    count_add(bitmap, (size_t) -1);
+    summary_resync(bitmap, w);
+    return true;
 }
 
-size_t bitmap_ffs(const bitmap_t *const bitmap) 
+size_t bitmap_claim_first_zero(bitmap_t *const bitmap, const size_t start) 
 {
-    if (bitmap) 
+    if (!bitmap) 
+    {
+        return SIZE_MAX;
+    }
+    const size_t first = (start < bitmap->bit_count ? start : 0);
+    // One pass from first to the end, then one from 0 back up to first
+    size_t pos = first, end = bitmap->bit_count;
+    for (;;) 
     {
-        size_t result = 0;
-        for (; result < bitmap->bit_count && !bitmap_test(bitmap, result); ++result) 
+        const size_t bit = (pos < end ? next_bit(bitmap, pos, false) : end);
+        if (bit >= end) 
+        {
+            if (end != bitmap->bit_count || first == 0) 
+            {
+                return SIZE_MAX;
+            }
+            pos = 0;
+            end = first;
+            continue;
+        }
+        // Try for it. If somebody beat us to it, the CAS hands back the word as it is
+        // now, so keep trying any other zeros in it before going back to the search.
+        const size_t w = WORD_INDEX(bit);
+        const uint64_t limit = (end - w * WORD_BITS >= WORD_BITS ? ~UINT64_C(0) : WORD_MASK(end) - 1);
+        uint64_t old = LOAD(bitmap->data[w]);
+        uint64_t candidates = ~old & limit & (~UINT64_C(0) << (bit & 0x3F));
+        while (candidates) 
         {
+            const uint64_t mask = candidates & -candidates;
+            if (__atomic_compare_exchange_n(&bitmap->data[w], &old, old | mask, true, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) 
+            {
+                count_add(bitmap, 1);
+                summary_resync(bitmap, w);
+                return w * WORD_BITS + __builtin_ctzll(mask);
+            }
+            candidates = ~old & limit & (~UINT64_C(0) << (bit & 0x3F));
         }
-        return (result == bitmap->bit_count ? SIZE_MAX : result);
+        pos = (w + 1) * WORD_BITS;
+    }
+}
+
+bool bitmap_claim_range(bitmap_t *const bitmap, const size_t start, const size_t count) 
+{
+    if (!bitmap || !count || start >= bitmap->bit_count || count > bitmap->bit_count - start) 
+    {
+        return false;
+    }
+    const size_t end = start + count;
+    for (size_t bit = start; bit < end; bit = (WORD_INDEX(bit) + 1) * WORD_BITS) 
+    {
+        const size_t w = WORD_INDEX(bit);
+        const uint64_t mask = range_mask(bit, end);
+        uint64_t old = LOAD(bitmap->data[w]);
+        do 
+        {
+            if (old & mask) 
+            {
+                // Lost some of it, hand back the words we already took
+                if (bit > start) 
+                {
+                    change_range(bitmap, start, bit - start, false);
+                }
+                return false;
+            }
+        } while (!__atomic_compare_exchange_n(&bitmap->data[w], &old, old | mask, true, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+        count_add(bitmap, (size_t) __builtin_popcountll(mask));
+        summary_resync(bitmap, w);
+    }
+    return true;
+}
+
+void bitmap_flip(bitmap_t *const bitmap, const size_t bit) 
+{
+    const size_t w = WORD_INDEX(bit);
+    const uint64_t old = bitmap->data[w];
+    bitmap->data[w] = old ^ WORD_MASK(bit);
+    count_add(bitmap, (old & WORD_MASK(bit)) ? (size_t) -1 : 1);
+    summary_update(bitmap, w, old, bitmap->data[w]);
+}
+
+void bitmap_invert(bitmap_t *const bitmap) 
+{
+    bitmap->kernels->invert(bitmap->data, bitmap->word_count);
+    bitmap->data[bitmap->word_count - 1] &= tail_mask(bitmap);
+    count_store(bitmap, bitmap->bit_count - bitmap_total_set(bitmap));
+    summary_rebuild(bitmap);
+}
+
+size_t bitmap_ffs(const bitmap_t *const bitmap) 
+{
+    if (bitmap) 
+    {
+        const size_t result = next_bit(bitmap, 0, true);
+        return (result < bitmap->bit_count ? result : SIZE_MAX);
     }
     return SIZE_MAX;
 }
@@ -105,47 +478,72 @@ size_t bitmap_ffz(const bitmap_t *const bitmap)
 {
     if (bitmap) 
     {
-        size_t result = 0;
-        for (; result < bitmap->bit_count && bitmap_test(bitmap, result); ++result) 
-        {
-        }
-        return (result == bitmap->bit_count ? SIZE_MAX : result);
+        const size_t result = next_bit(bitmap, 0, false);
+        return (result < bitmap->bit_count ? result : SIZE_MAX);
     }
     return SIZE_MAX;
 }
 
-size_t bitmap_total_set(const bitmap_t *const bitmap) 
+size_t bitmap_ffz_from(const bitmap_t *const bitmap, const size_t start) 
 {
-    size_t total = 0;
-    if (bitmap) 
+    if (!bitmap || start >= bitmap->bit_count) 
+    {
+        return bitmap_ffz(bitmap);
+    }
+    const size_t result = next_bit(bitmap, start, false);
+    // Wrap around. Nothing at or after start is free, so this can only land before it
+    return (result < bitmap->bit_count ? result : bitmap_ffz(bitmap));
+}
+
+size_t bitmap_find_zero_run(const bitmap_t *const bitmap, const size_t start, const size_t count) 
+{
+    if (!bitmap || !count || count > bitmap->bit_count) 
+    {
+        return SIZE_MAX;
+    }
+    // Hop from the start of each free run to the end of it until one is long enough
+    for (size_t pos = start; pos < bitmap->bit_count; ) 
     {
-        // If we have leftover, stop a byte early because we have to handle it differently.
-        size_t stop = bitmap->leftover_bits ? bitmap->byte_count - 1 : bitmap->byte_count;
-        for (size_t idx = 0; idx < stop; ++idx) 
+        const size_t zero = next_bit(bitmap, pos, false);
+        if (zero + count > bitmap->bit_count) 
         {
-            total += bit_totals[bitmap->data[idx]];
+            break;
         }
-        if (bitmap->leftover_bits) 
+        const size_t one = next_bit(bitmap, zero, true);
+        if (one - zero >= count) 
         {
-            // haha, this is readable
-            // get the byte at the end of the bitmap, mask it so we're only looking at the bits in use
-            // then feed that to the bit_total lookup so we don't count the bits past our bit total
-            // (which whould be considered undetermined)
-            total += bit_totals[bitmap->data[bitmap->byte_count - 1] & mask_down_inclusive[bitmap->leftover_bits - 1]];
+            return zero;
         }
+        pos = one;
     }
-    return total;
+    return SIZE_MAX;
+}
+
+void bitmap_set_range(bitmap_t *const bitmap, const size_t start, const size_t count) 
+{
+    change_range(bitmap, start, count, true);
+}
+
+void bitmap_reset_range(bitmap_t *const bitmap, const size_t start, const size_t count) 
+{
+    change_range(bitmap, start, count, false);
+}
+
+size_t bitmap_total_set(const bitmap_t *const bitmap) 
+{
+    return bitmap ? __atomic_load_n(&bitmap->set_count, __ATOMIC_RELAXED) : 0;
 }
 
 void bitmap_for_each(const bitmap_t *const bitmap, void (*func)(size_t, void *), void *arg) 
 {
     if (bitmap && func) 
     {
-        for (size_t idx = 0; idx < bitmap->bit_count; ++idx) 
+        for (size_t word = 0; word < bitmap->word_count; ++word) 
         {
-            if (bitmap_test(bitmap, idx)) 
+            // Peel off the lowest set bit until the word runs dry
+            for (uint64_t bits = bitmap->data[word]; bits; bits &= bits - 1) 
             {
-                func(idx, arg);
+                func(word * WORD_BITS + __builtin_ctzll(bits), arg);
             }
         }
     }
@@ -153,7 +551,10 @@ void bitmap_for_each(const bitmap_t *const bitmap, void (*func)(size_t, void *),
 
 void bitmap_format(bitmap_t *const bitmap, const uint8_t pattern) 
 {
-    memset(bitmap->data, pattern, bitmap->byte_count);
+    memset(bitmap->data, pattern, bitmap->word_count * sizeof(uint64_t));
+    bitmap->data[bitmap->word_count - 1] &= tail_mask(bitmap);
+    recount(bitmap);
+    summary_rebuild(bitmap);
 }
 
 size_t bitmap_get_bits(const bitmap_t *const bitmap) 
@@ -173,7 +574,7 @@ bitmap_t *bitmap_create(const size_t n_bits)
 
 const uint8_t *bitmap_export(const bitmap_t *const bitmap) 
 {
-    return bitmap->data;
+    return (const uint8_t *) bitmap->data;
 }
 
 bitmap_t *bitmap_import(const size_t n_bits, const void *const bitmap_data) 
@@ -184,6 +585,9 @@ bitmap_t *bitmap_import(const size_t n_bits, const void *const bitmap_data)
         if (bitmap) 
         {
             memcpy(bitmap->data, bitmap_data, bitmap->byte_count);
+            // Whatever was in the unused bits of the last byte is undetermined
+            bitmap->data[bitmap->word_count - 1] &= tail_mask(bitmap);
+            recount(bitmap);
             return bitmap;
         }
     }
@@ -197,13 +601,59 @@ bitmap_t *bitmap_overlay(const size_t n_bits, void *const bitmap_data)
         bitmap_t *bitmap = bitmap_initialize(n_bits, OVERLAY);
         if (bitmap) 
         {
-            bitmap->data = (uint8_t *) bitmap_data;
+            bitmap->data = (uint64_t *) bitmap_data;
+            bitmap->data[bitmap->word_count - 1] &= tail_mask(bitmap);
+            recount(bitmap);
             return bitmap;
         }
     }
     return NULL;
 }
 
+bool bitmap_enable_summary(bitmap_t *const bitmap) 
+{
+    if (!bitmap) 
+    {
+        return false;
+    }
+    if (FLAG_CHECK(bitmap, SUMMARY)) 
+    {
+        return true;
+    }
+
+    // Stack up levels until one word covers everything below it
+    size_t total = 0;
+    unsigned levels = 0;
+    for (size_t words = bitmap->word_count; words > 1; ) 
+    {
+        words = (words + WORD_BITS - 1) / WORD_BITS;
+        bitmap->level_words[++levels] = words;
+        total += words;
+    }
+    if (levels == 0) 
+    {
+        // Single word, the scans are already O(1)
+        bitmap->levels = 0;
+        return true;
+    }
+
+    uint64_t *storage = (uint64_t *) malloc(2 * total * sizeof(uint64_t));
+    if (!storage) 
+    {
+        return false;
+    }
+    for (unsigned level = 1; level <= levels; ++level) 
+    {
+        bitmap->full[level]     = storage;
+        bitmap->nonempty[level] = storage + bitmap->level_words[level];
+        storage += 2 * bitmap->level_words[level];
+    }
+    bitmap->levels = levels;
+    bitmap->flags |= SUMMARY;
+    summary_rebuild(bitmap);
+    return true;
+}
+
 void bitmap_destroy(bitmap_t *bitmap) 
 {
     if (bitmap) 
@@ -213,6 +663,8 @@ void bitmap_destroy(bitmap_t *bitmap)
             // don't free memory that isn't ours!
             free(bitmap->data);
         }
+        // Both trees live in the one allocation hanging off full[1]
+        free(bitmap->full[1]);
         free(bitmap);
     }
 }
@@ -235,6 +687,12 @@ bitmap_t *bitmap_initialize(size_t n_bits, BITMAP_FLAGS flags)
             bitmap->byte_count    = n_bits >> 3;
             bitmap->leftover_bits = n_bits & 0x07;
             bitmap->byte_count += (bitmap->leftover_bits ? 1 : 0);
+            bitmap->word_count    = (n_bits + WORD_BITS - 1) / WORD_BITS;
+            bitmap->kernels       = bitmap_kernels_select();
+            bitmap->set_count     = 0;
+            bitmap->levels        = 0;
+            bitmap->level_words[0] = bitmap->word_count;
+            bitmap->full[1]       = NULL;
 
             // FLAG HANDLING HERE
 
@@ -250,7 +708,7 @@ bitmap_t *bitmap_initialize(size_t n_bits, BITMAP_FLAGS flags)
             } 
             else 
             {
-                bitmap->data = (uint8_t *) calloc(bitmap->byte_count, 1);
+                bitmap->data = (uint64_t *) calloc(bitmap->word_count, sizeof(uint64_t));
                 if (bitmap->data) 
                 {
                     return bitmap;
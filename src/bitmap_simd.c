@@ -0,0 +1,236 @@
+#include "bitmap_simd.h"
+#include "cpu_features.h"
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define BITMAP_X86 1
+#include <immintrin.h>
+#endif
+
+//
+// Scalar: always available. __builtin_popcountll falls back to a bit trick
+// when the compiler isn't allowed to use popcnt.
+//
+
+static size_t popcount_scalar(const uint64_t *words, const size_t count) 
+{
+    size_t total = 0;
+    for (size_t i = 0; i < count; ++i) 
+    {
+        total += __builtin_popcountll(words[i]);
+    }
+    return total;
+}
+
+static size_t find_nonzero_scalar(const uint64_t *words, const size_t count) 
+{
+    size_t i = 0;
+    for (; i < count && !words[i]; ++i) 
+    {
+    }
+    return i;
+}
+
+static size_t find_nonfull_scalar(const uint64_t *words, const size_t count) 
+{
+    size_t i = 0;
+    for (; i < count && words[i] == ~UINT64_C(0); ++i) 
+    {
+    }
+    return i;
+}
+
+static void invert_scalar(uint64_t *words, const size_t count) 
+{
+    for (size_t i = 0; i < count; ++i) 
+    {
+        words[i] = ~words[i];
+    }
+}
+
+static const bitmap_kernels_t kernels_scalar = {"scalar", popcount_scalar, find_nonzero_scalar, find_nonfull_scalar, invert_scalar};
+
+#ifdef BITMAP_X86
+
+//
+// SSE4.2: popcnt for counting, ptest on two words at a time for the scans
+//
+
+__attribute__((target("sse4.2,popcnt"))) 
+static size_t popcount_sse42(const uint64_t *words, const size_t count) 
+{
+    // Four accumulators so the popcnts don't serialize on one register
+    size_t t0 = 0, t1 = 0, t2 = 0, t3 = 0, i = 0;
+    for (; i + 4 <= count; i += 4) 
+    {
+        t0 += __builtin_popcountll(words[i]);
+        t1 += __builtin_popcountll(words[i + 1]);
+        t2 += __builtin_popcountll(words[i + 2]);
+        t3 += __builtin_popcountll(words[i + 3]);
+    }
+    for (; i < count; ++i) 
+    {
+        t0 += __builtin_popcountll(words[i]);
+    }
+    return t0 + t1 + t2 + t3;
+}
+
+__attribute__((target("sse4.2"))) 
+static size_t find_nonzero_sse42(const uint64_t *words, const size_t count) 
+{
+    size_t i = 0;
+    for (; i + 2 <= count; i += 2) 
+    {
+        const __m128i v = _mm_loadu_si128((const __m128i *) (words + i));
+        if (!_mm_testz_si128(v, v)) 
+        {
+            break;
+        }
+    }
+    return i + find_nonzero_scalar(words + i, count - i);
+}
+
+__attribute__((target("sse4.2"))) 
+static size_t find_nonfull_sse42(const uint64_t *words, const size_t count) 
+{
+    const __m128i ones = _mm_set1_epi32(-1);
+    size_t i = 0;
+    for (; i + 2 <= count; i += 2) 
+    {
+        // testc is 1 when every bit of ones is also set in v
+        const __m128i v = _mm_loadu_si128((const __m128i *) (words + i));
+        if (!_mm_testc_si128(v, ones)) 
+        {
+            break;
+        }
+    }
+    return i + find_nonfull_scalar(words + i, count - i);
+}
+
+__attribute__((target("sse4.2"))) 
+static void invert_sse42(uint64_t *words, const size_t count) 
+{
+    const __m128i ones = _mm_set1_epi32(-1);
+    size_t i = 0;
+    for (; i + 2 <= count; i += 2) 
+    {
+        const __m128i v = _mm_loadu_si128((const __m128i *) (words + i));
+        _mm_storeu_si128((__m128i *) (words + i), _mm_xor_si128(v, ones));
+    }
+    invert_scalar(words + i, count - i);
+}
+
+static const bitmap_kernels_t kernels_sse42 = {"sse4.2", popcount_sse42, find_nonzero_sse42, find_nonfull_sse42, invert_sse42};
+
+//
+// AVX2: four words per step. Popcount is the nibble lookup through vpshufb,
+// summed with vpsadbw (http://0x80.pl/articles/sse-popcount.html)
+//
+
+__attribute__((target("avx2,popcnt"))) 
+static size_t popcount_avx2(const uint64_t *words, const size_t count) 
+{
+    const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                            0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low_nibble = _mm256_set1_epi8(0x0F);
+    __m256i total = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) 
+    {
+        const __m256i v = _mm256_loadu_si256((const __m256i *) (words + i));
+        const __m256i lo = _mm256_and_si256(v, low_nibble);
+        const __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low_nibble);
+        const __m256i bytes = _mm256_add_epi8(_mm256_shuffle_epi8(lookup, lo), _mm256_shuffle_epi8(lookup, hi));
+        total = _mm256_add_epi64(total, _mm256_sad_epu8(bytes, _mm256_setzero_si256()));
+    }
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i *) lanes, total);
+    size_t result = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    for (; i < count; ++i) 
+    {
+        result += __builtin_popcountll(words[i]);
+    }
+    return result;
+}
+
+__attribute__((target("avx2"))) 
+static size_t find_nonzero_avx2(const uint64_t *words, const size_t count) 
+{
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) 
+    {
+        const __m256i v = _mm256_loadu_si256((const __m256i *) (words + i));
+        if (!_mm256_testz_si256(v, v)) 
+        {
+            break;
+        }
+    }
+    return i + find_nonzero_scalar(words + i, count - i);
+}
+
+__attribute__((target("avx2"))) 
+static size_t find_nonfull_avx2(const uint64_t *words, const size_t count) 
+{
+    const __m256i ones = _mm256_set1_epi32(-1);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) 
+    {
+        const __m256i v = _mm256_loadu_si256((const __m256i *) (words + i));
+        if (!_mm256_testc_si256(v, ones)) 
+        {
+            break;
+        }
+    }
+    return i + find_nonfull_scalar(words + i, count - i);
+}
+
+__attribute__((target("avx2"))) 
+static void invert_avx2(uint64_t *words, const size_t count) 
+{
+    const __m256i ones = _mm256_set1_epi32(-1);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) 
+    {
+        const __m256i v = _mm256_loadu_si256((const __m256i *) (words + i));
+        _mm256_storeu_si256((__m256i *) (words + i), _mm256_xor_si256(v, ones));
+    }
+    invert_scalar(words + i, count - i);
+}
+
+static const bitmap_kernels_t kernels_avx2 = {"avx2", popcount_avx2, find_nonzero_avx2, find_nonfull_avx2, invert_avx2};
+
+#endif
+
+const bitmap_kernels_t *bitmap_kernels_get(const char *name) 
+{
+    if (!name) 
+    {
+        return NULL;
+    }
+    if (!strcmp(name, kernels_scalar.name)) 
+    {
+        return &kernels_scalar;
+    }
+#ifdef BITMAP_X86
+    if (!strcmp(name, kernels_sse42.name) && cpu_has(CPU_SSE42 | CPU_POPCNT)) 
+    {
+        return &kernels_sse42;
+    }
+    if (!strcmp(name, kernels_avx2.name) && cpu_has(CPU_AVX2 | CPU_POPCNT)) 
+    {
+        return &kernels_avx2;
+    }
+#endif
+    return NULL;
+}
+
+const bitmap_kernels_t *bitmap_kernels_select(void) 
+{
+    static const char *const preference[] = {"avx2", "sse4.2", "scalar"};
+    const bitmap_kernels_t *kernels = NULL;
+    for (size_t i = 0; !kernels; ++i) 
+    {
+        kernels = bitmap_kernels_get(preference[i]);
+    }
+    return kernels;
+}
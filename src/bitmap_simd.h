@@ -0,0 +1,45 @@
+#ifndef BITMAP_SIMD_H__
+#define BITMAP_SIMD_H__
+
+#ifdef __cplusplus
+extern "C" 
+{
+#endif
+
+// Internal to the bitmap: word-array kernels with a scalar, an SSE4.2 and an AVX2 version.
+// The best one the CPU supports is picked once (cpuid) and handed to every new bitmap.
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef struct bitmap_kernels 
+{
+    const char *name;
+    // Total bits set in words[0, count)
+    size_t (*popcount)(const uint64_t *words, const size_t count);
+    // Index of the first word that is not zero, count if there is none
+    size_t (*find_nonzero)(const uint64_t *words, const size_t count);
+    // Index of the first word that is not all ones, count if there is none
+    size_t (*find_nonfull)(const uint64_t *words, const size_t count);
+    // Flips every bit of words[0, count)
+    void (*invert)(uint64_t *words, const size_t count);
+} bitmap_kernels_t;
+
+///
+/// Picks the widest kernels this CPU supports (only probes the CPU once)
+/// \return The kernel table, never NULL
+///
+const bitmap_kernels_t *bitmap_kernels_select(void);
+
+///
+/// Looks up a kernel table by name ("scalar", "sse4.2", "avx2"), mostly for testing
+/// \param name The kernel name
+/// \return The kernel table, NULL if it isn't built in or the CPU can't run it
+///
+const bitmap_kernels_t *bitmap_kernels_get(const char *name);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,305 +1,3215 @@
-#include <stdio.h>
-#include <stdint.h>
-#include <string.h>
-#include <fcntl.h>
-#include <sys/stat.h>
-#include <errno.h>
-#include <unistd.h>
-#include "bitmap.h"
-#include "block_store.h"
-// include more if you need
-
-// You might find this handy.  I put it around unused parameters, but you should
-// remove it before you submit. Just allows things to compile initially.
-#define UNUSED(x) (void)(x)
-
-// Implementation of the block store struct. 
-typedef struct block_store 
-{
-    bitmap_t *fbm; 
-    void *blocks[BLOCK_STORE_NUM_BLOCKS]; 
-} block_store_t;
-
-
-block_store_t *block_store_create()
-{
-    // Create the block store object. 
-    block_store_t *bs = malloc(sizeof(block_store_t));
-    if (!bs)
-    {
-        return NULL;
-    } 
-
-    // Initialize the FBM. 
-    bitmap_t *fbm = bitmap_create(BLOCK_STORE_NUM_BLOCKS);
-    if (!fbm)
-    {
-        return NULL; 
-    }
-    bs -> fbm = fbm;
-
-    return bs;
-}
-
-void block_store_destroy(block_store_t *const bs)
-{
-   // If it exists, destroy the block store and its FBM. 
-   if (bs) 
-   {
-        bitmap_destroy(bs -> fbm);
-        free(bs);
-   }
-}
-
-
-size_t block_store_allocate(block_store_t *const bs)
-{
-    // Bad inputs. 
-    if (!bs)
-    {
-        return SIZE_MAX;
-    } 
-
-    // Find the first free block and allocate it. 
-    size_t id = bitmap_ffz(bs -> fbm);
-    if (id != SIZE_MAX && id != BLOCK_STORE_AVAIL_BLOCKS)
-    {
-        // Set the corresponding bit in the FBM. 
-        bitmap_set(bs->fbm, id);
-		(bs -> blocks)[id] = calloc(BLOCK_SIZE_BYTES, 1); 
-        return id; 
-    }
-    return SIZE_MAX;
-}
-
-
-bool block_store_request(block_store_t *const bs, const size_t block_id)
-{
-    // Check for bad inputs. 
-    if (bs != NULL) 
-    {
-		if (bs -> fbm != NULL) 
-        {
-			if (block_id < BLOCK_STORE_NUM_BLOCKS) 
-            {
-                // Return if requested block in use. 
-                if (bitmap_test(bs -> fbm, block_id)) 
-                {
-                    return false;
-                }
-                
-                // Set the corresponding bit in the FBM. 
-                bitmap_set(bs -> fbm, block_id);
-				(bs -> blocks)[block_id] = calloc(BLOCK_SIZE_BYTES, 1); 
-                return true;
-			}
-		}
-    }
-    return false;
-}
-
-// Frees the specified block
-void block_store_release(block_store_t *const bs, const size_t block_id)
-{
-    // Check for bad inputs. 
-    if (bs != NULL) 
-    {
-		if (bs -> fbm != NULL) 
-        {
-			if (block_id < BLOCK_STORE_NUM_BLOCKS) {
-				// Release the . and clear . 
-                free((bs -> blocks)[block_id]);
-				(bs -> blocks)[block_id] = NULL;
-				bitmap_reset(bs -> fbm, block_id);
-			}
-		}
-    }
-}
-
-
-size_t block_store_get_used_blocks(const block_store_t *const bs)
-{
-    // Check for bad inputs. 
-    if (bs == NULL || bs -> fbm == NULL) 
-    {
-        return SIZE_MAX;
-    }
-	
-    // Return # of available blocks. 
-    return bitmap_total_set(bs -> fbm);
-}
-
-size_t block_store_get_free_blocks(const block_store_t *const bs)
-{
-    // Check for bad inputs. 
-    if (bs == NULL || bs -> fbm == NULL) 
-    {
-        return SIZE_MAX;
-    }
-	
-	// Return # of free blocks. 
-    return BLOCK_STORE_AVAIL_BLOCKS - bitmap_total_set(bs -> fbm);
-}
-
-
-size_t block_store_get_total_blocks()
-{
-    return BLOCK_STORE_AVAIL_BLOCKS;
-}
-
-size_t block_store_read(const block_store_t *const bs, const size_t block_id, void *buffer)
-{
-    // Check for bad inputs. 
-    if (bs == NULL || buffer == NULL || block_id >= BLOCK_STORE_NUM_BYTES || block_id == 0) 
-    {
-        return 0;
-    }
-
-    // Copy the block's contents into the given buffer.  
-    if ((bs -> blocks)[block_id])
-    {
-		memcpy(buffer, ((bs -> blocks)[block_id]), BLOCK_SIZE_BYTES);
-	}
-    return BLOCK_SIZE_BYTES;
-}
-
-
-size_t block_store_write(block_store_t *const bs, const size_t block_id, const void *buffer)
-{
-    // Check for bad inputs.
-    if (bs == NULL || buffer == NULL || block_id > BLOCK_STORE_NUM_BYTES) 
-    {
-        return 0;
-    }
-
-    // Copy the buffer's contents into the block.
-	if ((bs -> blocks)[block_id])
-    {
-		memcpy(((bs -> blocks)[block_id]), buffer, BLOCK_SIZE_BYTES);
-	}
-    return BLOCK_SIZE_BYTES;
-}
-
-
-block_store_t *block_store_deserialize(const char *const filename)
-{
-    // Check for bad inputs. 
-    if (filename == NULL) 
-    {
-        return NULL;
-    }
-	
-    // Create block store. 
-    block_store_t * bs = block_store_create();
-	if (!bs)
-	{
-		return NULL;
-	}
-	
-	char *buf = malloc(BLOCK_SIZE_BYTES);
-
-	// First need to get fbm to see which blocks to read and which to skip.
-	int fd = open(filename, O_RDONLY);
-	if (fd == -1)
-	{
-		printf("Deserialize open file error: %s/n", strerror(errno));
-	}
-	
-    // Go to the 127th block, i.e. where the FBM should be.
-	if (lseek(fd, 127 * BLOCK_SIZE_BYTES, SEEK_CUR) == -1)
-	{
-		printf("Deserialize Error (lseek): %s/n", strerror(errno));
-	}
-	
-    // Read the FBM into the buffer.
-	if (read(fd, buf, BLOCK_SIZE_BYTES) == -1)
-	{
-		printf("Deserialize Error (read): %s/n", strerror(errno));
-	}
-	// Save FBM. 
-	bitmap_t *bitmap = bitmap_import(BLOCK_STORE_NUM_BLOCKS, buf);
-	
-	// Reset file offset. 
-	if (lseek(fd, 0, SEEK_SET) == -1)
-	{
-		printf("Deserialize Error (lseek): %s/n", strerror(errno));
-	}
-
-	// Loop through FBM, allocating blocks that are marked as in use. 
-    for (int i = 0; i < 256; i++)
-	{
-		if (read(fd, buf, BLOCK_SIZE_BYTES) == -1)
-		{
-			printf("Deserialize Error (read): %s/n", strerror(errno));
-		}
-		
-		if (bitmap_test(bitmap, i))
-		{
-			// Update new FBM. 
-			if (!block_store_request(bs, i)){
-                return NULL;
-            } 
-			// Populate the block. 
-			if (block_store_write(bs, i, buf) != BLOCK_SIZE_BYTES) 
-            {
-                return NULL;
-            }
-		}
-	}
-
-    free(buf);
-    free(bitmap);
-    return bs; 
-}
-
-size_t block_store_serialize(const block_store_t *const bs, const char *const filename)
-{
-    // Check for bad inputs. 
-    if (!bs || !filename || !strcmp(filename, "\n") || !strcmp(filename, "\0") || !strcmp(filename, ""))
-    {
-        return 0;
-    } 
-
-    // System call to create or open the file. 
-    int fd = open(filename, O_CREAT | O_WRONLY | O_TRUNC, 0777);
-    if (fd == -1)
-    {
-		printf("Serialize Error (open): %s/n", strerror(errno));
-	}
-
-    char *buf = malloc(BLOCK_SIZE_BYTES);
-
-    // Serialize the data. 
-    size_t i = 0; 
-    for (i = 0; i < 256; i++) 
-    {
-        // Special case for FBM. 
-		if (i == 127)
-		{
-			memcpy(buf, bitmap_export(bs->fbm), BITMAP_SIZE_BYTES); 
-		}
-        else if (!bitmap_test(bs->fbm, i))
-        {
-            memset(buf, '0', BLOCK_SIZE_BYTES);
-        }
-        else 
-        {
-            memcpy(buf, (bs->blocks)[i], BLOCK_SIZE_BYTES);
-        }
-    
-        // Write the data to the file. 
-        if (write(fd, buf, BLOCK_SIZE_BYTES) == -1) 
-        {
-			printf("Serialize Error (write): %s/n", strerror(errno));
-		}
-    }
-	
-    // Close the file. 
-	if (close(fd) == -1) 
-	{
-		printf("Serialize Error (close): %s/n", strerror(errno));
-	}
-	
-    free(buf);
-    return BLOCK_STORE_NUM_BYTES;
-}
\ No newline at end of file
+// For SEEK_DATA/SEEK_HOLE, which let deserialize skip the holes in sparse images. 
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include "bitmap.h"
+#include "block_store.h"
+#include "crc32c.h"
+#include "rle.h"
+// include more if you need
+
+// You might find this handy.  I put it around unused parameters, but you should
+// remove it before you submit. Just allows things to compile initially.
+#define UNUSED(x) (void)(x)
+
+// Alignment of the block arena. Page aligned so every block sits at a
+// predictable offset and blocks of a page or more never straddle pages.
+#define BLOCK_ARENA_ALIGN 4096
+
+// Payload locking. Shards cover runs of 64 blocks (one FBM word's worth). The FBM
+// itself needs no lock, blocks are claimed and given back with atomic bitmap calls.
+#define SHARD_SHIFT 6
+#define SHARD_COUNT 64
+#define SHARD_OF(block_id) (((block_id) >> SHARD_SHIFT) & (SHARD_COUNT - 1))
+
+// Padded out to a cache line so neighbouring shards don't bounce one between cores. 
+typedef struct 
+{
+    _Alignas(64) pthread_rwlock_t lock;
+} shard_lock_t;
+
+// Per-thread free block caches. Threads are spread over a fixed set of 
+// magazines rather than each getting its own, which keeps the store from 
+// having to track threads coming and going. 
+#define MAGAZINE_COUNT 32
+
+typedef struct 
+{
+    _Alignas(64) pthread_mutex_t lock;
+    size_t count;
+    size_t *ids;          // Stack of cached ids, some may be stale (see magazine_pop)
+} magazine_t;
+
+// Chunks by payload hash, for deduplication (see block_store_set_dedup). The 
+// table only knows its chunks, they go when their last block does, so it lives 
+// on while a clone still has some even if its store has let go of it. 
+typedef struct dedup_table 
+{
+    size_t refs;            // The store deduplicating with it, plus each chunk in it. Atomic.
+    pthread_mutex_t lock;   // The buckets
+    struct chunk **buckets;
+    size_t bucket_count;
+    size_t count;           // Chunks in it. Atomic.
+} dedup_table_t;
+
+// An arena a store has moved off of, left to the chunks pointing into it (see store_fork). 
+typedef struct 
+{
+    size_t refs;            // Chunks pointing into it. Atomic.
+    uint8_t *blocks;
+} frozen_arena_t;
+
+// A payload shared by several blocks, of one store or of several. Once shared it's 
+// never written, a write gives the block a different payload. 
+typedef struct chunk 
+{
+    uint32_t refs;          // Blocks using it, in any store. Atomic.
+    uint32_t hash;          // CRC32C of the payload, if it's in a table
+    struct chunk *next;     // Table chain
+    dedup_table_t *table;   // Where it can be found by contents, NULL if nowhere
+    frozen_arena_t *home;   // Arena the payload is in, NULL if it's right after the chunk
+    uint8_t *data;          // block_size bytes
+} chunk_t;
+
+// Dedup table buckets to start with, it doubles as it fills up. 
+#define DEDUP_MIN_BUCKETS 1024
+
+// Implementation of the block store struct. 
+typedef struct block_store 
+{
+    bitmap_t *fbm;        // One bit per user block, the FBM's own blocks aren't in it
+    uint8_t *blocks;      // Arena of num_blocks * block_size bytes, indexed by block id
+    int fd;               // Device file the arena is a mapping of, -1 for in-memory stores
+    size_t num_blocks;    // Total blocks in the device, FBM included
+    size_t block_size;    // Bytes per block
+    size_t avail_blocks;  // User-addressable blocks, the FBM lives in the ones after these
+    block_store_alloc_policy_t alloc_policy;
+    size_t alloc_cursor;  // First fit: no free block below this. Next fit: where the last allocation ended. Atomic.
+    uint32_t *pins;       // Pin count per block
+    size_t pinned_blocks; // Blocks with a non-zero pin count, so release can skip checking when there are none
+
+    // Shard locks are taken in ascending order. 
+    shard_lock_t *shards; // Payloads and pin counts of each shard's blocks
+
+    // Optional free block caches. Cached blocks keep their FBM bit set, so nothing 
+    // else can claim them, and are marked in cached. That bitmap is the truth, 
+    // the magazines' stacks are only hints. 
+    magazine_t *magazines;
+    size_t magazine_capacity;
+    bitmap_t *cached;
+    size_t cached_blocks; // Bits set in cached. Atomic.
+
+    // Blocks whose allocation has finished. A claim sets the FBM bit without any 
+    // lock and only clears the old payload after, under the shard lock, and cached 
+    // blocks keep their bits too, so anything holding the shard locks that needs 
+    // the blocks in use to match their payloads goes by this instead. Set once a 
+    // claimed block is cleared, reset when it's released, both under its shard 
+    // write lock. 
+    bitmap_t *live;
+
+    // Blocks whose image changed since the store was created, loaded or last 
+    // flushed. Only marked under the block's shard write lock, so a flush holding
+    // every shard's read lock sees a dirty set that matches the payloads. 
+    bitmap_t *dirty;
+
+    // The file the dirty set is relative to: the image the store was loaded from 
+    // or last flushed to. A flush anywhere else has to write everything. A mapped 
+    // store's dirty set belongs to writeback, so its flushes always do. Only 
+    // touched under writeback_pass_lock. 
+    bool flush_known;
+    dev_t flush_dev;
+    ino_t flush_ino;
+
+    // Background writeback of file-backed stores (see block_store_set_writeback_policy). 
+    // The policy's dirty limit is read without the lock by everyone marking blocks dirty. 
+    pthread_mutex_t writeback_lock;       // Policy, and the worker's state below
+    pthread_cond_t writeback_wake;
+    pthread_t writeback_thread;
+    block_store_writeback_policy_t writeback_policy;
+    bool writeback_running, writeback_stop, writeback_kick;
+    pthread_mutex_t writeback_pass_lock;  // One writeback pass at a time, worker or barrier
+
+    // Write-ahead journal of a file-backed store (see block_store_set_journal). 
+    // Records are appended under the shard write locks of the blocks they're 
+    // about, so a block's records are in the order its changes were made. 
+    char *journal_path;                   // <device file>.journal, NULL for in-memory stores
+    int journal_fd;                       // -1 while journaling is off. Atomic.
+    pthread_mutex_t journal_lock;         // Appends, and the group commit state below
+    pthread_cond_t journal_synced;
+    uint64_t journal_appended;            // Records appended so far. Atomic.
+    uint64_t journal_durable;             // Records known to be on disk
+    bool journal_syncing;                 // Someone is in fdatasync on behalf of everyone
+
+    // Checksums a store was loaded with. Blocks set in unverified haven't been 
+    // checked against theirs yet, or rewritten since. NULL for images without. 
+    uint32_t *checksums;
+    bitmap_t *unverified;
+
+    // Shared payloads, from deduplication or snapshots. A block with a chunk reads 
+    // from the chunk, not its arena slot. chunks[id] only changes under the block's 
+    // shard write lock. 
+    chunk_t **chunks;                     // Per user block, NULL until something is shared
+    size_t shared_blocks;                 // Blocks with a chunk. Atomic.
+    dedup_table_t *dedup;                 // NULL while dedup is off
+    bool read_only;                       // Snapshots can't be changed
+} block_store_t;
+
+
+// Number of blocks needed at the end of the device to hold the FBM. 
+static size_t fbm_block_count(const size_t num_blocks, const size_t block_size)
+{
+    size_t fbm_bytes = (num_blocks + 7) / 8;
+    return (fbm_bytes + block_size - 1) / block_size;
+}
+
+// Address of the given block's payload in the arena. 
+static inline uint8_t *block_addr(const block_store_t *const bs, const size_t block_id)
+{
+    return bs -> blocks + block_id * bs -> block_size;
+}
+
+// Where the given block's payload is to be read from: its chunk if it's sharing 
+// one, its arena slot otherwise. Caller holds the block's shard lock. 
+static inline const uint8_t *block_payload(const block_store_t *const bs, const size_t block_id)
+{
+    const chunk_t *chunk = bs -> chunks ? bs -> chunks[block_id] : NULL;
+    return chunk ? chunk -> data : block_addr(bs, block_id);
+}
+
+static inline bool is_shared(const block_store_t *const bs, const size_t block_id)
+{
+    return bs -> chunks && bs -> chunks[block_id];
+}
+
+// In use means allocated and cleared, not just claimed or sitting free in a thread 
+// cache. Caller holds the block's shard lock. 
+static inline bool in_use(const block_store_t *const bs, const size_t block_id)
+{
+    return bitmap_test(bs -> live, block_id);
+}
+
+// Loaded blocks are checked against the image's checksums the first time they're 
+// read, not all at once on load. Caller holds the block's shard lock, readers 
+// racing to check the same block just both do it. 
+static bool block_verified(const block_store_t *const bs, const size_t block_id)
+{
+    if (!bs -> unverified || !bitmap_test(bs -> unverified, block_id))
+    {
+        return true;
+    }
+    if (crc32c(0, block_payload(bs, block_id), bs -> block_size) != bs -> checksums[block_id])
+    {
+        printf("Read Error: block %zu failed its checksum\n", block_id);
+        return false;
+    }
+    bitmap_test_and_reset(bs -> unverified, block_id);
+    return true;
+}
+
+// Once a block's been overwritten the checksum it was loaded with is no use. 
+// Caller holds the blocks' shard write locks. 
+static inline void blocks_rewritten(const block_store_t *const bs, const size_t first, const size_t count)
+{
+    if (bs -> unverified)
+    {
+        bitmap_reset_range(bs -> unverified, first, count);
+    }
+}
+
+// Blocks set in the FBM less the ones sitting in caches. Neither count stops 
+// moving while we read them, so don't let a race take it below zero. 
+static inline size_t used_blocks(const block_store_t *const bs)
+{
+    const size_t cached = __atomic_load_n(&bs -> cached_blocks, __ATOMIC_RELAXED);
+    const size_t set = bitmap_total_set(bs -> fbm);
+    return set > cached ? set - cached : 0;
+}
+
+// Wakes the writeback worker once there are more dirty blocks than its policy 
+// allows. Only the first one over the limit has to take the lock. 
+static void writeback_note_dirty(const block_store_t *const bs)
+{
+    const size_t limit = __atomic_load_n(&bs -> writeback_policy.max_dirty_blocks, __ATOMIC_RELAXED);
+    if (limit && bitmap_total_set(bs -> dirty) >= limit && !__atomic_load_n(&bs -> writeback_kick, __ATOMIC_RELAXED))
+    {
+        pthread_mutex_t *lock = (pthread_mutex_t *) &bs -> writeback_lock;
+        pthread_mutex_lock(lock);
+        __atomic_store_n((bool *) &bs -> writeback_kick, true, __ATOMIC_RELAXED);
+        pthread_cond_signal((pthread_cond_t *) &bs -> writeback_wake);
+        pthread_mutex_unlock(lock);
+    }
+}
+
+// Marks a block's image as changed. Caller holds the block's shard write lock. 
+// Testing first keeps rewrites of an already dirty block from bouncing the line. 
+static inline void mark_dirty(const block_store_t *const bs, const size_t block_id)
+{
+    if (!bitmap_test(bs -> dirty, block_id) && !bitmap_test_and_set(bs -> dirty, block_id))
+    {
+        writeback_note_dirty(bs);
+    }
+}
+
+static inline void mark_dirty_range(const block_store_t *const bs, const size_t first, const size_t count)
+{
+    bitmap_set_range(bs -> dirty, first, count);
+    writeback_note_dirty(bs);
+}
+
+// Starts a new dirty set once everything in the old one is safely written. 
+// Pinned blocks can be written through their pointers at any time, so they stay 
+// dirty. Caller holds every shard lock. 
+static void restart_dirty(const block_store_t *const bs)
+{
+    bitmap_format(bs -> dirty, 0);
+    if (__atomic_load_n(&bs -> pinned_blocks, __ATOMIC_RELAXED))
+    {
+        for (size_t id = 0; id < bs -> avail_blocks; id++)
+        {
+            if (bs -> pins[id])
+            {
+                bitmap_set(bs -> dirty, id);
+            }
+        }
+    }
+}
+
+// Pinned blocks can't be released. Caller holds the block's shard lock. 
+static inline bool is_pinned(const block_store_t *const bs, const size_t block_id)
+{
+    return __atomic_load_n(&bs -> pinned_blocks, __ATOMIC_RELAXED) && bs -> pins[block_id];
+}
+
+// The locks live inside the store but even const operations have to take them. 
+static inline void lock_block(const block_store_t *const bs, const size_t block_id, const bool write)
+{
+    pthread_rwlock_t *lock = &bs -> shards[SHARD_OF(block_id)].lock;
+    if (write)
+    {
+        pthread_rwlock_wrlock(lock);
+    }
+    else
+    {
+        pthread_rwlock_rdlock(lock);
+    }
+}
+
+static inline void unlock_block(const block_store_t *const bs, const size_t block_id)
+{
+    pthread_rwlock_unlock(&bs -> shards[SHARD_OF(block_id)].lock);
+}
+
+// Does [first, first + count) touch shard? Since shards wrap around, that's 
+// a circular interval of shards unless the range covers them all. 
+static inline bool range_uses_shard(const size_t first, const size_t count, const size_t shard)
+{
+    const size_t first_shard = first >> SHARD_SHIFT, last_shard = (first + count - 1) >> SHARD_SHIFT;
+    if (last_shard - first_shard + 1 >= SHARD_COUNT)
+    {
+        return true;
+    }
+    const size_t lo = first_shard & (SHARD_COUNT - 1), hi = last_shard & (SHARD_COUNT - 1);
+    return lo <= hi ? (shard >= lo && shard <= hi) : (shard >= lo || shard <= hi);
+}
+
+// Locks every shard a range of blocks touches, in ascending order. 
+static void lock_blocks(const block_store_t *const bs, const size_t first, const size_t count, const bool write)
+{
+    for (size_t shard = 0; shard < SHARD_COUNT; shard++)
+    {
+        if (range_uses_shard(first, count, shard))
+        {
+            lock_block(bs, shard << SHARD_SHIFT, write);
+        }
+    }
+}
+
+static void unlock_blocks(const block_store_t *const bs, const size_t first, const size_t count)
+{
+    for (size_t shard = 0; shard < SHARD_COUNT; shard++)
+    {
+        if (range_uses_shard(first, count, shard))
+        {
+            unlock_block(bs, shard << SHARD_SHIFT);
+        }
+    }
+}
+
+// Locks a set of shards, one bit each (there are 64), for batches of scattered ids. 
+// Same ascending order as lock_blocks. 
+static void lock_shards(const block_store_t *const bs, const uint64_t shards, const bool write)
+{
+    for (size_t shard = 0; shard < SHARD_COUNT; shard++)
+    {
+        if ((shards >> shard) & 1)
+        {
+            lock_block(bs, shard << SHARD_SHIFT, write);
+        }
+    }
+}
+
+static void unlock_shards(const block_store_t *const bs, const uint64_t shards)
+{
+    for (size_t shard = 0; shard < SHARD_COUNT; shard++)
+    {
+        if ((shards >> shard) & 1)
+        {
+            unlock_block(bs, shard << SHARD_SHIFT);
+        }
+    }
+}
+
+// With no lock around allocation the cursor is only a hint, but first fit still 
+// keeps it a low-water mark: releases only ever lower it, and an allocation only 
+// moves it on if nobody lowered it since the allocation started from it. 
+static inline size_t cursor_get(const block_store_t *const bs)
+{
+    return __atomic_load_n(&bs -> alloc_cursor, __ATOMIC_RELAXED);
+}
+
+static inline void cursor_advance(block_store_t *const bs, size_t seen, const size_t next)
+{
+    __atomic_compare_exchange_n(&bs -> alloc_cursor, &seen, next, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+static void cursor_lower(block_store_t *const bs, const size_t block_id)
+{
+    if (__atomic_load_n(&bs -> alloc_policy, __ATOMIC_RELAXED) == BLOCK_STORE_FIRST_FIT)
+    {
+        size_t cursor = cursor_get(bs);
+        while (block_id < cursor 
+               && !__atomic_compare_exchange_n(&bs -> alloc_cursor, &cursor, block_id, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        {
+        }
+    }
+}
+
+// Journal records are a header then, for data, the bytes written. Replay stops
+// at the first record that doesn't check out, which is where a crash cut it off. 
+#define JOURNAL_MAGIC 0x4C4E524AU  // "JRNL"
+
+typedef enum 
+{
+    JOURNAL_ALLOC = 1,  // Blocks [first, first + count) claimed and zeroed
+    JOURNAL_FREE,       // Blocks [first, first + count) released
+    JOURNAL_DATA,       // count bytes at arena offset first, which follow the header
+} journal_type_t;
+
+typedef struct 
+{
+    uint32_t magic;
+    uint32_t type;
+    uint64_t first, count;
+    uint64_t check;     // CRC32C of the header (with check 0) and the payload
+} journal_record_t;
+
+static uint64_t journal_check(journal_record_t rec, const void *const payload, const size_t len)
+{
+    rec.check = 0;
+    return crc32c(crc32c(0, &rec, sizeof(rec)), payload, len);
+}
+
+// writevs the whole of iov, IOV_MAX entries at a time, picking up after short writes. 
+// Consumes iov (entries are advanced past what's been written). 
+static bool writev_full(const int fd, struct iovec *iov, size_t count)
+{
+    while (count)
+    {
+        const ssize_t put = writev(fd, iov, count < IOV_MAX ? (int) count : IOV_MAX);
+        if (put == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            printf("Write Error (writev): %s\n", strerror(errno));
+            return false;
+        }
+        for (size_t left = (size_t) put; left; )
+        {
+            const size_t step = left < iov -> iov_len ? left : iov -> iov_len;
+            iov -> iov_base = (uint8_t *) iov -> iov_base + step;
+            iov -> iov_len -= step;
+            left -= step;
+            if (!iov -> iov_len)
+            {
+                iov++;
+                count--;
+            }
+        }
+        // Skip over anything that was empty to begin with. 
+        while (count && !iov -> iov_len)
+        {
+            iov++;
+            count--;
+        }
+    }
+    return true;
+}
+
+// Appends a record to the journal, if there is one. Data records copy their 
+// bytes out of the arena, so the change is made before it's logged. Caller 
+// holds the shard write locks of the blocks involved. seq is raised to the 
+// record's number, for journal_commit. 
+static bool journal_log(const block_store_t *const bs, const journal_type_t type, const size_t first, const size_t count, uint64_t *const seq)
+{
+    if (__atomic_load_n(&bs -> journal_fd, __ATOMIC_RELAXED) == -1)
+    {
+        return true;
+    }
+    journal_record_t rec = { JOURNAL_MAGIC, type, first, count, 0 };
+    const size_t len = type == JOURNAL_DATA ? count : 0;
+    rec.check = journal_check(rec, bs -> blocks + first, len);
+    struct iovec iov[2] = { { &rec, sizeof(rec) }, { bs -> blocks + first, len } };
+
+    block_store_t *store = (block_store_t *) bs;
+    pthread_mutex_lock(&store -> journal_lock);
+    bool ok = true;
+    if (store -> journal_fd != -1)
+    {
+        ok = writev_full(store -> journal_fd, iov, 2);
+        if (ok)
+        {
+            const uint64_t n = __atomic_add_fetch(&store -> journal_appended, 1, __ATOMIC_RELAXED);
+            if (seq && n > *seq)
+            {
+                *seq = n;
+            }
+        }
+    }
+    pthread_mutex_unlock(&store -> journal_lock);
+    return ok;
+}
+
+// Waits until record seq is on disk. Whoever gets here first fdatasyncs for 
+// everyone appended so far and the rest wait on that, so a crowd of writers 
+// costs one sync, not one each. 
+static bool journal_commit(block_store_t *const bs, const uint64_t seq)
+{
+    if (!seq)
+    {
+        return true;
+    }
+    bool ok = true;
+    pthread_mutex_lock(&bs -> journal_lock);
+    while (ok && bs -> journal_durable < seq)
+    {
+        if (bs -> journal_syncing)
+        {
+            pthread_cond_wait(&bs -> journal_synced, &bs -> journal_lock);
+            continue;
+        }
+        bs -> journal_syncing = true;
+        const uint64_t target = bs -> journal_appended;
+        const int fd = bs -> journal_fd;
+        pthread_mutex_unlock(&bs -> journal_lock);
+        ok = fd == -1 || fdatasync(fd) == 0;
+        if (!ok)
+        {
+            printf("Journal Error (fdatasync): %s\n", strerror(errno));
+        }
+        pthread_mutex_lock(&bs -> journal_lock);
+        bs -> journal_syncing = false;
+        if (ok && target > bs -> journal_durable)
+        {
+            bs -> journal_durable = target;
+        }
+        pthread_cond_broadcast(&bs -> journal_synced);
+    }
+    pthread_mutex_unlock(&bs -> journal_lock);
+    return ok;
+}
+
+// Empties the journal once the mapping has been synced with everything in its 
+// first seq records. Caller holds journal_lock. Anything appended since has 
+// to be kept, and a journal can't lose just its front, so that waits for next time. 
+static void journal_trim(block_store_t *const bs, const uint64_t seq)
+{
+    if (bs -> journal_fd != -1 && bs -> journal_appended == seq)
+    {
+        if (ftruncate(bs -> journal_fd, 0) == -1)
+        {
+            printf("Journal Error (ftruncate): %s\n", strerror(errno));
+            return;
+        }
+        bs -> journal_durable = seq;
+        pthread_cond_broadcast(&bs -> journal_synced);
+    }
+}
+
+// Redoes whatever a journal left behind by a crash says onto a freshly mapped 
+// store, then syncs the mapping and empties the journal. 
+static bool journal_replay(block_store_t *const bs)
+{
+    const int fd = open(bs -> journal_path, O_RDWR);
+    if (fd == -1)
+    {
+        return errno == ENOENT;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size == 0)
+    {
+        close(fd);
+        return true;
+    }
+    const size_t size = (size_t) st.st_size;
+    uint8_t *log = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (log == MAP_FAILED)
+    {
+        printf("Journal Error (mmap): %s\n", strerror(errno));
+        close(fd);
+        return false;
+    }
+
+    const size_t arena_bytes = bs -> avail_blocks * bs -> block_size;
+    for (size_t pos = 0; size - pos >= sizeof(journal_record_t); )
+    {
+        journal_record_t rec;
+        memcpy(&rec, log + pos, sizeof(rec));
+        const size_t len = rec.type == JOURNAL_DATA ? rec.count : 0;
+        const size_t limit = rec.type == JOURNAL_DATA ? arena_bytes : bs -> avail_blocks;
+        if (rec.magic != JOURNAL_MAGIC || rec.type < JOURNAL_ALLOC || rec.type > JOURNAL_DATA
+            || rec.first > limit || rec.count > limit - rec.first
+            || len > size - pos - sizeof(rec) || rec.check != journal_check(rec, log + pos + sizeof(rec), len))
+        {
+            break;
+        }
+        if (rec.type == JOURNAL_ALLOC)
+        {
+            bitmap_set_range(bs -> fbm, rec.first, rec.count);
+            bitmap_set_range(bs -> live, rec.first, rec.count);
+            memset(block_addr(bs, rec.first), 0, rec.count * bs -> block_size);
+        }
+        else if (rec.type == JOURNAL_FREE)
+        {
+            bitmap_reset_range(bs -> fbm, rec.first, rec.count);
+            bitmap_reset_range(bs -> live, rec.first, rec.count);
+        }
+        else
+        {
+            memcpy(bs -> blocks + rec.first, log + pos + sizeof(rec), len);
+        }
+        pos += sizeof(rec) + len;
+    }
+    munmap(log, size);
+
+    // Only once the image has it all can the journal go. 
+    bool ok = msync(bs -> blocks, bs -> num_blocks * bs -> block_size, MS_SYNC) == 0;
+    if (!ok)
+    {
+        printf("Journal Error (msync): %s\n", strerror(errno));
+    }
+    else if (ftruncate(fd, 0) == -1)
+    {
+        printf("Journal Error (ftruncate): %s\n", strerror(errno));
+        ok = false;
+    }
+    close(fd);
+    return ok;
+}
+
+static void dedup_table_put(dedup_table_t *const table)
+{
+    if (__atomic_sub_fetch(&table -> refs, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        pthread_mutex_destroy(&table -> lock);
+        free(table -> buckets);
+        free(table);
+    }
+}
+
+// Takes a reference to a chunk found in a table, unless its last block has 
+// already let go of it and it's on its way out. Caller holds the table lock. 
+static bool chunk_get_live(chunk_t *const chunk)
+{
+    uint32_t refs = __atomic_load_n(&chunk -> refs, __ATOMIC_RELAXED);
+    while (refs && !__atomic_compare_exchange_n(&chunk -> refs, &refs, refs + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+    }
+    return refs != 0;
+}
+
+// Gives up a block's reference to a chunk, freeing it with the last one. 
+static void chunk_put(chunk_t *const chunk)
+{
+    if (__atomic_sub_fetch(&chunk -> refs, 1, __ATOMIC_ACQ_REL) != 0)
+    {
+        return;
+    }
+    dedup_table_t *table = chunk -> table;
+    if (table)
+    {
+        pthread_mutex_lock(&table -> lock);
+        chunk_t **link = &table -> buckets[chunk -> hash & (table -> bucket_count - 1)];
+        while (*link != chunk)
+        {
+            link = &(*link) -> next;
+        }
+        *link = chunk -> next;
+        __atomic_sub_fetch(&table -> count, 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&table -> lock);
+        dedup_table_put(table);
+    }
+    frozen_arena_t *home = chunk -> home;
+    if (home && __atomic_sub_fetch(&home -> refs, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        free(home -> blocks);
+        free(home);
+    }
+    free(chunk);
+}
+
+// Detaches a block from its chunk, copying the payload back into its arena slot 
+// if it's still wanted. Caller holds the block's shard write lock. 
+static void block_unshare(const block_store_t *const bs, const size_t block_id, const bool keep)
+{
+    chunk_t *chunk = bs -> chunks ? bs -> chunks[block_id] : NULL;
+    if (chunk)
+    {
+        if (keep)
+        {
+            memcpy(block_addr(bs, block_id), chunk -> data, bs -> block_size);
+        }
+        bs -> chunks[block_id] = NULL;
+        __atomic_sub_fetch((size_t *) &bs -> shared_blocks, 1, __ATOMIC_RELAXED);
+        chunk_put(chunk);
+    }
+}
+
+static void blocks_unshare(const block_store_t *const bs, const size_t first, const size_t count, const bool keep)
+{
+    for (size_t id = first; bs -> chunks && id < first + count; id++)
+    {
+        block_unshare(bs, id, keep);
+    }
+}
+
+// Doubles a table once it averages a chunk per bucket. Caller holds its lock. 
+static void dedup_grow(dedup_table_t *const table)
+{
+    if (table -> count <= table -> bucket_count)
+    {
+        return;
+    }
+    const size_t count = table -> bucket_count * 2;
+    chunk_t **buckets = calloc(count, sizeof(chunk_t *));
+    if (!buckets)
+    {
+        return;  // Longer chains, no harm done
+    }
+    for (size_t b = 0; b < table -> bucket_count; b++)
+    {
+        for (chunk_t *chunk = table -> buckets[b], *next; chunk; chunk = next)
+        {
+            next = chunk -> next;
+            chunk -> next = buckets[chunk -> hash & (count - 1)];
+            buckets[chunk -> hash & (count - 1)] = chunk;
+        }
+    }
+    free(table -> buckets);
+    table -> buckets = buckets;
+    table -> bucket_count = count;
+}
+
+// Points a block at the chunk holding src, making one if no block has that 
+// payload yet. The arena slot isn't needed any more, so whole pages of it are 
+// handed back. Caller holds the block's shard write lock. 
+static bool dedup_store(const block_store_t *const bs, const size_t block_id, const void *const src)
+{
+    dedup_table_t *table = bs -> dedup;
+    const uint32_t hash = crc32c(0, src, bs -> block_size);
+    pthread_mutex_lock(&table -> lock);
+    chunk_t **bucket = &table -> buckets[hash & (table -> bucket_count - 1)];
+    chunk_t *chunk = *bucket;
+    while (chunk && (chunk -> hash != hash || memcmp(chunk -> data, src, bs -> block_size) || !chunk_get_live(chunk)))
+    {
+        chunk = chunk -> next;
+    }
+    if (!chunk && (chunk = malloc(sizeof(chunk_t) + bs -> block_size)))
+    {
+        chunk -> refs = 1;
+        chunk -> hash = hash;
+        chunk -> table = table;
+        chunk -> home = NULL;
+        chunk -> data = (uint8_t *) (chunk + 1);
+        memcpy(chunk -> data, src, bs -> block_size);
+        chunk -> next = *bucket;
+        *bucket = chunk;
+        __atomic_add_fetch(&table -> refs, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&table -> count, 1, __ATOMIC_RELAXED);
+        dedup_grow(table);
+    }
+    pthread_mutex_unlock(&table -> lock);
+    if (!chunk)
+    {
+        return false;
+    }
+
+    chunk_t *old = bs -> chunks[block_id];
+    bs -> chunks[block_id] = chunk;
+    if (old)
+    {
+        chunk_put(old);
+    }
+    else
+    {
+        __atomic_add_fetch((size_t *) &bs -> shared_blocks, 1, __ATOMIC_RELAXED);
+        madvise(block_addr(bs, block_id), bs -> block_size, MADV_DONTNEED);
+    }
+    return true;
+}
+
+// Replaces the whole of a block's payload, sharing it when dedup is on. Pinned 
+// blocks keep theirs in the slot the pin points at. Caller holds the block's 
+// shard write lock. 
+static void store_block(const block_store_t *const bs, const size_t block_id, const void *const src)
+{
+    if (!bs -> dedup || bs -> pins[block_id] || !dedup_store(bs, block_id, src))
+    {
+        block_unshare(bs, block_id, false);
+        memcpy(block_addr(bs, block_id), src, bs -> block_size);
+    }
+}
+
+// Clears out a newly claimed run of blocks and puts them in use. The claim is 
+// lock-free, the shard locks keep readers of the blocks from seeing half a memset. 
+static void zero_blocks(const block_store_t *const bs, const size_t first, const size_t count)
+{
+    lock_blocks(bs, first, count, true);
+    blocks_unshare(bs, first, count, false);
+    memset(block_addr(bs, first), 0, count * bs -> block_size);
+    bitmap_set_range(bs -> live, first, count);
+    blocks_rewritten(bs, first, count);
+    mark_dirty_range(bs, first, count);
+    journal_log(bs, JOURNAL_ALLOC, first, count, NULL);
+    unlock_blocks(bs, first, count);
+}
+
+// Checks the geometry limits from block_store.h. 
+static bool geometry_is_valid(const size_t num_blocks, const size_t block_size)
+{
+    if (block_size < BLOCK_STORE_MIN_BLOCK_SIZE || block_size > BLOCK_STORE_MAX_BLOCK_SIZE
+        || (block_size & (block_size - 1)))
+    {
+        return false;
+    }
+    if (num_blocks > BLOCK_STORE_MAX_NUM_BLOCKS || num_blocks > SIZE_MAX / block_size)
+    {
+        return false;
+    }
+    // Need at least one user block on top of the FBM. 
+    return num_blocks > fbm_block_count(num_blocks, block_size);
+}
+
+// The FBM's blocks hold the bitmap and nothing after it. Images from before the FBM 
+// moved to the end of the device (it used to be block 127 of the default geometry) 
+// have a user block there instead, which is how they're told apart and refused 
+// rather than loaded with a user block's bytes for an FBM. 
+static bool fbm_is_valid(const block_store_t *const bs)
+{
+    const uint8_t *const fbm = block_addr(bs, bs -> avail_blocks);
+    const size_t fbm_bytes = (bs -> num_blocks - bs -> avail_blocks) * bs -> block_size;
+    const size_t used_bytes = (bs -> avail_blocks + 7) / 8;
+    if (bs -> avail_blocks % 8 && fbm[used_bytes - 1] >> (bs -> avail_blocks % 8))
+    {
+        return false;
+    }
+    for (size_t i = used_bytes; i < fbm_bytes; i++)
+    {
+        if (fbm[i])
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Moves a block between a cache and the FBM. A block can only be in a cache
+// while its FBM bit is set, so claim it from the FBM first and give it back last. 
+static bool cache_block(block_store_t *const bs, const size_t block_id)
+{
+    if (bitmap_test_and_set(bs -> cached, block_id))
+    {
+        return false;
+    }
+    __atomic_add_fetch(&bs -> cached_blocks, 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+static bool uncache_block(block_store_t *const bs, const size_t block_id)
+{
+    if (!bitmap_test_and_reset(bs -> cached, block_id))
+    {
+        return false;
+    }
+    __atomic_sub_fetch(&bs -> cached_blocks, 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+// The calling thread's magazine. Threads are dealt out round robin the first 
+// time they come through, which spreads them evenly whatever their ids are. 
+static magazine_t *thread_magazine(const block_store_t *const bs)
+{
+    static size_t next_slot = 0;
+    static _Thread_local size_t slot = SIZE_MAX;
+    if (slot == SIZE_MAX)
+    {
+        slot = __atomic_fetch_add(&next_slot, 1, __ATOMIC_RELAXED) % MAGAZINE_COUNT;
+    }
+    return &bs -> magazines[slot];
+}
+
+// Takes a block out of a magazine. Entries whose cached bit has gone (the block 
+// was requested by id, or drained by someone else) are stale and skipped. 
+static size_t magazine_pop(block_store_t *const bs, magazine_t *const mag)
+{
+    while (mag -> count)
+    {
+        const size_t id = mag -> ids[--mag -> count];
+        if (uncache_block(bs, id))
+        {
+            return id;
+        }
+    }
+    return SIZE_MAX;
+}
+
+// Claims half a magazine's worth of free blocks from the FBM in one sweep. 
+static void magazine_refill(block_store_t *const bs, magazine_t *const mag)
+{
+    const size_t seen = cursor_get(bs);
+    size_t pos = seen;
+    const size_t want = bs -> magazine_capacity / 2 ? bs -> magazine_capacity / 2 : 1;
+    while (mag -> count < want)
+    {
+        const size_t id = bitmap_claim_first_zero(bs -> fbm, pos);
+        if (id == SIZE_MAX)
+        {
+            break;
+        }
+        cache_block(bs, id);
+        mag -> ids[mag -> count++] = id;
+        pos = id + 1;
+    }
+    cursor_advance(bs, seen, pos);
+}
+
+// Gives the oldest entries of a magazine back to the FBM until only keep are left. 
+static void magazine_drain(block_store_t *const bs, magazine_t *const mag, const size_t keep)
+{
+    if (mag -> count <= keep)
+    {
+        return;
+    }
+    const size_t n = mag -> count - keep;
+    for (size_t i = 0; i < n; i++)
+    {
+        if (uncache_block(bs, mag -> ids[i]))
+        {
+            bitmap_test_and_reset(bs -> fbm, mag -> ids[i]);
+            cursor_lower(bs, mag -> ids[i]);
+        }
+    }
+    memmove(mag -> ids, mag -> ids + n, keep * sizeof(size_t));
+    mag -> count = keep;
+}
+
+// Empties every magazine, for when the FBM has run dry but the caches haven't. 
+static void magazine_drain_all(block_store_t *const bs)
+{
+    for (size_t m = 0; m < MAGAZINE_COUNT; m++)
+    {
+        pthread_mutex_lock(&bs -> magazines[m].lock);
+        magazine_drain(bs, &bs -> magazines[m], 0);
+        pthread_mutex_unlock(&bs -> magazines[m].lock);
+    }
+}
+
+// Tears the caches down, handing every cached block back to the FBM first. 
+static void magazine_free_all(block_store_t *const bs)
+{
+    if (bs -> magazines)
+    {
+        magazine_drain_all(bs);
+        for (size_t m = 0; m < MAGAZINE_COUNT; m++)
+        {
+            pthread_mutex_destroy(&bs -> magazines[m].lock);
+        }
+        free(bs -> magazines[0].ids);
+        free(bs -> magazines);
+        bitmap_destroy(bs -> cached);
+        bs -> magazines = NULL;
+        bs -> cached = NULL;
+        bs -> magazine_capacity = 0;
+    }
+}
+
+
+block_store_t *block_store_create()
+{
+    return block_store_create_ex(BLOCK_STORE_NUM_BLOCKS, BLOCK_SIZE_BYTES);
+}
+
+// Sets up a store around an arena. Without one, a fresh arena is allocated and
+// the FBM gets its own memory. With one (a mapping of the device file fd), the 
+// FBM is overlaid on the arena's tail blocks, which is exactly where the image 
+// format keeps it. The caller still owns the arena and fd if this fails. 
+static block_store_t *store_new(const size_t num_blocks, const size_t block_size, uint8_t *const arena, const int fd)
+{
+    // Create the block store object. 
+    block_store_t *bs = malloc(sizeof(block_store_t));
+    if (!bs)
+    {
+        return NULL;
+    } 
+    bs -> num_blocks = num_blocks;
+    bs -> block_size = block_size;
+    bs -> avail_blocks = num_blocks - fbm_block_count(num_blocks, block_size);
+    bs -> fd = fd;
+    bs -> alloc_policy = BLOCK_STORE_FIRST_FIT;
+    bs -> alloc_cursor = 0;
+    bs -> pinned_blocks = 0;
+    bs -> magazines = NULL;
+    bs -> magazine_capacity = 0;
+    bs -> cached = NULL;
+    bs -> cached_blocks = 0;
+    bs -> writeback_policy = (block_store_writeback_policy_t) { 0, 0 };
+    bs -> writeback_running = false;
+    bs -> writeback_stop = false;
+    bs -> writeback_kick = false;
+    bs -> flush_known = false;
+    bs -> journal_path = NULL;
+    bs -> journal_fd = -1;
+    bs -> journal_appended = 0;
+    bs -> journal_durable = 0;
+    bs -> journal_syncing = false;
+    bs -> checksums = NULL;
+    bs -> unverified = NULL;
+    bs -> chunks = NULL;
+    bs -> shared_blocks = 0;
+    bs -> dedup = NULL;
+    bs -> read_only = false;
+
+    // A mapped store's file already holds its image, a new one has nothing flushed yet. 
+    bs -> dirty = bitmap_create(bs -> avail_blocks);
+    if (bs -> dirty && !arena)
+    {
+        bitmap_format(bs -> dirty, 0xFF);
+    }
+
+    // Initialize the FBM and the block arena. The arena is left uninitialized
+    // (blocks are zeroed as they get allocated) so untouched pages stay free. 
+    if (arena)
+    {
+        bs -> blocks = arena;
+        bs -> fbm = bitmap_overlay(bs -> avail_blocks, block_addr(bs, bs -> avail_blocks));
+    }
+    else
+    {
+        size_t arena_bytes = num_blocks * block_size;
+        arena_bytes = (arena_bytes + BLOCK_ARENA_ALIGN - 1) & ~((size_t) BLOCK_ARENA_ALIGN - 1);
+        bs -> blocks = aligned_alloc(BLOCK_ARENA_ALIGN, arena_bytes);
+        bs -> fbm = bitmap_create(bs -> avail_blocks);
+    }
+    // Whatever a mapped file already has in use is done with. 
+    bs -> live = bs -> fbm ? bitmap_import(bs -> avail_blocks, bitmap_export(bs -> fbm)) : NULL;
+    // Pin counts are mostly never touched, so calloc's lazily zeroed pages keep them cheap. 
+    bs -> pins = calloc(bs -> avail_blocks, sizeof(uint32_t));
+    bs -> shards = aligned_alloc(_Alignof(shard_lock_t), SHARD_COUNT * sizeof(shard_lock_t));
+    if (!bs -> fbm || !bs -> live || !bs -> blocks || !bs -> pins || !bs -> shards || !bs -> dirty || !bitmap_enable_summary(bs -> fbm))
+    {
+        bitmap_destroy(bs -> fbm);
+        bitmap_destroy(bs -> live);
+        bitmap_destroy(bs -> dirty);
+        if (!arena)
+        {
+            free(bs -> blocks);
+        }
+        free(bs -> pins);
+        free(bs -> shards);
+        free(bs);
+        return NULL; 
+    }
+
+    // Default attributes can't fail to initialize on Linux, so no unwinding here. 
+    for (size_t shard = 0; shard < SHARD_COUNT; shard++)
+    {
+        pthread_rwlock_init(&bs -> shards[shard].lock, NULL);
+    }
+    pthread_mutex_init(&bs -> writeback_lock, NULL);
+    pthread_cond_init(&bs -> writeback_wake, NULL);
+    pthread_mutex_init(&bs -> writeback_pass_lock, NULL);
+    pthread_mutex_init(&bs -> journal_lock, NULL);
+    pthread_cond_init(&bs -> journal_synced, NULL);
+    return bs;
+}
+
+block_store_t *block_store_create_ex(const size_t num_blocks, const size_t block_size)
+{
+    if (!geometry_is_valid(num_blocks, block_size))
+    {
+        return NULL;
+    }
+    return store_new(num_blocks, block_size, NULL, -1);
+}
+
+block_store_t *block_store_open_mmap(const char *const filename, const bool create)
+{
+    return block_store_open_mmap_ex(filename, create, BLOCK_STORE_NUM_BLOCKS, BLOCK_SIZE_BYTES);
+}
+
+block_store_t *block_store_open_mmap_ex(const char *const filename, const bool create, const size_t num_blocks, const size_t block_size)
+{
+    // Check for bad inputs. 
+    if (filename == NULL || !strcmp(filename, "") || !geometry_is_valid(num_blocks, block_size))
+    {
+        return NULL;
+    }
+
+    // A new device starts out as a file of zeros, i.e. an empty FBM. ftruncate
+    // leaves it sparse, so that costs nothing until blocks get written. 
+    const size_t image_bytes = num_blocks * block_size;
+    int fd = open(filename, create ? O_CREAT | O_RDWR | O_TRUNC : O_RDWR, 0777);
+    if (fd == -1)
+    {
+        printf("Open Mmap Error (open): %s\n", strerror(errno));
+        return NULL;
+    }
+    struct stat st;
+    if (create && ftruncate(fd, (off_t) image_bytes) == -1)
+    {
+        printf("Open Mmap Error (ftruncate): %s\n", strerror(errno));
+        close(fd);
+        return NULL;
+    }
+    if (fstat(fd, &st) == -1)
+    {
+        printf("Open Mmap Error (fstat): %s\n", strerror(errno));
+        close(fd);
+        return NULL;
+    }
+    if ((size_t) st.st_size != image_bytes)
+    {
+        printf("Open Mmap Error: image is not %zu bytes\n", image_bytes);
+        close(fd);
+        return NULL;
+    }
+
+    // Nothing gets read here, pages come in as blocks are touched. 
+    uint8_t *arena = mmap(NULL, image_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (arena == MAP_FAILED)
+    {
+        printf("Open Mmap Error (mmap): %s\n", strerror(errno));
+        close(fd);
+        return NULL;
+    }
+    block_store_t *bs = store_new(num_blocks, block_size, arena, fd);
+    if (!bs)
+    {
+        munmap(arena, image_bytes);
+        close(fd);
+        return NULL;
+    }
+
+    // A journal left over is the tail end of the last session: gone with a new 
+    // image, something to catch the image up with otherwise. 
+    bs -> journal_path = malloc(strlen(filename) + sizeof(".journal"));
+    if (!bs -> journal_path)
+    {
+        block_store_destroy(bs);
+        return NULL;
+    }
+    strcpy(bs -> journal_path, filename);
+    strcat(bs -> journal_path, ".journal");
+    if (!create && !fbm_is_valid(bs))
+    {
+        printf("Open Mmap Error: %s has no valid FBM\n", filename);
+        block_store_destroy(bs);
+        return NULL;
+    }
+    if (create ? unlink(bs -> journal_path) == -1 && errno != ENOENT : !journal_replay(bs))
+    {
+        printf("Open Mmap Error: could not recover from %s\n", bs -> journal_path);
+        block_store_destroy(bs);
+        return NULL;
+    }
+    return bs;
+}
+
+// Writeback works in runs of dirty blocks; runs closer than this are merged, 
+// msync skips the clean pages between them for free. 
+#define WRITEBACK_GAP_BYTES (64 * 1024)
+
+// What a writeback pass has got up to, as bitmap_for_each hands it the dirty blocks. 
+typedef struct 
+{
+    block_store_t *bs;
+    size_t first, count;  // Run of blocks still to be synced, clean gaps included
+    size_t gap_blocks;
+    bool ok;
+} writeback_state_t;
+
+// msyncs a byte range of the mapping, widened out to whole pages. 
+static bool sync_range(const block_store_t *const bs, const size_t offset, const size_t len)
+{
+    const size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    const size_t start = offset & ~(page - 1);
+    if (msync(bs -> blocks + start, offset + len - start, MS_SYNC) == -1)
+    {
+        printf("Writeback Error (msync): %s\n", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+static void writeback_run(writeback_state_t *const state)
+{
+    if (state -> count)
+    {
+        const size_t block_size = state -> bs -> block_size;
+        state -> ok &= sync_range(state -> bs, state -> first * block_size, state -> count * block_size);
+        state -> count = 0;
+    }
+}
+
+static void writeback_block(const size_t block_id, void *arg)
+{
+    writeback_state_t *state = arg;
+    if (state -> count && block_id - (state -> first + state -> count) <= state -> gap_blocks)
+    {
+        state -> count = block_id + 1 - state -> first;
+        return;
+    }
+    writeback_run(state);
+    state -> first = block_id;
+    state -> count = 1;
+}
+
+static void redirty_block(const size_t block_id, void *arg)
+{
+    bitmap_test_and_set(arg, block_id);
+}
+
+// Writes every block that is dirty now back to the file and waits for it. The 
+// dirty set is swapped out under the shard locks and synced after they're 
+// dropped, so writers only wait for the swap, never for the disk. Anything 
+// written meanwhile is marked in the new set and left for the next pass. 
+static bool writeback_pass(block_store_t *const bs)
+{
+    pthread_mutex_lock(&bs -> writeback_pass_lock);
+    lock_blocks(bs, 0, bs -> avail_blocks, false);
+    const uint64_t journaled = __atomic_load_n(&bs -> journal_appended, __ATOMIC_RELAXED);
+    bitmap_t *dirty = bitmap_import(bs -> avail_blocks, bitmap_export(bs -> dirty));
+    if (dirty)
+    {
+        restart_dirty(bs);
+    }
+    unlock_blocks(bs, 0, bs -> avail_blocks);
+    if (!dirty)
+    {
+        pthread_mutex_unlock(&bs -> writeback_pass_lock);
+        return false;
+    }
+
+    // The FBM is always synced, it changes with every allocation. Every journaled 
+    // change marked its block dirty, so once the snapshot is on disk everything 
+    // the journal held up to it can go. 
+    writeback_state_t state = { .bs = bs, .first = 0, .count = 0, .gap_blocks = WRITEBACK_GAP_BYTES / bs -> block_size, .ok = true };
+    bitmap_for_each(dirty, writeback_block, &state);
+    writeback_run(&state);
+    state.ok &= sync_range(bs, bs -> avail_blocks * bs -> block_size, (bs -> num_blocks - bs -> avail_blocks) * bs -> block_size);
+    if (state.ok && __atomic_load_n(&bs -> journal_fd, __ATOMIC_RELAXED) != -1)
+    {
+        pthread_mutex_lock(&bs -> journal_lock);
+        journal_trim(bs, journaled);
+        pthread_mutex_unlock(&bs -> journal_lock);
+    }
+    if (!state.ok)
+    {
+        // Try again next time. 
+        bitmap_for_each(dirty, redirty_block, bs -> dirty);
+    }
+    bitmap_destroy(dirty);
+    pthread_mutex_unlock(&bs -> writeback_pass_lock);
+    return state.ok;
+}
+
+// The worker sleeps until it's kicked for too many dirty blocks or the policy's 
+// age limit comes round, then does a pass. 
+static void *writeback_worker(void *arg)
+{
+    block_store_t *bs = arg;
+    pthread_mutex_lock(&bs -> writeback_lock);
+    while (!bs -> writeback_stop)
+    {
+        if (!bs -> writeback_kick)
+        {
+            const unsigned age_ms = bs -> writeback_policy.max_age_ms;
+            if (age_ms)
+            {
+                struct timespec deadline;
+                clock_gettime(CLOCK_REALTIME, &deadline);
+                deadline.tv_sec += age_ms / 1000;
+                deadline.tv_nsec += (long) (age_ms % 1000) * 1000000;
+                if (deadline.tv_nsec >= 1000000000)
+                {
+                    deadline.tv_sec++;
+                    deadline.tv_nsec -= 1000000000;
+                }
+                pthread_cond_timedwait(&bs -> writeback_wake, &bs -> writeback_lock, &deadline);
+            }
+            else
+            {
+                pthread_cond_wait(&bs -> writeback_wake, &bs -> writeback_lock);
+            }
+        }
+        if (bs -> writeback_stop)
+        {
+            break;
+        }
+        // Clear the kick before the pass, anything dirtied during it can kick again. 
+        __atomic_store_n(&bs -> writeback_kick, false, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&bs -> writeback_lock);
+        writeback_pass(bs);
+        pthread_mutex_lock(&bs -> writeback_lock);
+    }
+    pthread_mutex_unlock(&bs -> writeback_lock);
+    return NULL;
+}
+
+static void writeback_stop_worker(block_store_t *const bs)
+{
+    pthread_mutex_lock(&bs -> writeback_lock);
+    const bool running = bs -> writeback_running;
+    bs -> writeback_stop = true;
+    pthread_cond_signal(&bs -> writeback_wake);
+    pthread_mutex_unlock(&bs -> writeback_lock);
+    if (running)
+    {
+        pthread_join(bs -> writeback_thread, NULL);
+    }
+    pthread_mutex_lock(&bs -> writeback_lock);
+    bs -> writeback_running = false;
+    bs -> writeback_stop = false;
+    pthread_mutex_unlock(&bs -> writeback_lock);
+}
+
+bool block_store_set_writeback_policy(block_store_t *const bs, const block_store_writeback_policy_t *const policy)
+{
+    // Check for bad inputs. Only file-backed stores have somewhere to write back to. 
+    if (bs == NULL || bs -> fd == -1)
+    {
+        return false;
+    }
+
+    // No limits at all means no worker. 
+    const bool wanted = policy && (policy -> max_dirty_blocks || policy -> max_age_ms);
+    if (!wanted)
+    {
+        pthread_mutex_lock(&bs -> writeback_lock);
+        __atomic_store_n(&bs -> writeback_policy.max_dirty_blocks, 0, __ATOMIC_RELAXED);
+        bs -> writeback_policy.max_age_ms = 0;
+        pthread_mutex_unlock(&bs -> writeback_lock);
+        writeback_stop_worker(bs);
+        return true;
+    }
+
+    // A running worker just has to be woken up to pick up the new limits. A new 
+    // one blocks on the lock until its state is all in place. 
+    bool ok = true;
+    pthread_mutex_lock(&bs -> writeback_lock);
+    __atomic_store_n(&bs -> writeback_policy.max_dirty_blocks, policy -> max_dirty_blocks, __ATOMIC_RELAXED);
+    bs -> writeback_policy.max_age_ms = policy -> max_age_ms;
+    if (bs -> writeback_running)
+    {
+        pthread_cond_signal(&bs -> writeback_wake);
+    }
+    else if (pthread_create(&bs -> writeback_thread, NULL, writeback_worker, bs) == 0)
+    {
+        bs -> writeback_running = true;
+    }
+    else
+    {
+        printf("Writeback Error (pthread_create): could not start the worker\n");
+        __atomic_store_n(&bs -> writeback_policy.max_dirty_blocks, 0, __ATOMIC_RELAXED);
+        bs -> writeback_policy.max_age_ms = 0;
+        ok = false;
+    }
+    pthread_mutex_unlock(&bs -> writeback_lock);
+    return ok;
+}
+
+bool block_store_barrier(block_store_t *const bs)
+{
+    // Check for bad inputs. 
+    if (bs == NULL || bs -> fd == -1)
+    {
+        return false;
+    }
+    return writeback_pass(bs);
+}
+
+bool block_store_set_journal(block_store_t *const bs, const bool enable)
+{
+    // Check for bad inputs. Only file-backed stores have an image to protect. 
+    if (bs == NULL || bs -> fd == -1)
+    {
+        return false;
+    }
+
+    bool ok = true;
+    pthread_mutex_lock(&bs -> journal_lock);
+    if (enable && bs -> journal_fd == -1)
+    {
+        const int fd = open(bs -> journal_path, O_CREAT | O_WRONLY | O_APPEND, 0777);
+        if (fd == -1)
+        {
+            printf("Journal Error (open): %s\n", strerror(errno));
+            ok = false;
+        }
+        __atomic_store_n(&bs -> journal_fd, fd, __ATOMIC_RELAXED);
+    }
+    else if (!enable && bs -> journal_fd != -1)
+    {
+        // The journal can only go once the image has everything in it. 
+        ok = msync(bs -> blocks, bs -> num_blocks * bs -> block_size, MS_SYNC) == 0;
+        if (!ok)
+        {
+            printf("Journal Error (msync): %s\n", strerror(errno));
+        }
+        else
+        {
+            // Wait out anyone still syncing the old one. 
+            while (bs -> journal_syncing)
+            {
+                pthread_cond_wait(&bs -> journal_synced, &bs -> journal_lock);
+            }
+            close(bs -> journal_fd);
+            unlink(bs -> journal_path);
+            __atomic_store_n(&bs -> journal_fd, -1, __ATOMIC_RELAXED);
+            bs -> journal_durable = bs -> journal_appended;
+            pthread_cond_broadcast(&bs -> journal_synced);
+        }
+    }
+    pthread_mutex_unlock(&bs -> journal_lock);
+    return ok;
+}
+
+bool block_store_set_dedup(block_store_t *const bs, const bool enable)
+{
+    // Check for bad inputs. A mapped file's blocks have to stay in the mapping, and 
+    // sharing only saves memory if the slots it empties are whole pages. 
+    if (bs == NULL || bs -> fd != -1 || bs -> read_only 
+        || (enable && bs -> block_size < (size_t) sysconf(_SC_PAGESIZE)))
+    {
+        return false;
+    }
+
+    bool ok = true;
+    lock_blocks(bs, 0, bs -> avail_blocks, true);
+    if (enable && !bs -> dedup)
+    {
+        dedup_table_t *table = malloc(sizeof(dedup_table_t));
+        chunk_t **buckets = calloc(DEDUP_MIN_BUCKETS, sizeof(chunk_t *));
+        if (!bs -> chunks)
+        {
+            bs -> chunks = calloc(bs -> avail_blocks, sizeof(chunk_t *));
+        }
+        ok = table && buckets && bs -> chunks;
+        if (ok)
+        {
+            *table = (dedup_table_t) { .refs = 1, .buckets = buckets, .bucket_count = DEDUP_MIN_BUCKETS, .count = 0 };
+            pthread_mutex_init(&table -> lock, NULL);
+            bs -> dedup = table;
+        }
+        else
+        {
+            free(table);
+            free(buckets);
+        }
+    }
+    else if (!enable && bs -> dedup)
+    {
+        // Every block gets its own payload back. Clones may still be sharing 
+        // some of the table's chunks, they keep the table around until they're done. 
+        for (size_t id = 0; id < bs -> avail_blocks; id++)
+        {
+            if (bs -> chunks[id] && bs -> chunks[id] -> table == bs -> dedup)
+            {
+                block_unshare(bs, id, true);
+            }
+        }
+        dedup_table_put(bs -> dedup);
+        bs -> dedup = NULL;
+    }
+    unlock_blocks(bs, 0, bs -> avail_blocks);
+    return ok;
+}
+
+size_t block_store_get_payload_copies(const block_store_t *const bs)
+{
+    // Check for bad inputs. 
+    if (bs == NULL || bs -> fbm == NULL) 
+    {
+        return SIZE_MAX;
+    }
+    const size_t tabled = bs -> dedup ? __atomic_load_n(&bs -> dedup -> count, __ATOMIC_RELAXED) : 0;
+    return used_blocks(bs) - __atomic_load_n(&bs -> shared_blocks, __ATOMIC_RELAXED) + tabled;
+}
+
+// Makes a store with the same blocks as bs, sharing every payload. Blocks of bs 
+// that still have theirs in its arena get chunks pointing there, and bs moves to 
+// a fresh arena, leaving the old one to those chunks; whoever writes a block next 
+// copies it. The FBM and checksums are small enough to just copy. 
+static block_store_t *store_fork(block_store_t *const bs, const bool read_only)
+{
+    // Check for bad inputs. A mapped file's arena can't be handed over. 
+    if (bs == NULL || bs -> fd != -1)
+    {
+        return NULL;
+    }
+    block_store_t *fork = store_new(bs -> num_blocks, bs -> block_size, NULL, -1);
+    if (!fork)
+    {
+        return NULL;
+    }
+    fork -> alloc_policy = bs -> alloc_policy;
+    fork -> read_only = read_only;
+    fork -> chunks = calloc(fork -> avail_blocks, sizeof(chunk_t *));
+    bool ok = fork -> chunks != NULL;
+
+    // Pinned payloads have to stay where their pointers are. 
+    lock_blocks(bs, 0, bs -> avail_blocks, true);
+    if (ok && __atomic_load_n(&bs -> pinned_blocks, __ATOMIC_RELAXED))
+    {
+        printf("Fork Error: blocks are pinned\n");
+        ok = false;
+    }
+    if (ok && !bs -> chunks)
+    {
+        ok = (bs -> chunks = calloc(bs -> avail_blocks, sizeof(chunk_t *))) != NULL;
+    }
+
+    // Everything that can fail comes first, so nothing needs undoing after. Claims 
+    // and caches flip FBM bits without the shard locks, so the blocks in use are 
+    // read once, into the fork's FBM, and everything after goes by that. Blocks 
+    // claimed but not cleared yet aren't in use, the fork gets them free. 
+    size_t fresh = 0;
+    for (size_t id = 0; ok && id < bs -> avail_blocks; id++)
+    {
+        if (in_use(bs, id))
+        {
+            bitmap_set(fork -> fbm, id);
+            bitmap_set(fork -> live, id);
+            fresh += !is_shared(bs, id);
+        }
+    }
+    chunk_t **made = ok && fresh ? calloc(fresh, sizeof(chunk_t *)) : NULL;
+    frozen_arena_t *home = ok && fresh ? malloc(sizeof(frozen_arena_t)) : NULL;
+    uint8_t *arena = NULL;
+    if (ok && fresh)
+    {
+        size_t arena_bytes = bs -> num_blocks * bs -> block_size;
+        arena_bytes = (arena_bytes + BLOCK_ARENA_ALIGN - 1) & ~((size_t) BLOCK_ARENA_ALIGN - 1);
+        arena = aligned_alloc(BLOCK_ARENA_ALIGN, arena_bytes);
+        ok = made && home && arena;
+        for (size_t k = 0; ok && k < fresh; k++)
+        {
+            ok = (made[k] = malloc(sizeof(chunk_t))) != NULL;
+        }
+    }
+    if (ok && bs -> checksums)
+    {
+        fork -> checksums = malloc(bs -> avail_blocks * sizeof(uint32_t));
+        fork -> unverified = bs -> unverified ? bitmap_import(bs -> avail_blocks, bitmap_export(bs -> unverified)) : NULL;
+        ok = fork -> checksums && (fork -> unverified || !bs -> unverified);
+        if (ok)
+        {
+            memcpy(fork -> checksums, bs -> checksums, bs -> avail_blocks * sizeof(uint32_t));
+        }
+    }
+
+    if (ok)
+    {
+        size_t k = 0;
+        for (size_t id = 0; id < bs -> avail_blocks; id++)
+        {
+            if (!bitmap_test(fork -> fbm, id))
+            {
+                continue;
+            }
+            if (!is_shared(bs, id))
+            {
+                *made[k] = (chunk_t) { .refs = 1, .hash = 0, .next = NULL, .table = NULL, .home = home, .data = block_addr(bs, id) };
+                bs -> chunks[id] = made[k++];
+                bs -> shared_blocks++;
+            }
+            __atomic_add_fetch(&bs -> chunks[id] -> refs, 1, __ATOMIC_RELAXED);
+            fork -> chunks[id] = bs -> chunks[id];
+            fork -> shared_blocks++;
+        }
+        if (fresh)
+        {
+            *home = (frozen_arena_t) { .refs = fresh, .blocks = bs -> blocks };
+            bs -> blocks = arena;
+        }
+    }
+    else
+    {
+        for (size_t k = 0; made && k < fresh; k++)
+        {
+            free(made[k]);
+        }
+        free(home);
+        free(arena);
+    }
+    unlock_blocks(bs, 0, bs -> avail_blocks);
+    free(made);
+
+    if (!ok)
+    {
+        block_store_destroy(fork);
+        return NULL;
+    }
+    return fork;
+}
+
+block_store_t *block_store_snapshot(block_store_t *const bs)
+{
+    return store_fork(bs, true);
+}
+
+block_store_t *block_store_clone(block_store_t *const bs)
+{
+    return store_fork(bs, false);
+}
+
+bool block_store_sync(block_store_t *const bs)
+{
+    // Check for bad inputs. Only file-backed stores have anything to sync. 
+    if (bs == NULL || bs -> fd == -1)
+    {
+        return false;
+    }
+
+    // The FBM lives in the mapping too, so this covers it. Holding the journal 
+    // still meanwhile means all of it is covered too, and it can be emptied. 
+    pthread_mutex_lock(&bs -> journal_lock);
+    const bool ok = msync(bs -> blocks, bs -> num_blocks * bs -> block_size, MS_SYNC) == 0;
+    if (!ok)
+    {
+        printf("Sync Error (msync): %s\n", strerror(errno));
+    }
+    else
+    {
+        journal_trim(bs, bs -> journal_appended);
+    }
+    pthread_mutex_unlock(&bs -> journal_lock);
+    return ok;
+}
+
+void block_store_destroy(block_store_t *const bs)
+{
+   // If it exists, destroy the block store, its arena and its FBM. 
+   if (bs) 
+   {
+        // The worker has to be gone before anything it looks at is. 
+        writeback_stop_worker(bs);
+        magazine_free_all(bs);
+        blocks_unshare(bs, 0, bs -> avail_blocks, false);
+        if (bs -> dedup)
+        {
+            dedup_table_put(bs -> dedup);
+        }
+        free(bs -> chunks);
+        for (size_t shard = 0; shard < SHARD_COUNT; shard++)
+        {
+            pthread_rwlock_destroy(&bs -> shards[shard].lock);
+        }
+        pthread_mutex_destroy(&bs -> writeback_lock);
+        pthread_cond_destroy(&bs -> writeback_wake);
+        pthread_mutex_destroy(&bs -> writeback_pass_lock);
+        pthread_mutex_destroy(&bs -> journal_lock);
+        pthread_cond_destroy(&bs -> journal_synced);
+        free(bs -> shards);
+        bitmap_destroy(bs -> fbm);
+        bitmap_destroy(bs -> live);
+        bitmap_destroy(bs -> dirty);
+        bitmap_destroy(bs -> unverified);
+        free(bs -> checksums);
+        if (bs -> fd != -1)
+        {
+            // Unmapping doesn't lose anything, the page cache writes it back in its own time. 
+            // The journal stays, it's replayed next time if that time never comes. 
+            munmap(bs -> blocks, bs -> num_blocks * bs -> block_size);
+            close(bs -> fd);
+            if (bs -> journal_fd != -1)
+            {
+                close(bs -> journal_fd);
+            }
+            free(bs -> journal_path);
+        }
+        else
+        {
+            free(bs -> blocks);
+        }
+        free(bs -> pins);
+        free(bs);
+   }
+}
+
+
+size_t block_store_allocate(block_store_t *const bs)
+{
+    // Bad inputs. 
+    if (!bs || bs -> read_only)
+    {
+        return SIZE_MAX;
+    } 
+
+    // With caching on, try this thread's magazine first, refilling it if it's empty. 
+    size_t id = SIZE_MAX;
+    if (bs -> magazines)
+    {
+        magazine_t *mag = thread_magazine(bs);
+        pthread_mutex_lock(&mag -> lock);
+        id = magazine_pop(bs, mag);
+        if (id == SIZE_MAX)
+        {
+            magazine_refill(bs, mag);
+            id = magazine_pop(bs, mag);
+        }
+        pthread_mutex_unlock(&mag -> lock);
+        if (id == SIZE_MAX)
+        {
+            // The FBM is out, but other threads' caches may not be. 
+            magazine_drain_all(bs);
+        }
+    }
+
+    // Claim the next free block from the cursor and clear out the old contents. 
+    // Either way everything up to the block we take is worth skipping next time. 
+    if (id == SIZE_MAX)
+    {
+        const size_t seen = cursor_get(bs);
+        id = bitmap_claim_first_zero(bs -> fbm, seen);
+        if (id == SIZE_MAX)
+        {
+            return SIZE_MAX;
+        }
+        cursor_advance(bs, seen, id + 1);
+    }
+    zero_blocks(bs, id, 1);
+    return id;
+}
+
+size_t block_store_allocate_near(block_store_t *const bs, const size_t hint)
+{
+    // Bad inputs. 
+    if (!bs || bs -> read_only)
+    {
+        return SIZE_MAX;
+    } 
+
+    // Leaves the cursor alone, taking a block never breaks its first fit guarantee. 
+    const size_t id = bitmap_claim_first_zero(bs -> fbm, hint);
+    if (id != SIZE_MAX)
+    {
+        zero_blocks(bs, id, 1);
+    }
+    return id;
+}
+
+void block_store_set_alloc_policy(block_store_t *const bs, const block_store_alloc_policy_t policy)
+{
+    if (bs)
+    {
+        __atomic_store_n(&bs -> alloc_policy, policy, __ATOMIC_RELAXED);
+        // Only first fit cares where the cursor is, and it has to start from a known-good spot. 
+        __atomic_store_n(&bs -> alloc_cursor, 0, __ATOMIC_RELAXED);
+    }
+}
+
+bool block_store_set_thread_cache(block_store_t *const bs, const size_t capacity)
+{
+    // Check for bad inputs. Cached blocks keep their FBM bits, and a mapped file's 
+    // FBM reaches the file whether it's synced or not, so anything that never gets 
+    // as far as destroying the store would leave them in use for good. 
+    if (bs == NULL || bs -> fd != -1 || capacity > BLOCK_STORE_MAX_THREAD_CACHE)
+    {
+        return false;
+    }
+
+    // Start from scratch, whatever was cached goes back to the FBM. 
+    magazine_free_all(bs);
+    if (capacity == 0)
+    {
+        return true;
+    }
+
+    // One allocation for all the stacks, hanging off the first magazine. 
+    bs -> magazines = aligned_alloc(_Alignof(magazine_t), MAGAZINE_COUNT * sizeof(magazine_t));
+    size_t *ids = malloc(MAGAZINE_COUNT * capacity * sizeof(size_t));
+    bs -> cached = bitmap_create(bs -> avail_blocks);
+    if (!bs -> magazines || !ids || !bs -> cached)
+    {
+        free(bs -> magazines);
+        free(ids);
+        bitmap_destroy(bs -> cached);
+        bs -> magazines = NULL;
+        bs -> cached = NULL;
+        return false;
+    }
+    for (size_t m = 0; m < MAGAZINE_COUNT; m++)
+    {
+        pthread_mutex_init(&bs -> magazines[m].lock, NULL);
+        bs -> magazines[m].count = 0;
+        bs -> magazines[m].ids = ids + m * capacity;
+    }
+    bs -> magazine_capacity = capacity;
+    return true;
+}
+
+
+bool block_store_request(block_store_t *const bs, const size_t block_id)
+{
+    // Check for bad inputs. 
+    if (bs != NULL && !bs -> read_only) 
+    {
+        if (bs -> fbm != NULL) 
+        {
+            if (block_id < bs -> avail_blocks) 
+            {
+                // Return if requested block in use, otherwise it's ours. A cached
+                // block is free, so take it from the cache (leaving a stale entry). 
+                if (bitmap_test_and_set(bs -> fbm, block_id) && !(bs -> cached && uncache_block(bs, block_id))) 
+                {
+                    return false;
+                }
+
+                // Clear out the old contents. 
+                zero_blocks(bs, block_id, 1);
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// Frees the specified block
+void block_store_release(block_store_t *const bs, const size_t block_id)
+{
+    // Check for bad inputs. 
+    if (bs != NULL && !bs -> read_only) 
+    {
+        if (bs -> fbm != NULL) 
+        {
+            if (block_id < bs -> avail_blocks) {
+                // The shard lock keeps a pin from landing between the check and the release. 
+                // With caching on, the block goes to this thread's cache instead of the FBM. 
+                lock_block(bs, block_id, true);
+                bool cached = false;
+                if (!is_pinned(bs, block_id) && in_use(bs, block_id))
+                {
+                    bitmap_reset(bs -> live, block_id);
+                    block_unshare(bs, block_id, false);
+                    mark_dirty(bs, block_id);
+                    journal_log(bs, JOURNAL_FREE, block_id, 1, NULL);
+                    if (bs -> magazines)
+                    {
+                        cached = cache_block(bs, block_id);
+                    }
+                    else if (bitmap_test_and_reset(bs -> fbm, block_id))
+                    {
+                        // The arena slot is simply reused. 
+                        cursor_lower(bs, block_id);
+                    }
+                }
+                unlock_block(bs, block_id);
+
+                if (cached)
+                {
+                    // Full magazines keep the newest half, those are the warmest. 
+                    magazine_t *mag = thread_magazine(bs);
+                    pthread_mutex_lock(&mag -> lock);
+                    if (mag -> count == bs -> magazine_capacity)
+                    {
+                        magazine_drain(bs, mag, bs -> magazine_capacity / 2);
+                    }
+                    mag -> ids[mag -> count++] = block_id;
+                    pthread_mutex_unlock(&mag -> lock);
+                }
+            }
+        }
+    }
+}
+
+
+bool block_store_allocate_extent(block_store_t *const bs, const size_t count, size_t *const first_id)
+{
+    // Check for bad inputs. 
+    if (bs == NULL || bs -> read_only || first_id == NULL || count == 0 || count > bs -> avail_blocks)
+    {
+        return false;
+    }
+
+    // Same starting point as block_store_allocate, then once more from the beginning. 
+    // Losing the claim to another thread just means looking again past that run. 
+    const size_t seen = cursor_get(bs);
+    size_t from = seen, id;
+    bool wrapped = seen == 0, drained = !bs -> magazines;
+    for (;;)
+    {
+        id = bitmap_find_zero_run(bs -> fbm, from, count);
+        if (id == SIZE_MAX)
+        {
+            if (wrapped && drained)
+            {
+                return false;
+            }
+            if (wrapped)
+            {
+                // The thread caches might be what's breaking up the free space. 
+                magazine_drain_all(bs);
+                drained = true;
+            }
+            wrapped = true;
+            from = 0;
+        }
+        else if (bitmap_claim_range(bs -> fbm, id, count))
+        {
+            break;
+        }
+        else
+        {
+            from = id + 1;
+        }
+    }
+
+    // The blocks are adjacent in the arena too, so one memset clears them all. 
+    if (__atomic_load_n(&bs -> alloc_policy, __ATOMIC_RELAXED) == BLOCK_STORE_NEXT_FIT || id == seen)
+    {
+        cursor_advance(bs, seen, id + count);
+    }
+    zero_blocks(bs, id, count);
+    *first_id = id;
+    return true;
+}
+
+void block_store_release_extent(block_store_t *const bs, const size_t first_id, const size_t count)
+{
+    // Check for bad inputs. 
+    if (bs == NULL || bs -> read_only || first_id >= bs -> avail_blocks || count > bs -> avail_blocks - first_id)
+    {
+        return;
+    }
+
+    lock_blocks(bs, first_id, count, true);
+    if (!__atomic_load_n(&bs -> pinned_blocks, __ATOMIC_RELAXED) && !bs -> magazines)
+    {
+        bitmap_reset_range(bs -> live, first_id, count);
+        bitmap_reset_range(bs -> fbm, first_id, count);
+        blocks_unshare(bs, first_id, count, false);
+        mark_dirty_range(bs, first_id, count);
+        journal_log(bs, JOURNAL_FREE, first_id, count, NULL);
+    }
+    else
+    {
+        // Have to pick around the pinned and cached ones. 
+        for (size_t id = first_id; id < first_id + count; id++)
+        {
+            if (!bs -> pins[id] && in_use(bs, id))
+            {
+                bitmap_reset(bs -> live, id);
+                bitmap_test_and_reset(bs -> fbm, id);
+                block_unshare(bs, id, false);
+                mark_dirty(bs, id);
+                journal_log(bs, JOURNAL_FREE, id, 1, NULL);
+            }
+        }
+    }
+    unlock_blocks(bs, first_id, count);
+    cursor_lower(bs, first_id);
+}
+
+size_t block_store_allocate_many(block_store_t *const bs, const size_t n, size_t *const ids_out)
+{
+    // Check for bad inputs, and whether there is enough room at all (that's O(1)). 
+    if (bs == NULL || bs -> read_only || ids_out == NULL || n == 0 || n > bs -> avail_blocks - used_blocks(bs))
+    {
+        return 0;
+    }
+    if (bs -> magazines && n > bs -> avail_blocks - bitmap_total_set(bs -> fbm))
+    {
+        // The room is there, but some of it is in thread caches. 
+        magazine_drain_all(bs);
+    }
+
+    // One sweep from the cursor. Other threads can still get to the last free 
+    // blocks first, in which case hand back what we got. 
+    const size_t seen = cursor_get(bs);
+    size_t pos = seen;
+    for (size_t i = 0; i < n; i++)
+    {
+        const size_t id = bitmap_claim_first_zero(bs -> fbm, pos);
+        if (id == SIZE_MAX)
+        {
+            while (i--)
+            {
+                bitmap_test_and_reset(bs -> fbm, ids_out[i]);
+                cursor_lower(bs, ids_out[i]);
+            }
+            return 0;
+        }
+        ids_out[i] = id;
+        pos = id + 1;
+    }
+
+    // Clear the payloads, in one go for each run of adjacent ids. 
+    for (size_t i = 0, run; i < n; i += run)
+    {
+        for (run = 1; i + run < n && ids_out[i + run] == ids_out[i] + run; run++)
+        {
+        }
+        zero_blocks(bs, ids_out[i], run);
+    }
+    cursor_advance(bs, seen, pos);
+    return n;
+}
+
+// Orders block ids for qsort. 
+static int compare_ids(const void *const a, const void *const b)
+{
+    const size_t x = *(const size_t *) a, y = *(const size_t *) b;
+    return (x > y) - (x < y);
+}
+
+bool block_store_request_many(block_store_t *const bs, const size_t *const ids, const size_t n)
+{
+    // Check for bad inputs. 
+    if (bs == NULL || bs -> read_only || ids == NULL)
+    {
+        return false;
+    }
+    for (size_t i = 0; i < n; i++)
+    {
+        if (ids[i] >= bs -> avail_blocks)
+        {
+            return false;
+        }
+    }
+
+    if (n == 0)
+    {
+        return true;
+    }
+
+    // Work on a sorted copy, so adjacent ids can be zeroed (and locked) as runs. 
+    size_t *sorted = malloc(n * sizeof(size_t));
+    if (sorted == NULL)
+    {
+        return false;
+    }
+    memcpy(sorted, ids, n * sizeof(size_t));
+    qsort(sorted, n, sizeof(size_t), compare_ids);
+
+    // Claim them in order. Anything already in use (including a repeat within 
+    // the list) undoes what we claimed so far. 
+    for (size_t i = 0; i < n; i++)
+    {
+        if (bitmap_test_and_set(bs -> fbm, sorted[i]) && !(bs -> cached && uncache_block(bs, sorted[i])))
+        {
+            while (i--)
+            {
+                bitmap_test_and_reset(bs -> fbm, sorted[i]);
+            }
+            free(sorted);
+            return false;
+        }
+    }
+
+    // Clear the payloads, in one go for each run of adjacent ids. 
+    for (size_t i = 0, run; i < n; i += run)
+    {
+        for (run = 1; i + run < n && sorted[i + run] == sorted[i] + run; run++)
+        {
+        }
+        zero_blocks(bs, sorted[i], run);
+    }
+    free(sorted);
+    return true;
+}
+
+void block_store_release_many(block_store_t *const bs, const size_t *const ids, const size_t n)
+{
+    // Check for bad inputs. 
+    if (bs == NULL || bs -> read_only || ids == NULL)
+    {
+        return;
+    }
+
+    // One acquisition of each shard lock the batch needs, for the whole batch. 
+    uint64_t shards = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        if (ids[i] < bs -> avail_blocks)
+        {
+            shards |= (uint64_t) 1 << SHARD_OF(ids[i]);
+        }
+    }
+    lock_shards(bs, shards, true);
+    size_t lowest = SIZE_MAX;
+    for (size_t i = 0; i < n; i++)
+    {
+        // Same as block_store_release, bad and pinned ids are skipped. 
+        if (ids[i] < bs -> avail_blocks && !is_pinned(bs, ids[i]) && in_use(bs, ids[i])
+            && bitmap_test_and_reset(bs -> fbm, ids[i]))
+        {
+            bitmap_reset(bs -> live, ids[i]);
+            block_unshare(bs, ids[i], false);
+            mark_dirty(bs, ids[i]);
+            journal_log(bs, JOURNAL_FREE, ids[i], 1, NULL);
+            lowest = ids[i] < lowest ? ids[i] : lowest;
+        }
+    }
+    unlock_shards(bs, shards);
+    cursor_lower(bs, lowest);
+}
+
+size_t block_store_get_used_blocks(const block_store_t *const bs)
+{
+    // Check for bad inputs. 
+    if (bs == NULL || bs -> fbm == NULL) 
+    {
+        return SIZE_MAX;
+    }
+
+    // Return # of blocks in use. Cached blocks are set in the FBM but free. 
+    return used_blocks(bs);
+}
+
+size_t block_store_get_free_blocks(const block_store_t *const bs)
+{
+    // Check for bad inputs. 
+    if (bs == NULL || bs -> fbm == NULL) 
+    {
+        return SIZE_MAX;
+    }
+
+    // Return # of free blocks. 
+    return bs -> avail_blocks - used_blocks(bs);
+}
+
+
+size_t block_store_get_total_blocks()
+{
+    return BLOCK_STORE_AVAIL_BLOCKS;
+}
+
+size_t block_store_get_total_blocks_ex(const block_store_t *const bs)
+{
+    return bs ? bs -> avail_blocks : SIZE_MAX;
+}
+
+size_t block_store_get_block_size(const block_store_t *const bs)
+{
+    return bs ? bs -> block_size : 0;
+}
+
+size_t block_store_read(const block_store_t *const bs, const size_t block_id, void *buffer)
+{
+    // Check for bad inputs. 
+    if (bs == NULL || buffer == NULL || block_id >= bs -> avail_blocks) 
+    {
+        return 0;
+    }
+
+    // Copy the block's contents into the given buffer.  
+    bool ok = true;
+    lock_block(bs, block_id, false);
+    if (in_use(bs, block_id) && (ok = block_verified(bs, block_id)))
+    {
+        memcpy(buffer, block_payload(bs, block_id), bs -> block_size);
+    }
+    unlock_block(bs, block_id);
+    return ok ? bs -> block_size : 0;
+}
+
+
+size_t block_store_write(block_store_t *const bs, const size_t block_id, const void *buffer)
+{
+    // Check for bad inputs.
+    if (bs == NULL || bs -> read_only || buffer == NULL || block_id >= bs -> avail_blocks) 
+    {
+        return 0;
+    }
+
+    // Copy the buffer's contents into the block. With a journal, it's only 
+    // written once it's logged and the log is on disk. 
+    uint64_t seq = 0;
+    bool logged = true;
+    lock_block(bs, block_id, true);
+    if (in_use(bs, block_id))
+    {
+        store_block(bs, block_id, buffer);
+        blocks_rewritten(bs, block_id, 1);
+        mark_dirty(bs, block_id);
+        logged = journal_log(bs, JOURNAL_DATA, block_id * bs -> block_size, bs -> block_size, &seq);
+    }
+    unlock_block(bs, block_id);
+    return logged && journal_commit(bs, seq) ? bs -> block_size : 0;
+}
+
+
+size_t block_store_pread(const block_store_t *const bs, const size_t block_id, const size_t offset, const size_t len, void *buffer)
+{
+    // Check for bad inputs, the range has to stay inside the block. 
+    if (bs == NULL || buffer == NULL || block_id >= bs -> avail_blocks 
+        || offset > bs -> block_size || len > bs -> block_size - offset) 
+    {
+        return 0;
+    }
+
+    bool ok = true;
+    lock_block(bs, block_id, false);
+    if (in_use(bs, block_id) && (ok = block_verified(bs, block_id)))
+    {
+        memcpy(buffer, block_payload(bs, block_id) + offset, len);
+    }
+    unlock_block(bs, block_id);
+    return ok ? len : 0;
+}
+
+size_t block_store_pwrite(block_store_t *const bs, const size_t block_id, const size_t offset, const size_t len, const void *buffer)
+{
+    // Check for bad inputs, the range has to stay inside the block. 
+    if (bs == NULL || bs -> read_only || buffer == NULL || block_id >= bs -> avail_blocks 
+        || offset > bs -> block_size || len > bs -> block_size - offset) 
+    {
+        return 0;
+    }
+
+    // The rest of the block keeps its old contents, so they have to check out first. 
+    uint64_t seq = 0;
+    bool ok = true;
+    lock_block(bs, block_id, true);
+    if (in_use(bs, block_id) && (ok = block_verified(bs, block_id)))
+    {
+        block_unshare(bs, block_id, true);
+        memcpy(block_addr(bs, block_id) + offset, buffer, len);
+        mark_dirty(bs, block_id);
+        ok = journal_log(bs, JOURNAL_DATA, block_id * bs -> block_size + offset, len, &seq);
+    }
+    unlock_block(bs, block_id);
+    return ok && journal_commit(bs, seq) ? len : 0;
+}
+
+// Length of the run of consecutive ids starting at ids[i]. Their payloads are
+// adjacent in the arena, so the in-use ones can be moved a few memcpys at a time. 
+static size_t id_run(const size_t *const ids, const size_t i, const size_t n)
+{
+    size_t run = 1;
+    while (i + run < n && ids[i + run] == ids[i] + run)
+    {
+        run++;
+    }
+    return run;
+}
+
+// Checks every id up front so a vectored call either moves everything or nothing. 
+static bool ids_are_valid(const block_store_t *const bs, const size_t *const ids, const size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        if (ids[i] >= bs -> avail_blocks)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Moves a run of blocks between the arena and buf (block first + k <-> buf slot k), 
+// skipping the blocks that aren't in use. Caller holds the run's shard locks. 
+// Writes are journaled as they go, seq is as for journal_log. Fails if a block 
+// read fails its checksum, or a write couldn't be logged. 
+static bool copy_run(const block_store_t *const bs, const size_t first, const size_t count, uint8_t *buf, const bool to_arena, uint64_t *const seq)
+{
+    bool ok = true;
+    for (size_t k = 0, len; k < count; k += len)
+    {
+        if (!in_use(bs, first + k))
+        {
+            len = 1;
+            continue;
+        }
+        for (len = 1; k + len < count && in_use(bs, first + k + len); len++)
+        {
+        }
+        if (to_arena)
+        {
+            if (bs -> chunks)
+            {
+                for (size_t j = k; j < k + len; j++)
+                {
+                    store_block(bs, first + j, buf + j * bs -> block_size);
+                }
+            }
+            else
+            {
+                memcpy(block_addr(bs, first + k), buf + k * bs -> block_size, len * bs -> block_size);
+            }
+            blocks_rewritten(bs, first + k, len);
+            mark_dirty_range(bs, first + k, len);
+            ok &= journal_log(bs, JOURNAL_DATA, (first + k) * bs -> block_size, len * bs -> block_size, seq);
+        }
+        else
+        {
+            for (size_t j = k; j < k + len; j++)
+            {
+                ok &= block_verified(bs, first + j);
+                if (bs -> chunks)
+                {
+                    memcpy(buf + j * bs -> block_size, block_payload(bs, first + j), bs -> block_size);
+                }
+            }
+            if (!bs -> chunks)
+            {
+                memcpy(buf + k * bs -> block_size, block_addr(bs, first + k), len * bs -> block_size);
+            }
+        }
+    }
+    return ok;
+}
+
+size_t block_store_readv(const block_store_t *const bs, const size_t *const ids, const size_t n, void *buffer)
+{
+    // Check for bad inputs. 
+    if (bs == NULL || ids == NULL || buffer == NULL || !ids_are_valid(bs, ids, n)) 
+    {
+        return 0;
+    }
+
+    // Block ids[i] goes to the i-th block-sized slot of the buffer. Like 
+    // block_store_read, blocks that aren't in use leave their slot alone. 
+    uint8_t *dst = buffer;
+    bool ok = true;
+    for (size_t i = 0, run; i < n; i += run)
+    {
+        run = id_run(ids, i, n);
+        lock_blocks(bs, ids[i], run, false);
+        ok &= copy_run(bs, ids[i], run, dst + i * bs -> block_size, false, NULL);
+        unlock_blocks(bs, ids[i], run);
+    }
+    return ok ? n * bs -> block_size : 0;
+}
+
+size_t block_store_writev(block_store_t *const bs, const size_t *const ids, const size_t n, const void *buffer)
+{
+    // Check for bad inputs. 
+    if (bs == NULL || bs -> read_only || ids == NULL || buffer == NULL || !ids_are_valid(bs, ids, n)) 
+    {
+        return 0;
+    }
+
+    // The i-th block-sized slot of the buffer goes to block ids[i]. The whole 
+    // batch shares one journal commit. 
+    const uint8_t *src = buffer;
+    uint64_t seq = 0;
+    bool logged = true;
+    for (size_t i = 0, run; i < n; i += run)
+    {
+        run = id_run(ids, i, n);
+        lock_blocks(bs, ids[i], run, true);
+        logged &= copy_run(bs, ids[i], run, (uint8_t *) src + i * bs -> block_size, true, &seq);
+        unlock_blocks(bs, ids[i], run);
+    }
+    return logged && journal_commit(bs, seq) ? n * bs -> block_size : 0;
+}
+
+void *block_store_pin(block_store_t *const bs, const size_t block_id, const block_store_pin_mode_t mode)
+{
+    // Check for bad inputs. 
+    if (bs == NULL || block_id >= bs -> avail_blocks
+        || (mode != BLOCK_STORE_PIN_READ && mode != BLOCK_STORE_PIN_WRITE)
+        || (mode == BLOCK_STORE_PIN_WRITE && bs -> read_only))
+    {
+        return NULL;
+    }
+
+    // Only blocks in use have a payload worth pointing at, and it has to check out. 
+    void *payload = NULL;
+    lock_block(bs, block_id, true);
+    if (in_use(bs, block_id) && bs -> pins[block_id] != UINT32_MAX && block_verified(bs, block_id))
+    {
+        if (bs -> pins[block_id]++ == 0)
+        {
+            __atomic_add_fetch(&bs -> pinned_blocks, 1, __ATOMIC_RELAXED);
+        }
+        if (mode == BLOCK_STORE_PIN_WRITE)
+        {
+            // Writes through the pointer can't be seen, so assume they happen. 
+            mark_dirty(bs, block_id);
+        }
+        // A shared payload could be dropped by a write while it's pinned, so 
+        // pinned blocks always have their own. 
+        block_unshare(bs, block_id, true);
+        payload = block_addr(bs, block_id);
+    }
+    unlock_block(bs, block_id);
+    return payload;
+}
+
+void block_store_unpin(block_store_t *const bs, const size_t block_id)
+{
+    // Check for bad inputs. 
+    if (bs == NULL || block_id >= bs -> avail_blocks)
+    {
+        return;
+    }
+
+    // Writes through a pin can't be journaled as they happen, so the block is 
+    // logged whole when the last pin goes. 
+    lock_block(bs, block_id, true);
+    if (is_pinned(bs, block_id) && --bs -> pins[block_id] == 0)
+    {
+        __atomic_sub_fetch(&bs -> pinned_blocks, 1, __ATOMIC_RELAXED);
+        if (bitmap_test(bs -> dirty, block_id))
+        {
+            journal_log(bs, JOURNAL_DATA, block_id * bs -> block_size, bs -> block_size, NULL);
+        }
+    }
+    unlock_block(bs, block_id);
+}
+
+block_store_t *block_store_deserialize(const char *const filename)
+{
+    return block_store_deserialize_ex(filename, BLOCK_STORE_NUM_BLOCKS, BLOCK_SIZE_BYTES);
+}
+
+// Checksums follow the image as a table of one CRC32C per user block (0 for free 
+// ones), then this footer. Both are little-endian like the FBM. 
+#define CHECKSUM_MAGIC 0x4B435342U  // "BSCK"
+
+typedef struct 
+{
+    uint32_t magic;
+    uint32_t fbm_crc;       // Of the FBM's blocks as the image has them
+    uint32_t table_crc;
+    uint32_t reserved;
+    uint64_t avail_blocks;  // Entries in the table
+} checksum_footer_t;
+
+// Image I/O works on large runs of blocks. Free blocks between used ones are read 
+// along with them when the gap is smaller than this, one bigger pread beats two. 
+#define READ_GAP_BYTES (64 * 1024)
+
+// Free blocks are written as '0's from a fill buffer of up to this many bytes. 
+#define FILL_BYTES (64 * 1024)
+
+// Fills buf (the FBM's blocks worth of bytes) with the FBM as the image stores it. 
+// Only blocks in use are set: cached ones and ones still being claimed are free as 
+// far as the image is concerned. Caller holds every shard lock. 
+static void fbm_image(const block_store_t *const bs, uint8_t *const buf, const size_t fbm_bytes)
+{
+    memset(buf, 0, fbm_bytes);
+    memcpy(buf, bitmap_export(bs -> live), bitmap_get_bytes(bs -> live)); 
+}
+
+// preads exactly len bytes at offset, however many calls that takes. 
+static bool pread_full(const int fd, void *const buf, const size_t len, const size_t offset)
+{
+    for (size_t done = 0; done < len; )
+    {
+        const ssize_t got = pread(fd, (uint8_t *) buf + done, len - done, (off_t) (offset + done));
+        if (got <= 0)
+        {
+            if (got == -1 && errno == EINTR)
+            {
+                continue;
+            }
+            printf("Deserialize Error (pread): %s\n", got ? strerror(errno) : "unexpected end of file");
+            return false;
+        }
+        done += (size_t) got;
+    }
+    return true;
+}
+
+// Like pread_full, for files with holes: only the data extents are read, the 
+// holes (free blocks of sparse images) read as zeros anyway so they're zeroed here.
+static bool pread_data(const int fd, uint8_t *const dst, const size_t len, const size_t offset)
+{
+#ifdef SEEK_DATA
+    const size_t end = offset + len;
+    for (size_t pos = offset; pos < end; )
+    {
+        // ENXIO means no data past pos at all. Any other failure means the file 
+        // system can't tell us, so just read the lot. 
+        const off_t data = lseek(fd, (off_t) pos, SEEK_DATA);
+        if (data == -1 && errno != ENXIO)
+        {
+            return pread_full(fd, dst + (pos - offset), end - pos, pos);
+        }
+        const size_t data_start = (data == -1 || (size_t) data > end) ? end : (size_t) data;
+        memset(dst + (pos - offset), 0, data_start - pos);
+        if (data_start == end)
+        {
+            break;
+        }
+        const off_t hole = lseek(fd, data, SEEK_HOLE);
+        const size_t data_end = (hole == -1 || (size_t) hole > end) ? end : (size_t) hole;
+        if (!pread_full(fd, dst + (data_start - offset), data_end - data_start, data_start))
+        {
+            return false;
+        }
+        pos = data_end;
+    }
+    return true;
+#else
+    return pread_full(fd, dst, len, offset);
+#endif
+}
+
+// What a load has got up to, as bitmap_for_each hands it the used blocks. 
+typedef struct 
+{
+    block_store_t *bs;
+    int fd;
+    size_t first, count;  // Run of blocks still to be read, free gaps included
+    size_t gap_blocks;
+    bool sparse;          // File has holes, look for them rather than reading them
+    bool ok;
+} load_state_t;
+
+static void load_run(load_state_t *const state)
+{
+    if (state -> ok && state -> count)
+    {
+        uint8_t *const dst = block_addr(state -> bs, state -> first);
+        const size_t len = state -> count * state -> bs -> block_size, offset = state -> first * state -> bs -> block_size;
+        state -> ok = state -> sparse ? pread_data(state -> fd, dst, len, offset) : pread_full(state -> fd, dst, len, offset);
+    }
+    state -> count = 0;
+}
+
+static void load_block(const size_t block_id, void *arg)
+{
+    load_state_t *state = arg;
+    if (state -> count && block_id - (state -> first + state -> count) <= state -> gap_blocks)
+    {
+        state -> count = block_id + 1 - state -> first;
+        return;
+    }
+    load_run(state);
+    state -> first = block_id;
+    state -> count = 1;
+}
+
+// Makes the FBM image sitting in the arena's tail blocks the store's FBM. With 
+// checksums loaded, every block in use starts out unverified. 
+static bool install_fbm(block_store_t *const bs)
+{
+    if (!fbm_is_valid(bs))
+    {
+        printf("Deserialize Error: image has no valid FBM\n");
+        return false;
+    }
+    bitmap_t *fbm = bitmap_import(bs -> avail_blocks, block_addr(bs, bs -> avail_blocks));
+    bitmap_t *live = bitmap_import(bs -> avail_blocks, block_addr(bs, bs -> avail_blocks));
+    if (!fbm || !live || !bitmap_enable_summary(fbm))
+    {
+        bitmap_destroy(fbm);
+        bitmap_destroy(live);
+        return false;
+    }
+    bitmap_destroy(bs -> fbm);
+    bitmap_destroy(bs -> live);
+    bs -> fbm = fbm;
+    bs -> live = live;
+    if (bs -> checksums)
+    {
+        bs -> unverified = bitmap_import(bs -> avail_blocks, bitmap_export(bs -> fbm));
+        return bs -> unverified != NULL;
+    }
+    return true;
+}
+
+// Compressed images: this header, one index entry per user block, a CRC32C per 
+// user block if they have checksums, the FBM's blocks run-length encoded, then 
+// each block in use in id order and maybe a byte of padding. An index entry is the block's encoding in its 
+// top two bits and its encoded length in the rest; free blocks have 0. Offsets 
+// come from adding up the lengths, so any block decodes without the others. A 
+// block sharing a deduplicated payload with an earlier one stores nothing and 
+// has that block's id in place of a length. 
+#define PACKED_MAGIC 0x5A435342U  // "BSCZ"
+#define PACKED_CHECKSUMS 0x1U
+#define PACKED_KIND_SHIFT 30
+#define PACKED_LEN_MASK ((1U << PACKED_KIND_SHIFT) - 1)
+
+typedef enum 
+{
+    PACKED_ZERO = 0,  // All zeros, nothing stored
+    PACKED_RLE,       // rle_encode'd
+    PACKED_RAW,       // Didn't shrink, stored as is
+    PACKED_DUP        // Same payload as an earlier block
+} packed_kind_t;
+
+typedef struct 
+{
+    uint32_t magic;
+    uint32_t flags;
+    uint64_t num_blocks, block_size;
+    uint64_t fbm_len;    // Bytes of encoded FBM
+    uint32_t fbm_crc;    // With checksums: of the FBM's blocks as a plain image has them
+    uint32_t index_crc;  // With checksums: of the index and checksum table
+} packed_header_t;
+
+// Encoded blocks are gathered here and written out a stage at a time. 
+#define PACK_STAGE_BYTES (256 * 1024)
+
+// Checksum of a block in use as an image should record it. Blocks not checked 
+// since they were loaded keep the one they came with, so corruption isn't vouched for. 
+static uint32_t block_checksum(const block_store_t *const bs, const size_t block_id)
+{
+    if (bs -> unverified && bitmap_test(bs -> unverified, block_id))
+    {
+        return bs -> checksums[block_id];
+    }
+    return crc32c(0, block_payload(bs, block_id), bs -> block_size);
+}
+
+static bool block_is_zero(const uint8_t *const block, const size_t block_size)
+{
+    return block[0] == 0 && !memcmp(block, block + 1, block_size - 1);
+}
+
+// Finds the first block packed with the given chunk, making it block_id if the 
+// chunk hasn't come up yet. The table is open-addressed on the chunk's address. 
+static size_t pack_source(const chunk_t **keys, uint32_t *ids, const size_t mask, const chunk_t *chunk, const size_t block_id)
+{
+    size_t slot = (size_t) (((uint64_t) (uintptr_t) chunk * 0x9E3779B97F4A7C15ULL) >> 32) & mask;
+    while (keys[slot] && keys[slot] != chunk)
+    {
+        slot = (slot + 1) & mask;
+    }
+    if (!keys[slot])
+    {
+        keys[slot] = chunk;
+        ids[slot] = (uint32_t) block_id;
+    }
+    return ids[slot];
+}
+
+// Writes a compressed image of the store to fd. Returns the image's size, 0 on error. 
+static size_t pack_image(const block_store_t *const bs, const int fd, const bool checked)
+{
+    const size_t index_bytes = bs -> avail_blocks * sizeof(uint32_t);
+    const size_t table_bytes = checked ? index_bytes : 0;
+    const size_t fbm_bytes = (bs -> num_blocks - bs -> avail_blocks) * bs -> block_size;
+    const size_t stage_bytes = PACK_STAGE_BYTES > 2 * bs -> block_size ? PACK_STAGE_BYTES : 2 * bs -> block_size;
+    uint32_t *index = calloc(bs -> avail_blocks, sizeof(uint32_t));
+    uint32_t *table = checked ? calloc(bs -> avail_blocks, sizeof(uint32_t)) : NULL;
+    uint8_t *fbm = malloc(fbm_bytes + rle_bound(fbm_bytes));
+    uint8_t *stage = malloc(stage_bytes);
+    packed_header_t header = { PACKED_MAGIC, checked ? PACKED_CHECKSUMS : 0, bs -> num_blocks, bs -> block_size, 0, 0, 0 };
+    size_t offset = sizeof(header) + index_bytes + table_bytes;
+    bool ok = index && fbm && stage && (table || !checked);
+
+    // Hold the payloads still so the image is consistent. 
+    lock_blocks(bs, 0, bs -> avail_blocks, false);
+    const chunk_t **sources = NULL;
+    uint32_t *source_ids = NULL;
+    size_t source_mask = 0;
+    if (ok && bs -> chunks)
+    {
+        for (source_mask = 1; source_mask < 2 * bs -> shared_blocks; source_mask <<= 1)
+        {
+        }
+        sources = calloc(source_mask, sizeof(chunk_t *));
+        source_ids = malloc(source_mask * sizeof(uint32_t));
+        ok = sources && source_ids;
+        source_mask--;
+    }
+    if (ok)
+    {
+        // The FBM goes first, then the blocks. The header and index are only 
+        // known at the end, so they're left room for and written last. 
+        uint8_t *const fbm_packed = fbm + fbm_bytes;
+        fbm_image(bs, fbm, fbm_bytes);
+        header.fbm_len = rle_encode(fbm, fbm_bytes, fbm_packed, rle_bound(fbm_bytes));
+        header.fbm_crc = checked ? crc32c(0, fbm, fbm_bytes) : 0;
+        struct iovec iov = { fbm_packed, header.fbm_len };
+        ok = lseek(fd, (off_t) offset, SEEK_SET) != -1 && writev_full(fd, &iov, 1);
+        offset += header.fbm_len;
+    }
+    size_t staged = 0;
+    for (size_t id = 0; ok && id < bs -> avail_blocks; id++)
+    {
+        if (!in_use(bs, id))
+        {
+            continue;
+        }
+        if (checked)
+        {
+            table[id] = block_checksum(bs, id);
+        }
+        if (is_shared(bs, id))
+        {
+            const size_t source = pack_source(sources, source_ids, source_mask, bs -> chunks[id], id);
+            if (source != id)
+            {
+                index[id] = (uint32_t) PACKED_DUP << PACKED_KIND_SHIFT | (uint32_t) source;
+                continue;
+            }
+        }
+        if (stage_bytes - staged < bs -> block_size)
+        {
+            struct iovec iov = { stage, staged };
+            ok = writev_full(fd, &iov, 1);
+            staged = 0;
+        }
+        const uint8_t *const block = block_payload(bs, id);
+        packed_kind_t kind = PACKED_ZERO;
+        size_t len = 0;
+        if (!block_is_zero(block, bs -> block_size))
+        {
+            kind = PACKED_RLE;
+            len = rle_encode(block, bs -> block_size, stage + staged, bs -> block_size - 1);
+            if (len == SIZE_MAX)
+            {
+                kind = PACKED_RAW;
+                len = bs -> block_size;
+                memcpy(stage + staged, block, len);
+            }
+        }
+        index[id] = (uint32_t) kind << PACKED_KIND_SHIFT | (uint32_t) len;
+        staged += len;
+        offset += len;
+    }
+    unlock_blocks(bs, 0, bs -> avail_blocks);
+
+    // Deserialize tells images apart by size first, so a compressed one that 
+    // comes out at either plain size gets a byte of padding. 
+    const size_t image_bytes = bs -> num_blocks * bs -> block_size;
+    const uint8_t pad = 0;
+    const size_t padding = offset == image_bytes || offset == image_bytes + index_bytes + sizeof(checksum_footer_t);
+    offset += padding;
+    if (ok)
+    {
+        struct iovec iov[5] = { { stage, staged }, { (void *) &pad, padding }, { &header, sizeof(header) }, { index, index_bytes }, 
+                                { table, table_bytes } };
+        header.index_crc = checked ? crc32c(crc32c(0, index, index_bytes), table, table_bytes) : 0;
+        ok = writev_full(fd, iov, 2) && lseek(fd, 0, SEEK_SET) != -1 && writev_full(fd, iov + 2, 3);
+    }
+    if (!ok)
+    {
+        printf("Serialize Error: could not write compressed image\n");
+    }
+    free(index);
+    free(table);
+    free(fbm);
+    free(stage);
+    free(sources);
+    free(source_ids);
+    return ok ? offset : 0;
+}
+
+// Loads a compressed image straight out of a read-only mapping of it. 
+static bool unpack_image(block_store_t *const bs, const int fd, const size_t size)
+{
+    uint8_t *image = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (image == MAP_FAILED)
+    {
+        printf("Deserialize Error (mmap): %s\n", strerror(errno));
+        return false;
+    }
+    madvise(image, size, MADV_SEQUENTIAL);
+
+    packed_header_t header;
+    memcpy(&header, image, sizeof(header));
+    const bool checked = header.flags & PACKED_CHECKSUMS;
+    const size_t index_bytes = bs -> avail_blocks * sizeof(uint32_t), table_bytes = checked ? index_bytes : 0;
+    const size_t fbm_bytes = (bs -> num_blocks - bs -> avail_blocks) * bs -> block_size;
+    const uint32_t *index = (const uint32_t *) (image + sizeof(header));
+    size_t offset = sizeof(header) + index_bytes + table_bytes;
+    bool ok = header.num_blocks == bs -> num_blocks && header.block_size == bs -> block_size 
+              && !(header.flags & ~PACKED_CHECKSUMS) && size >= offset && header.fbm_len <= size - offset;
+    if (!ok)
+    {
+        printf("Deserialize Error: compressed image doesn't match the device\n");
+    }
+    else if (checked && crc32c(0, index, index_bytes + table_bytes) != header.index_crc)
+    {
+        printf("Deserialize Error: index failed its checksum\n");
+        ok = false;
+    }
+
+    // The FBM decodes straight into its blocks, as a plain load would read it. 
+    uint8_t *const fbm = block_addr(bs, bs -> avail_blocks);
+    if (ok && !rle_decode(image + offset, header.fbm_len, fbm, fbm_bytes))
+    {
+        printf("Deserialize Error: FBM doesn't decompress\n");
+        ok = false;
+    }
+    else if (ok && checked && crc32c(0, fbm, fbm_bytes) != header.fbm_crc)
+    {
+        printf("Deserialize Error: FBM failed its checksum\n");
+        ok = false;
+    }
+    if (ok && checked)
+    {
+        bs -> checksums = malloc(table_bytes);
+        ok = bs -> checksums != NULL;
+        if (ok)
+        {
+            memcpy(bs -> checksums, image + sizeof(header) + index_bytes, table_bytes);
+        }
+    }
+    ok = ok && install_fbm(bs);
+    offset += header.fbm_len;
+
+    for (size_t id = 0; ok && id < bs -> avail_blocks; id++)
+    {
+        const packed_kind_t kind = (packed_kind_t) (index[id] >> PACKED_KIND_SHIFT);
+        const size_t len = kind == PACKED_DUP ? 0 : index[id] & PACKED_LEN_MASK;
+        if (len > size - offset)
+        {
+            ok = false;
+        }
+        else if (in_use(bs, id))
+        {
+            uint8_t *const block = block_addr(bs, id);
+            if (kind == PACKED_ZERO)
+            {
+                memset(block, 0, bs -> block_size);
+            }
+            else if (kind == PACKED_RLE)
+            {
+                ok = rle_decode(image + offset, len, block, bs -> block_size);
+            }
+            else if (kind == PACKED_RAW && len == bs -> block_size)
+            {
+                memcpy(block, image + offset, len);
+            }
+            else if (kind == PACKED_DUP)
+            {
+                const size_t source = index[id] & PACKED_LEN_MASK;
+                ok = source < id && in_use(bs, source);
+                if (ok)
+                {
+                    memcpy(block, block_addr(bs, source), bs -> block_size);
+                }
+            }
+            else
+            {
+                ok = false;
+            }
+            if (!ok)
+            {
+                printf("Deserialize Error: block %zu doesn't decompress\n", id);
+            }
+        }
+        offset += len;
+    }
+    munmap(image, size);
+    return ok;
+}
+
+block_store_t *block_store_deserialize_ex(const char *const filename, const size_t num_blocks, const size_t block_size)
+{
+    // Check for bad inputs. 
+    if (filename == NULL) 
+    {
+        return NULL;
+    }
+
+    // Create block store. 
+    block_store_t *bs = block_store_create_ex(num_blocks, block_size);
+    if (!bs)
+    {
+        return NULL;
+    }
+
+    // First need to get fbm to see which blocks to read and which to skip.
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1)
+    {
+        printf("Deserialize open file error: %s\n", strerror(errno));
+        block_store_destroy(bs);
+        return NULL;
+    }
+
+    // Images with checksums are exactly a table and a footer longer than plain ones. 
+    struct stat st;
+    checksum_footer_t footer;
+    const size_t image_bytes = num_blocks * block_size, table_bytes = bs -> avail_blocks * sizeof(uint32_t);
+    bool ok = fstat(fd, &st) == 0;
+    const bool checked = ok && (size_t) st.st_size == image_bytes + table_bytes + sizeof(footer);
+    if (checked && (!pread_full(fd, &footer, sizeof(footer), image_bytes + table_bytes) 
+                    || footer.magic != CHECKSUM_MAGIC || footer.avail_blocks != bs -> avail_blocks))
+    {
+        printf("Deserialize Error: image has no valid checksum footer\n");
+        ok = false;
+    }
+
+    // Compressed images start by saying so. Plain ones can start with anything, 
+    // but they only come in the two sizes, which compressed ones never do. 
+    uint32_t magic = 0;
+    if (ok && !checked && (size_t) st.st_size != image_bytes && (size_t) st.st_size >= sizeof(packed_header_t)
+        && pread_full(fd, &magic, sizeof(magic), 0) && magic == PACKED_MAGIC)
+    {
+        ok = unpack_image(bs, fd, (size_t) st.st_size);
+        close(fd);
+        if (!ok)
+        {
+            block_store_destroy(bs);
+            return NULL;
+        }
+        bitmap_format(bs -> dirty, 0);
+        return bs;
+    }
+
+    // The FBM's blocks sit after the user blocks, in the arena just as in the file,
+    // so read them straight into place and import the FBM from there. It says 
+    // what everything else is, so it's checked up front. The payloads' checksums 
+    // are only kept for now, each block is checked when it's first read. 
+    const size_t fbm_bytes = (num_blocks - bs -> avail_blocks) * block_size;
+    ok = ok && pread_full(fd, block_addr(bs, bs -> avail_blocks), fbm_bytes, bs -> avail_blocks * block_size);
+    if (ok && checked)
+    {
+        bs -> checksums = malloc(table_bytes);
+        if (crc32c(0, block_addr(bs, bs -> avail_blocks), fbm_bytes) != footer.fbm_crc)
+        {
+            printf("Deserialize Error: FBM failed its checksum\n");
+            ok = false;
+        }
+        else if (!bs -> checksums || !pread_full(fd, bs -> checksums, table_bytes, image_bytes))
+        {
+            ok = false;
+        }
+        else if (crc32c(0, bs -> checksums, table_bytes) != footer.table_crc)
+        {
+            printf("Deserialize Error: checksum table failed its checksum\n");
+            ok = false;
+        }
+    }
+    ok = ok && install_fbm(bs);
+
+    // Then the used blocks, straight into the arena a run at a time. Files taking 
+    // less disk space than their size have holes, which are free blocks. 
+    if (ok)
+    {
+        const bool sparse = (size_t) st.st_blocks * 512 < (size_t) st.st_size;
+        load_state_t state = { .bs = bs, .fd = fd, .first = 0, .count = 0, .gap_blocks = READ_GAP_BYTES / block_size, 
+                               .sparse = sparse, .ok = true };
+        bitmap_for_each(bs -> fbm, load_block, &state);
+        load_run(&state);
+        ok = state.ok;
+    }
+
+    close(fd);
+    if (!ok)
+    {
+        block_store_destroy(bs);
+        return NULL;
+    }
+    // The file matches the store now. 
+    bitmap_format(bs -> dirty, 0);
+    bs -> flush_known = true;
+    bs -> flush_dev = st.st_dev;
+    bs -> flush_ino = st.st_ino;
+    return bs; 
+}
+
+// Writes the checksum table and footer after an image that has just been written 
+// out. Caller holds every shard lock. 
+static bool write_checksums(const block_store_t *const bs, const int fd, const uint8_t *const fbm, const size_t fbm_bytes)
+{
+    uint32_t *table = calloc(bs -> avail_blocks, sizeof(uint32_t));
+    if (!table)
+    {
+        return false;
+    }
+    for (size_t id = 0; id < bs -> avail_blocks; id++)
+    {
+        if (!in_use(bs, id))
+        {
+            continue;
+        }
+        table[id] = block_checksum(bs, id);
+    }
+    const size_t table_bytes = bs -> avail_blocks * sizeof(uint32_t);
+    checksum_footer_t footer = { CHECKSUM_MAGIC, crc32c(0, fbm, fbm_bytes), crc32c(0, table, table_bytes), 0, bs -> avail_blocks };
+    struct iovec iov[2] = { { table, table_bytes }, { &footer, sizeof(footer) } };
+    const bool ok = writev_full(fd, iov, 2);
+    free(table);
+    return ok;
+}
+
+size_t block_store_serialize(const block_store_t *const bs, const char *const filename)
+{
+    return block_store_serialize_ex(bs, filename, 0);
+}
+
+size_t block_store_serialize_ex(const block_store_t *const bs, const char *const filename, const unsigned flags)
+{
+    // Check for bad inputs. 
+    if (!bs || !filename || !strcmp(filename, "\n") || !strcmp(filename, "\0") || !strcmp(filename, "")
+        || (flags & ~(unsigned) (BLOCK_STORE_SERIALIZE_SPARSE | BLOCK_STORE_SERIALIZE_CHECKSUMS | BLOCK_STORE_SERIALIZE_COMPRESSED)))
+    {
+        return 0;
+    } 
+
+    // System call to create or open the file. 
+    int fd = open(filename, O_CREAT | O_WRONLY | O_TRUNC, 0777);
+    if (fd == -1)
+    {
+        printf("Serialize Error (open): %s\n", strerror(errno));
+        return 0;
+    }
+    if (flags & BLOCK_STORE_SERIALIZE_COMPRESSED)
+    {
+        size_t written = pack_image(bs, fd, flags & BLOCK_STORE_SERIALIZE_CHECKSUMS);
+        if (close(fd) == -1)
+        {
+            printf("Serialize Error (close): %s\n", strerror(errno));
+            written = 0;
+        }
+        return written;
+    }
+
+    // The image goes out in writevs of up to IOV_MAX entries: one per run of used 
+    // blocks (straight from the arena), one per fill buffer's worth of free blocks, 
+    // and the FBM. A dense or empty store is a single call. Sparse images seek 
+    // over free runs instead, the file was truncated so that leaves a hole. 
+    const bool sparse = flags & BLOCK_STORE_SERIALIZE_SPARSE;
+    size_t written = bs -> num_blocks * bs -> block_size;
+    const size_t fbm_bytes = (bs -> num_blocks - bs -> avail_blocks) * bs -> block_size;
+    const size_t fill_bytes = FILL_BYTES > bs -> block_size ? FILL_BYTES : bs -> block_size;
+    uint8_t *fill = malloc(fill_bytes);
+    uint8_t *fbm = malloc(fbm_bytes);
+    struct iovec *iov = malloc(IOV_MAX * sizeof(struct iovec));
+    bool ok = fill && fbm && iov;
+    if (ok)
+    {
+        memset(fill, '0', fill_bytes);
+
+        // Hold the payloads still so the image is consistent. 
+        lock_blocks(bs, 0, bs -> avail_blocks, false);
+        size_t count = 0;
+        for (size_t i = 0, run; ok && i < bs -> avail_blocks; i += run)
+        {
+            // Shared payloads aren't in the arena, they go one at a time. 
+            const bool used = in_use(bs, i);
+            const bool shared = used && is_shared(bs, i);
+            for (run = 1; !shared && i + run < bs -> avail_blocks && in_use(bs, i + run) == used 
+                          && !(used && is_shared(bs, i + run)); run++)
+            {
+            }
+            if (sparse && !used)
+            {
+                ok = writev_full(fd, iov, count);
+                count = 0;
+                if (ok && lseek(fd, (off_t) (run * bs -> block_size), SEEK_CUR) == -1)
+                {
+                    printf("Serialize Error (lseek): %s\n", strerror(errno));
+                    ok = false;
+                }
+                continue;
+            }
+            for (size_t left = run * bs -> block_size, len; ok && left; left -= len)
+            {
+                if (count == IOV_MAX)
+                {
+                    ok = writev_full(fd, iov, count);
+                    count = 0;
+                }
+                len = used ? left : (left < fill_bytes ? left : fill_bytes);
+                iov[count++] = (struct iovec) { .iov_base = used ? (uint8_t *) block_payload(bs, i) : fill, .iov_len = len };
+            }
+        }
+
+        // Special case for FBM, which fills the last blocks. 
+        if (ok && count == IOV_MAX)
+        {
+            ok = writev_full(fd, iov, count);
+            count = 0;
+        }
+        fbm_image(bs, fbm, fbm_bytes);
+        iov[count++] = (struct iovec) { .iov_base = fbm, .iov_len = fbm_bytes };
+        ok = ok && writev_full(fd, iov, count);
+        if (ok && (flags & BLOCK_STORE_SERIALIZE_CHECKSUMS))
+        {
+            ok = write_checksums(bs, fd, fbm, fbm_bytes);
+            written += bs -> avail_blocks * sizeof(uint32_t) + sizeof(checksum_footer_t);
+        }
+        unlock_blocks(bs, 0, bs -> avail_blocks);
+    }
+
+    // Close the file. 
+    if (close(fd) == -1) 
+    {
+        printf("Serialize Error (close): %s\n", strerror(errno));
+        ok = false;
+    }
+
+    free(fill);
+    free(fbm);
+    free(iov);
+    return ok ? written : 0;
+}
+
+// What a flush has got up to, as bitmap_for_each hands it the dirty blocks. 
+// Dirty blocks in use are gathered into runs so each run is one pwrite. 
+typedef struct 
+{
+    const block_store_t *bs;
+    int fd;
+    const uint8_t *fill;  // A block of '0's, which is what the image holds for free blocks
+    size_t first, count;  // Run of dirty blocks in use that still has to be written
+    size_t written;
+    bool ok;
+} flush_state_t;
+
+static void flush_pwrite(flush_state_t *const state, const void *src, const size_t bytes, const size_t block_id)
+{
+    if (state -> ok)
+    {
+        if (pwrite(state -> fd, src, bytes, (off_t) (block_id * state -> bs -> block_size)) != (ssize_t) bytes)
+        {
+            printf("Flush Error (pwrite): %s\n", strerror(errno));
+            state -> ok = false;
+        }
+        else
+        {
+            state -> written += bytes;
+        }
+    }
+}
+
+static void flush_run(flush_state_t *const state)
+{
+    if (state -> count)
+    {
+        flush_pwrite(state, block_addr(state -> bs, state -> first), state -> count * state -> bs -> block_size, state -> first);
+        state -> count = 0;
+    }
+}
+
+static void flush_block(const size_t block_id, void *arg)
+{
+    flush_state_t *state = arg;
+    if (in_use(state -> bs, block_id) && is_shared(state -> bs, block_id))
+    {
+        flush_run(state);
+        flush_pwrite(state, block_payload(state -> bs, block_id), state -> bs -> block_size, block_id);
+    }
+    else if (in_use(state -> bs, block_id))
+    {
+        if (!state -> count || state -> first + state -> count != block_id)
+        {
+            flush_run(state);
+            state -> first = block_id;
+        }
+        state -> count++;
+    }
+    else
+    {
+        flush_run(state);
+        flush_pwrite(state, state -> fill, state -> bs -> block_size, block_id);
+    }
+}
+
+size_t block_store_flush(block_store_t *const bs, const char *const filename)
+{
+    // Check for bad inputs. 
+    if (!bs || !filename || !strcmp(filename, ""))
+    {
+        return 0;
+    } 
+
+    // No O_TRUNC, everything that isn't dirty may already be right. Checksums after 
+    // the image would be out of date after this, so they go. 
+    int fd = open(filename, O_CREAT | O_WRONLY, 0777);
+    if (fd == -1)
+    {
+        printf("Flush Error (open): %s\n", strerror(errno));
+        return 0;
+    }
+    // Anything else (a compressed image, say) can't be patched in place. 
+    struct stat st;
+    const size_t image_bytes = bs -> num_blocks * bs -> block_size;
+    const size_t checked_bytes = image_bytes + bs -> avail_blocks * sizeof(uint32_t) + sizeof(checksum_footer_t);
+    if (fstat(fd, &st) == -1 || (st.st_size && (size_t) st.st_size != image_bytes && (size_t) st.st_size != checked_bytes))
+    {
+        printf("Flush Error: %s isn't a plain image\n", filename);
+        close(fd);
+        return 0;
+    }
+    if ((size_t) st.st_size > image_bytes && ftruncate(fd, (off_t) image_bytes) == -1)
+    {
+        printf("Flush Error (ftruncate): %s\n", strerror(errno));
+        close(fd);
+        return 0;
+    }
+    const size_t fbm_bytes = (bs -> num_blocks - bs -> avail_blocks) * bs -> block_size;
+    uint8_t *buf = malloc(fbm_bytes > bs -> block_size ? fbm_bytes : bs -> block_size);
+    if (!buf)
+    {
+        close(fd);
+        return 0;
+    }
+    memset(buf, '0', bs -> block_size);
+    flush_state_t state = { .bs = bs, .fd = fd, .fill = buf, .first = 0, .count = 0, .written = 0, .ok = true };
+
+    // Hold the payloads and the dirty set still while we write them out. Writeback 
+    // restarts the dirty set too, so it has to wait its turn. Only the file the 
+    // dirty set is relative to can be patched, any other gets the whole image. 
+    pthread_mutex_lock(&bs -> writeback_pass_lock);
+    lock_blocks(bs, 0, bs -> avail_blocks, false);
+    const bool mapped = bs -> fd != -1;
+    if (!mapped && st.st_size && bs -> flush_known && st.st_dev == bs -> flush_dev && st.st_ino == bs -> flush_ino)
+    {
+        bitmap_for_each(bs -> dirty, flush_block, &state);
+    }
+    else
+    {
+        for (size_t id = 0; id < bs -> avail_blocks; id++)
+        {
+            flush_block(id, &state);
+        }
+    }
+    flush_run(&state);
+
+    // The FBM is always written, it's one small write and it changes with every allocation. 
+    fbm_image(bs, buf, fbm_bytes);
+    flush_pwrite(&state, buf, fbm_bytes, bs -> avail_blocks);
+    if (state.ok && !mapped)
+    {
+        restart_dirty(bs);
+        bs -> flush_known = true;
+        bs -> flush_dev = st.st_dev;
+        bs -> flush_ino = st.st_ino;
+    }
+    unlock_blocks(bs, 0, bs -> avail_blocks);
+    pthread_mutex_unlock(&bs -> writeback_pass_lock);
+
+    if (close(fd) == -1)
+    {
+        printf("Flush Error (close): %s\n", strerror(errno));
+        state.ok = false;
+    }
+    free(buf);
+    return state.ok ? state.written : 0;
+}
@@ -0,0 +1,43 @@
+#include "cpu_features.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CPU_X86 1
+#endif
+
+// Set in every probed mask, so a probe that found nothing still isn't 0
+#define CPU_PROBED (1U << 31)
+
+static unsigned cpu_probe(void) 
+{
+    unsigned found = CPU_PROBED;
+#ifdef CPU_X86
+    // cpuid, through gcc. Normally run by a constructor, but that may not have happened yet
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) 
+    {
+        found |= CPU_SSE42;
+    }
+    if (__builtin_cpu_supports("popcnt")) 
+    {
+        found |= CPU_POPCNT;
+    }
+    if (__builtin_cpu_supports("avx2")) 
+    {
+        found |= CPU_AVX2;
+    }
+#endif
+    return found;
+}
+
+bool cpu_has(const unsigned features) 
+{
+    // Every caller computes the same answer, so a racy first store is harmless
+    static unsigned known = 0;
+    unsigned found = __atomic_load_n(&known, __ATOMIC_RELAXED);
+    if (!found) 
+    {
+        found = cpu_probe();
+        __atomic_store_n(&known, found, __ATOMIC_RELAXED);
+    }
+    return (found & features) == features;
+}
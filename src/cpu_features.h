@@ -0,0 +1,32 @@
+#ifndef CPU_FEATURES_H__
+#define CPU_FEATURES_H__
+
+#ifdef __cplusplus
+extern "C" 
+{
+#endif
+
+// Internal to the block store: the CPU features the SIMD kernels (bitmap, CRC32C)
+// pick between. The CPU is only probed once (cpuid), the first time it's asked.
+
+#include <stdbool.h>
+
+typedef enum cpu_feature 
+{
+    CPU_SSE42  = 1 << 0,
+    CPU_POPCNT = 1 << 1,
+    CPU_AVX2   = 1 << 2,
+} cpu_feature_t;
+
+///
+/// Checks the CPU for a set of features
+/// \param features The cpu_feature_t flags that are needed, or'd together
+/// \return true if the CPU has all of them, always false off x86
+///
+bool cpu_has(const unsigned features);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
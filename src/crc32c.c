@@ -0,0 +1,141 @@
+#include "crc32c.h"
+#include "cpu_features.h"
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CRC32C_X86 1
+#include <immintrin.h>
+#endif
+
+// Reflected Castagnoli polynomial
+#define CRC32C_POLY 0x82F63B78U
+
+//
+// Scalar: slicing by 8, eight table lookups for every eight bytes
+// (Intel's "Slicing-by-8" paper). The tables are built on first use.
+//
+
+static uint32_t table[8][256];
+static pthread_once_t table_once = PTHREAD_ONCE_INIT;
+
+static void table_init(void) 
+{
+    for (uint32_t n = 0; n < 256; ++n) 
+    {
+        uint32_t crc = n;
+        for (int k = 0; k < 8; ++k) 
+        {
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        table[0][n] = crc;
+    }
+    for (uint32_t n = 0; n < 256; ++n) 
+    {
+        for (int k = 1; k < 8; ++k) 
+        {
+            table[k][n] = (table[k - 1][n] >> 8) ^ table[0][table[k - 1][n] & 0xFF];
+        }
+    }
+}
+
+static uint32_t update_scalar(uint32_t crc, const void *data, size_t len) 
+{
+    pthread_once(&table_once, table_init);
+    const uint8_t *bytes = data;
+    for (; len >= 8; bytes += 8, len -= 8) 
+    {
+        // Little-endian, the low four bytes fold into the register
+        uint64_t word;
+        memcpy(&word, bytes, sizeof(word));
+        word ^= crc;
+        crc = table[7][word & 0xFF] ^ table[6][(word >> 8) & 0xFF] 
+            ^ table[5][(word >> 16) & 0xFF] ^ table[4][(word >> 24) & 0xFF] 
+            ^ table[3][(word >> 32) & 0xFF] ^ table[2][(word >> 40) & 0xFF] 
+            ^ table[1][(word >> 48) & 0xFF] ^ table[0][word >> 56];
+    }
+    for (; len; ++bytes, --len) 
+    {
+        crc = (crc >> 8) ^ table[0][(crc ^ *bytes) & 0xFF];
+    }
+    return crc;
+}
+
+static const crc32c_kernel_t kernel_scalar = {"scalar", update_scalar};
+
+#ifdef CRC32C_X86
+
+//
+// SSE4.2: the crc32 instruction does eight bytes a cycle or so once the 
+// pointer is aligned 
+//
+
+__attribute__((target("sse4.2"))) 
+static uint32_t update_sse42(uint32_t crc, const void *data, size_t len) 
+{
+    const uint8_t *bytes = data;
+    for (; len && ((uintptr_t) bytes & 7); ++bytes, --len) 
+    {
+        crc = _mm_crc32_u8(crc, *bytes);
+    }
+#ifdef __x86_64__
+    uint64_t crc64 = crc;
+    for (; len >= 8; bytes += 8, len -= 8) 
+    {
+        uint64_t word;
+        memcpy(&word, bytes, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = (uint32_t) crc64;
+#endif
+    for (; len >= 4; bytes += 4, len -= 4) 
+    {
+        uint32_t word;
+        memcpy(&word, bytes, sizeof(word));
+        crc = _mm_crc32_u32(crc, word);
+    }
+    for (; len; ++bytes, --len) 
+    {
+        crc = _mm_crc32_u8(crc, *bytes);
+    }
+    return crc;
+}
+
+static const crc32c_kernel_t kernel_sse42 = {"sse4.2", update_sse42};
+
+#endif
+
+const crc32c_kernel_t *crc32c_kernel_get(const char *name) 
+{
+    if (!name) 
+    {
+        return NULL;
+    }
+    if (!strcmp(name, kernel_scalar.name)) 
+    {
+        return &kernel_scalar;
+    }
+#ifdef CRC32C_X86
+    if (!strcmp(name, kernel_sse42.name) && cpu_has(CPU_SSE42)) 
+    {
+        return &kernel_sse42;
+    }
+#endif
+    return NULL;
+}
+
+const crc32c_kernel_t *crc32c_kernel_select(void) 
+{
+#ifdef CRC32C_X86
+    if (cpu_has(CPU_SSE42)) 
+    {
+        return &kernel_sse42;
+    }
+#endif
+    return &kernel_scalar;
+}
+
+uint32_t crc32c(const uint32_t crc, const void *data, const size_t len) 
+{
+    return ~crc32c_kernel_select() -> update(~crc, data, len);
+}
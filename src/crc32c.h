@@ -0,0 +1,49 @@
+#ifndef CRC32C_H__
+#define CRC32C_H__
+
+#ifdef __cplusplus
+extern "C" 
+{
+#endif
+
+// Internal to the block store: CRC32C (Castagnoli), with a table-driven scalar 
+// version and one using SSE4.2's crc32 instruction. The best one the CPU 
+// supports is picked once (cpuid), like the bitmap kernels. 
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef struct crc32c_kernel 
+{
+    const char *name;
+    // Runs len bytes through the raw CRC register, no pre/post inversion
+    uint32_t (*update)(uint32_t crc, const void *data, size_t len);
+} crc32c_kernel_t;
+
+///
+/// Picks the fastest kernel this CPU supports (only probes the CPU once)
+/// \return The kernel, never NULL
+///
+const crc32c_kernel_t *crc32c_kernel_select(void);
+
+///
+/// Looks up a kernel by name ("scalar", "sse4.2"), mostly for testing
+/// \param name The kernel name
+/// \return The kernel, NULL if it isn't built in or the CPU can't run it
+///
+const crc32c_kernel_t *crc32c_kernel_get(const char *name);
+
+///
+/// CRC32C of a buffer, continuing from the CRC of whatever came before it (0 to start)
+/// \param crc CRC so far
+/// \param data The bytes
+/// \param len Number of bytes
+/// \return The CRC with data appended
+///
+uint32_t crc32c(const uint32_t crc, const void *data, const size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,119 @@
+#include "rle.h"
+#include <string.h>
+
+// Runs shorter than this are cheaper as literals
+#define RLE_MIN_RUN 3
+#define RLE_MAX_SHORT_RUN (0xFE - 0x80 + RLE_MIN_RUN)
+#define RLE_MAX_LONG_RUN 0xFFFF
+#define RLE_MAX_LITERALS 0x80
+
+size_t rle_bound(const size_t len) 
+{
+    return len + (len + RLE_MAX_LITERALS - 1) / RLE_MAX_LITERALS;
+}
+
+// Appends literals src[0, count), in as many pieces as it takes
+static bool put_literals(const uint8_t *src, size_t count, uint8_t *const dst, size_t *const out, const size_t limit) 
+{
+    while (count) 
+    {
+        const size_t n = count < RLE_MAX_LITERALS ? count : RLE_MAX_LITERALS;
+        if (limit - *out < n + 1) 
+        {
+            return false;
+        }
+        dst[(*out)++] = (uint8_t) (n - 1);
+        memcpy(dst + *out, src, n);
+        *out += n;
+        src += n;
+        count -= n;
+    }
+    return true;
+}
+
+static bool put_run(const uint8_t byte, const size_t count, uint8_t *const dst, size_t *const out, const size_t limit) 
+{
+    if (count <= RLE_MAX_SHORT_RUN) 
+    {
+        if (limit - *out < 2) 
+        {
+            return false;
+        }
+        dst[(*out)++] = (uint8_t) (0x80 + count - RLE_MIN_RUN);
+    }
+    else 
+    {
+        if (limit - *out < 4) 
+        {
+            return false;
+        }
+        dst[(*out)++] = 0xFF;
+        dst[(*out)++] = (uint8_t) count;
+        dst[(*out)++] = (uint8_t) (count >> 8);
+    }
+    dst[(*out)++] = byte;
+    return true;
+}
+
+size_t rle_encode(const uint8_t *const src, const size_t len, uint8_t *const dst, const size_t limit) 
+{
+    size_t out = 0, literals = 0, i = 0;
+    while (i < len) 
+    {
+        size_t run = 1;
+        while (i + run < len && run < RLE_MAX_LONG_RUN && src[i + run] == src[i]) 
+        {
+            ++run;
+        }
+        if (run < RLE_MIN_RUN) 
+        {
+            i += run;
+            continue;
+        }
+        if (!put_literals(src + literals, i - literals, dst, &out, limit) || !put_run(src[i], run, dst, &out, limit)) 
+        {
+            return SIZE_MAX;
+        }
+        i += run;
+        literals = i;
+    }
+    return put_literals(src + literals, len - literals, dst, &out, limit) ? out : SIZE_MAX;
+}
+
+bool rle_decode(const uint8_t *const src, const size_t len, uint8_t *const dst, const size_t dst_len) 
+{
+    size_t in = 0, out = 0;
+    while (in < len) 
+    {
+        const uint8_t c = src[in++];
+        if (c < 0x80) 
+        {
+            const size_t n = (size_t) c + 1;
+            if (len - in < n || dst_len - out < n) 
+            {
+                return false;
+            }
+            memcpy(dst + out, src + in, n);
+            in += n;
+            out += n;
+            continue;
+        }
+        size_t n = (size_t) c - 0x80 + RLE_MIN_RUN;
+        if (c == 0xFF) 
+        {
+            if (len - in < 2) 
+            {
+                return false;
+            }
+            n = (size_t) src[in] | (size_t) src[in + 1] << 8;
+            in += 2;
+        }
+        if (in == len || dst_len - out < n) 
+        {
+            return false;
+        }
+        memset(dst + out, src[in++], n);
+        out += n;
+    }
+    return out == dst_len;
+}
@@ -0,0 +1,52 @@
+#ifndef RLE_H__
+#define RLE_H__
+
+#ifdef __cplusplus
+extern "C" 
+{
+#endif
+
+// Internal to the block store: the byte run-length codec compressed images use. 
+// A control byte c starts each piece of the stream:
+//   0x00-0x7F  c + 1 literal bytes follow
+//   0x80-0xFE  the next byte, repeated c - 0x80 + 3 times
+//   0xFF       a 16-bit little-endian count, then the byte to repeat that many times
+// Payloads that are mostly one byte (zeros, or the '0's of free blocks) shrink 
+// to a few bytes per run, and decoding is a handful of memsets and memcpys. 
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+///
+/// Worst case encoded size of len bytes
+/// \param len Bytes to encode
+/// \return Largest number of bytes rle_encode can produce
+///
+size_t rle_bound(const size_t len);
+
+///
+/// Encodes src into dst, giving up once the output would pass limit
+/// \param src Bytes to encode
+/// \param len Number of bytes
+/// \param dst Output buffer, limit bytes
+/// \param limit Most output bytes wanted
+/// \return Bytes written to dst, SIZE_MAX if it didn't fit
+///
+size_t rle_encode(const uint8_t *const src, const size_t len, uint8_t *const dst, const size_t limit);
+
+///
+/// Decodes src, which has to come out at exactly dst_len bytes
+/// \param src Encoded bytes
+/// \param len Number of encoded bytes
+/// \param dst Output buffer
+/// \param dst_len Decoded size
+/// \return true on success, false if src is malformed or the wrong size
+///
+bool rle_decode(const uint8_t *const src, const size_t len, uint8_t *const dst, const size_t dst_len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
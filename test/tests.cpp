@@ -3,7 +3,18 @@
 
 #include <gtest/gtest.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <random>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <vector>
 #include "block_store.h"
+#include "bitmap.h"
+#include "../src/bitmap_simd.h"
+#include "../src/crc32c.h"
+#include "../src/rle.h"
 
 // The object is opaque, so we can't really test things directly....
 
@@ -41,6 +52,32 @@ TEST(block_store_create, create) {
     score += 3;
 }
 
+TEST(block_store_create, create_ex_bad_geometry) {
+    // Block size not a power of two
+    ASSERT_EQ(nullptr, block_store_create_ex(1024, 1000));
+    // Block size out of range
+    ASSERT_EQ(nullptr, block_store_create_ex(1024, BLOCK_STORE_MIN_BLOCK_SIZE / 2));
+    ASSERT_EQ(nullptr, block_store_create_ex(1024, BLOCK_STORE_MAX_BLOCK_SIZE * 2));
+    // No room for anything but the FBM
+    ASSERT_EQ(nullptr, block_store_create_ex(1, BLOCK_SIZE_BYTES));
+    ASSERT_EQ(nullptr, block_store_create_ex(BLOCK_STORE_MAX_NUM_BLOCKS + 1, BLOCK_SIZE_BYTES));
+}
+
+TEST(block_store_create, create_ex_large) {
+    // 2^20 blocks of 512B needs 128KiB of FBM, so 256 blocks go to the FBM
+    const size_t num_blocks = 1 << 20;
+    block_store_t *bs = block_store_create_ex(num_blocks, 512);
+    ASSERT_NE(nullptr, bs) << "block_store_create_ex returned NULL when it should not have\n";
+    ASSERT_EQ(num_blocks - 256, block_store_get_total_blocks_ex(bs));
+    ASSERT_EQ(512, block_store_get_block_size(bs));
+    ASSERT_EQ(true, block_store_request(bs, num_blocks - 257));
+    ASSERT_EQ(false, block_store_request(bs, num_blocks - 256));
+    ASSERT_EQ(0, block_store_allocate(bs));
+    ASSERT_EQ(2, block_store_get_used_blocks(bs));
+    ASSERT_EQ(num_blocks - 258, block_store_get_free_blocks(bs));
+    block_store_destroy(bs);
+}
+
 TEST(block_store_destroy, null_pointer) {
     block_store_destroy(NULL);
     // Congrats, you didn't segfault!
@@ -169,6 +206,122 @@ TEST(block_store_alloc_free_req, request_same_twice) {
     score += 2;
 }
 
+TEST(block_store_alloc_free_req, next_fit_and_near) {
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+
+    // First fit hands a released low block right back
+    ASSERT_EQ(0, block_store_allocate(bs));
+    ASSERT_EQ(1, block_store_allocate(bs));
+    block_store_release(bs, 0);
+    ASSERT_EQ(0, block_store_allocate(bs));
+
+    // Next fit keeps going and only wraps once it runs off the end
+    block_store_set_alloc_policy(bs, BLOCK_STORE_NEXT_FIT);
+    ASSERT_EQ(2, block_store_allocate(bs));
+    block_store_release(bs, 0);
+    ASSERT_EQ(3, block_store_allocate(bs));
+    for (size_t i = 4; i < BLOCK_STORE_AVAIL_BLOCKS; i++) {
+        ASSERT_EQ(i, block_store_allocate(bs));
+    }
+    ASSERT_EQ(0, block_store_allocate(bs));
+    ASSERT_EQ(SIZE_MAX, block_store_allocate(bs));
+
+    // Near a hint, wrapping past the end
+    block_store_release(bs, 5);
+    block_store_release(bs, 200);
+    ASSERT_EQ(200, block_store_allocate_near(bs, 100));
+    ASSERT_EQ(5, block_store_allocate_near(bs, 250));
+    ASSERT_EQ(SIZE_MAX, block_store_allocate_near(bs, 0));
+    ASSERT_EQ(SIZE_MAX, block_store_allocate_near(nullptr, 0));
+    block_store_destroy(bs);
+}
+
+TEST(block_store_alloc_free_req, extents) {
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+
+    // Leave a 3-block hole at 10 and a 100-block hole at 100
+    size_t first = SIZE_MAX;
+    ASSERT_EQ(true, block_store_allocate_extent(bs, BLOCK_STORE_AVAIL_BLOCKS, &first));
+    ASSERT_EQ(0, first);
+    ASSERT_EQ(false, block_store_allocate_extent(bs, 1, &first));
+    block_store_release_extent(bs, 10, 3);
+    block_store_release_extent(bs, 100, 100);
+    ASSERT_EQ(BLOCK_STORE_AVAIL_BLOCKS - 103, block_store_get_used_blocks(bs));
+
+    ASSERT_EQ(true, block_store_allocate_extent(bs, 70, &first));
+    ASSERT_EQ(100, first);
+    ASSERT_EQ(true, block_store_allocate_extent(bs, 3, &first));
+    ASSERT_EQ(10, first);
+    ASSERT_EQ(false, block_store_allocate_extent(bs, 31, &first));
+    ASSERT_EQ(true, block_store_allocate_extent(bs, 30, &first));
+    ASSERT_EQ(170, first);
+    ASSERT_EQ(0, block_store_get_free_blocks(bs));
+
+    // Bad inputs
+    ASSERT_EQ(false, block_store_allocate_extent(bs, 0, &first));
+    ASSERT_EQ(false, block_store_allocate_extent(bs, 1, nullptr));
+    ASSERT_EQ(false, block_store_allocate_extent(nullptr, 1, &first));
+    block_store_release_extent(bs, 200, BLOCK_STORE_AVAIL_BLOCKS);
+    ASSERT_EQ(0, block_store_get_free_blocks(bs));
+    block_store_destroy(bs);
+}
+
+TEST(block_store_alloc_free_req, batches) {
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+
+    const size_t wanted[] = {3, 4, 5, 100};
+    ASSERT_EQ(true, block_store_request_many(bs, wanted, 4));
+    // 5 is taken now, and a repeat within the list fails as well; neither leaves anything behind
+    const size_t taken[] = {6, 5};
+    ASSERT_EQ(false, block_store_request_many(bs, taken, 2));
+    const size_t twice[] = {7, 7};
+    ASSERT_EQ(false, block_store_request_many(bs, twice, 2));
+    const size_t bad[] = {8, 500};
+    ASSERT_EQ(false, block_store_request_many(bs, bad, 2));
+    ASSERT_EQ(4, block_store_get_used_blocks(bs));
+
+    // Same order as one-at-a-time allocation
+    size_t ids[BLOCK_STORE_AVAIL_BLOCKS];
+    ASSERT_EQ(5, block_store_allocate_many(bs, 5, ids));
+    const size_t expect[] = {0, 1, 2, 6, 7};
+    for (size_t i = 0; i < 5; i++) {
+        ASSERT_EQ(expect[i], ids[i]);
+    }
+    ASSERT_EQ(8, block_store_allocate(bs));
+
+    // All or nothing
+    ASSERT_EQ(0, block_store_allocate_many(bs, BLOCK_STORE_AVAIL_BLOCKS - 9, ids));
+    ASSERT_EQ(BLOCK_STORE_AVAIL_BLOCKS - 10, block_store_allocate_many(bs, BLOCK_STORE_AVAIL_BLOCKS - 10, ids));
+    ASSERT_EQ(0, block_store_get_free_blocks(bs));
+
+    block_store_release_many(bs, wanted, 4);
+    ASSERT_EQ(4, block_store_get_free_blocks(bs));
+    ASSERT_EQ(3, block_store_allocate(bs));
+
+    // Out of order ids still all come back zeroed, adjacent or not
+    uint8_t data[BLOCK_SIZE_BYTES], back[BLOCK_SIZE_BYTES];
+    memset(data, 0xA5, sizeof(data));
+    const size_t reused[] = {100, 5, 4};
+    for (size_t id : reused) {
+        ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, id, data));
+    }
+    block_store_release_many(bs, reused, 3);
+    ASSERT_EQ(true, block_store_request_many(bs, reused, 3));
+    memset(data, 0, sizeof(data));
+    for (size_t id : reused) {
+        ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, id, back));
+        ASSERT_EQ(0, memcmp(data, back, sizeof(back)));
+    }
+    ASSERT_EQ(true, block_store_request_many(bs, reused, 0));
+    ASSERT_EQ(0, block_store_allocate_many(nullptr, 1, ids));
+    ASSERT_EQ(false, block_store_request_many(nullptr, wanted, 1));
+    block_store_release_many(nullptr, wanted, 1);
+    block_store_destroy(bs);
+}
+
 TEST(block_store, count_free_and_used) {
     block_store_t *bs = NULL;
     bs = block_store_create();
@@ -224,7 +377,7 @@ TEST(block_store_write_read, valid_write) {
 TEST(block_store_write_read, null_bs_write) {
     size_t bytesWritten;
     // Want to give buffer a valid value since we are testing bs.
-    int buffer;
+    int buffer = 0;
     bytesWritten = block_store_write(NULL, 0, &buffer);
     ASSERT_EQ(bytesWritten, 0);
 
@@ -252,7 +405,7 @@ TEST(block_store_write_read, null_buffer_write) {
 TEST(block_store_write_read, null_bs_read) {
     size_t bytesWritten;
     // Want to give buffer a valid value since we are testing bs.
-    int buffer;
+    int buffer = 0;
     bytesWritten = block_store_read(NULL, 0, &buffer);
     ASSERT_EQ(bytesWritten, 0);
     score += 2;
@@ -312,6 +465,300 @@ TEST(block_store_write_read, valid_write_and_read) {
 }
 
 
+TEST(block_store_write_read, partial_write_and_read) {
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+    ASSERT_EQ(true, block_store_request(bs, 30));
+
+    uint8_t block[BLOCK_SIZE_BYTES];
+    memset(block, 'x', BLOCK_SIZE_BYTES);
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 30, block));
+
+    // An 8 byte field in the middle, and the very last byte
+    const uint64_t field = 0x0123456789ABCDEFULL;
+    ASSERT_EQ(8, block_store_pwrite(bs, 30, 100, 8, &field));
+    ASSERT_EQ(1, block_store_pwrite(bs, 30, BLOCK_SIZE_BYTES - 1, 1, "y"));
+    uint64_t read_field = 0;
+    ASSERT_EQ(8, block_store_pread(bs, 30, 100, 8, &read_field));
+    ASSERT_EQ(field, read_field);
+
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 30, block));
+    ASSERT_EQ('x', block[99]);
+    ASSERT_EQ(0, memcmp(block + 100, &field, 8));
+    ASSERT_EQ('x', block[108]);
+    ASSERT_EQ('y', block[BLOCK_SIZE_BYTES - 1]);
+
+    // Out of the block's bounds
+    ASSERT_EQ(0, block_store_pwrite(bs, 30, BLOCK_SIZE_BYTES - 1, 2, "zz"));
+    ASSERT_EQ(0, block_store_pread(bs, 30, BLOCK_SIZE_BYTES + 1, 0, block));
+    ASSERT_EQ(0, block_store_pread(bs, 30, 1, SIZE_MAX, block));
+    ASSERT_EQ(0, block_store_pread(nullptr, 30, 0, 1, block));
+    ASSERT_EQ(0, block_store_pwrite(bs, 500, 0, 1, block));
+    block_store_destroy(bs);
+}
+
+TEST(block_store_write_read, vectored_write_and_read) {
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+
+    // An extent plus a straggler, written out of order
+    size_t first = 0;
+    ASSERT_EQ(true, block_store_allocate_extent(bs, 3, &first));
+    ASSERT_EQ(true, block_store_request(bs, 50));
+    const size_t ids[] = {first + 1, first + 2, 50, first};
+    uint8_t write_buffer[4 * BLOCK_SIZE_BYTES], read_buffer[4 * BLOCK_SIZE_BYTES];
+    for (size_t i = 0; i < 4; i++) {
+        memset(write_buffer + i * BLOCK_SIZE_BYTES, 'a' + i, BLOCK_SIZE_BYTES);
+    }
+    ASSERT_EQ(4 * BLOCK_SIZE_BYTES, block_store_writev(bs, ids, 4, write_buffer));
+
+    // Each block should hold what a single block_store_write would have put there
+    uint8_t block[BLOCK_SIZE_BYTES];
+    for (size_t i = 0; i < 4; i++) {
+        ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, ids[i], block));
+        ASSERT_EQ(0, memcmp(block, write_buffer + i * BLOCK_SIZE_BYTES, BLOCK_SIZE_BYTES));
+    }
+
+    const size_t in_order[] = {first, first + 1, first + 2, 50};
+    ASSERT_EQ(4 * BLOCK_SIZE_BYTES, block_store_readv(bs, in_order, 4, read_buffer));
+    ASSERT_EQ(0, memcmp(read_buffer, write_buffer + 3 * BLOCK_SIZE_BYTES, BLOCK_SIZE_BYTES));
+    ASSERT_EQ(0, memcmp(read_buffer + BLOCK_SIZE_BYTES, write_buffer, 3 * BLOCK_SIZE_BYTES));
+
+    // One bad id and nothing moves
+    const size_t bad[] = {first, 500};
+    ASSERT_EQ(0, block_store_readv(bs, bad, 2, read_buffer));
+    ASSERT_EQ(0, block_store_writev(bs, bad, 2, write_buffer));
+    ASSERT_EQ(0, block_store_readv(nullptr, ids, 4, read_buffer));
+    ASSERT_EQ(0, block_store_writev(bs, ids, 4, nullptr));
+    block_store_destroy(bs);
+}
+
+TEST(block_store_write_read, pin_and_unpin) {
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+
+    // Only blocks in use can be pinned
+    ASSERT_EQ(nullptr, block_store_pin(bs, 20, BLOCK_STORE_PIN_READ));
+    ASSERT_EQ(nullptr, block_store_pin(nullptr, 20, BLOCK_STORE_PIN_READ));
+    ASSERT_EQ(true, block_store_request(bs, 20));
+
+    // Writes through the pin show up in reads, and vice versa
+    uint8_t *payload = (uint8_t *) block_store_pin(bs, 20, BLOCK_STORE_PIN_WRITE);
+    ASSERT_NE(nullptr, payload);
+    memset(payload, 'P', 8);
+    uint8_t buffer[BLOCK_SIZE_BYTES];
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 20, buffer));
+    ASSERT_EQ(0, memcmp(buffer, "PPPPPPPP", 8));
+    ASSERT_EQ(0, buffer[8]);
+    memset(buffer, 'W', BLOCK_SIZE_BYTES);
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 20, buffer));
+    ASSERT_EQ('W', payload[BLOCK_SIZE_BYTES - 1]);
+
+    // Two pins, so it takes two unpins before release works
+    ASSERT_EQ(payload, block_store_pin(bs, 20, BLOCK_STORE_PIN_READ));
+    block_store_release(bs, 20);
+    const size_t ids[] = {20};
+    block_store_release_many(bs, ids, 1);
+    block_store_release_extent(bs, 19, 3);
+    ASSERT_EQ(1, block_store_get_used_blocks(bs));
+    block_store_unpin(bs, 20);
+    block_store_release(bs, 20);
+    ASSERT_EQ(1, block_store_get_used_blocks(bs));
+    block_store_unpin(bs, 20);
+    block_store_unpin(bs, 20);  // One too many is ignored
+    block_store_release(bs, 20);
+    ASSERT_EQ(0, block_store_get_used_blocks(bs));
+    block_store_destroy(bs);
+}
+
+TEST(block_store_write, dedup) 
+{
+    block_store_t *bs = block_store_create_ex(1024, 4096);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(true, block_store_set_dedup(bs, true));
+    std::mt19937_64 rng(520);
+    uint8_t pattern[4][4096], buffer[4096];
+    for (auto &payload : pattern) {
+        for (uint8_t &byte : payload) {
+            byte = (uint8_t) rng();
+        }
+    }
+
+    // 800 blocks of four payloads hold four copies
+    for (size_t id = 0; id < 800; id++) {
+        ASSERT_EQ(true, block_store_request(bs, id));
+        ASSERT_EQ(4096, block_store_write(bs, id, pattern[id % 4]));
+    }
+    ASSERT_EQ(800, block_store_get_used_blocks(bs));
+    ASSERT_EQ(4, block_store_get_payload_copies(bs));
+
+    // Partial writes and pins get the block its own copy, the others keep theirs
+    ASSERT_EQ(5, block_store_pwrite(bs, 0, 10, 5, "dedup"));
+    uint8_t *pinned = (uint8_t *) block_store_pin(bs, 1, BLOCK_STORE_PIN_WRITE);
+    ASSERT_NE(nullptr, pinned);
+    pinned[0] ^= 0xFF;
+    block_store_unpin(bs, 1);
+    ASSERT_EQ(6, block_store_get_payload_copies(bs));
+    ASSERT_EQ(4096, block_store_read(bs, 4, buffer));
+    ASSERT_EQ(0, memcmp(pattern[0], buffer, sizeof(buffer)));
+    ASSERT_EQ(4096, block_store_read(bs, 0, buffer));
+    ASSERT_EQ(0, memcmp("dedup", buffer + 10, 5));
+    ASSERT_EQ(0, memcmp(pattern[0], buffer, 10));
+
+    // A pinned block keeps its payload where the pin points, whatever is written to it
+    uint8_t *pin = (uint8_t *) block_store_pin(bs, 8, BLOCK_STORE_PIN_WRITE);
+    ASSERT_NE(nullptr, pin);
+    ASSERT_EQ(4096, block_store_write(bs, 8, pattern[2]));
+    ASSERT_EQ(0, memcmp(pattern[2], pin, sizeof(buffer)));
+    pin[0] = 'Q';
+    ASSERT_EQ(4096, block_store_read(bs, 8, buffer));
+    ASSERT_EQ('Q', buffer[0]);
+    block_store_unpin(bs, 8);
+    ASSERT_EQ(4096, block_store_write(bs, 8, pattern[0]));
+    ASSERT_EQ(6, block_store_get_payload_copies(bs));
+
+    // Rewriting a payload moves the block over, releasing the rest frees a copy
+    ASSERT_EQ(4096, block_store_write(bs, 0, pattern[0]));
+    ASSERT_EQ(5, block_store_get_payload_copies(bs));
+    for (size_t id = 3; id < 800; id += 4) {
+        block_store_release(bs, id);
+    }
+    ASSERT_EQ(4, block_store_get_payload_copies(bs));
+
+    // Compressed images store each payload once
+    const size_t size = block_store_serialize_ex(bs, "test_dedup.bs", BLOCK_STORE_SERIALIZE_COMPRESSED);
+    ASSERT_LT(0, size);
+    ASSERT_GT(8 * 4096, size);
+    block_store_t *loaded = block_store_deserialize_ex("test_dedup.bs", 1024, 4096);
+    ASSERT_NE(nullptr, loaded);
+    ASSERT_EQ(600, block_store_get_used_blocks(loaded));
+    uint8_t expected[4096];
+    for (size_t id = 0; id < 800; id++) {
+        ASSERT_EQ(block_store_read(bs, id, expected), block_store_read(loaded, id, buffer));
+        ASSERT_EQ(0, memcmp(expected, buffer, sizeof(buffer))) << "block " << id;
+    }
+    block_store_destroy(loaded);
+
+    // Turned off, every block has its contents back in place
+    ASSERT_EQ(true, block_store_set_dedup(bs, false));
+    ASSERT_EQ(600, block_store_get_payload_copies(bs));
+    ASSERT_EQ(4096, block_store_read(bs, 401, buffer));
+    ASSERT_EQ(0, memcmp(pattern[1], buffer, sizeof(buffer)));
+    block_store_destroy(bs);
+    remove("test_dedup.bs");
+
+    // Not for blocks smaller than a page, or mapped files
+    bs = block_store_create();
+    ASSERT_EQ(false, block_store_set_dedup(bs, true));
+    ASSERT_EQ(BLOCK_STORE_NUM_BYTES, block_store_serialize(bs, "test_dedup.bs"));
+    block_store_destroy(bs);
+    bs = block_store_open_mmap("test_dedup.bs", false);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(false, block_store_set_dedup(bs, true));
+    block_store_destroy(bs);
+    remove("test_dedup.bs");
+}
+
+TEST(block_store_snapshot, copy_on_write) 
+{
+    block_store_t *bs = block_store_create_ex(1024, 4096);
+    ASSERT_NE(nullptr, bs);
+    uint8_t buffer[4096], expected[4096];
+    for (size_t id = 0; id < 500; id++) {
+        ASSERT_EQ(true, block_store_request(bs, id));
+        memset(buffer, (int) id, sizeof(buffer));
+        ASSERT_EQ(4096, block_store_write(bs, id, buffer));
+    }
+
+    // Nothing is copied until the device writes
+    block_store_t *snap = block_store_snapshot(bs);
+    ASSERT_NE(nullptr, snap);
+    ASSERT_EQ(500, block_store_get_used_blocks(snap));
+    ASSERT_EQ(0, block_store_get_payload_copies(bs));
+    memset(buffer, 'x', sizeof(buffer));
+    ASSERT_EQ(4096, block_store_write(bs, 0, buffer));
+    ASSERT_EQ(5, block_store_pwrite(bs, 3, 100, 5, "hello"));
+    block_store_release(bs, 1);
+    ASSERT_EQ(true, block_store_request(bs, 1));
+    ASSERT_EQ(3, block_store_get_payload_copies(bs));
+    for (size_t id = 0; id < 500; id++) {
+        memset(expected, (int) id, sizeof(expected));
+        ASSERT_EQ(4096, block_store_read(snap, id, buffer));
+        ASSERT_EQ(0, memcmp(expected, buffer, sizeof(buffer))) << "block " << id;
+    }
+    ASSERT_EQ(4096, block_store_read(bs, 1, buffer));
+    ASSERT_EQ(0, buffer[0]);
+    ASSERT_EQ(5, block_store_pread(bs, 3, 100, 5, buffer));
+    ASSERT_EQ(0, memcmp("hello", buffer, 5));
+
+    // A snapshot can't be changed
+    ASSERT_EQ(0, block_store_write(snap, 2, buffer));
+    ASSERT_EQ(0, block_store_pwrite(snap, 2, 0, 1, buffer));
+    ASSERT_EQ(false, block_store_request(snap, 600));
+    ASSERT_EQ(SIZE_MAX, block_store_allocate(snap));
+    ASSERT_EQ(nullptr, block_store_pin(snap, 2, BLOCK_STORE_PIN_WRITE));
+    block_store_release(snap, 2);
+    ASSERT_EQ(500, block_store_get_used_blocks(snap));
+
+    // A clone of it can, without touching either of the others
+    block_store_t *clone = block_store_clone(snap);
+    ASSERT_NE(nullptr, clone);
+    ASSERT_EQ(4096, block_store_write(clone, 3, buffer));
+    ASSERT_EQ(4096, block_store_read(snap, 3, buffer));
+    ASSERT_EQ(3, buffer[100]);
+    ASSERT_EQ(4096, block_store_read(bs, 3, buffer));
+    ASSERT_EQ('h', buffer[100]);
+    ASSERT_NE(SIZE_MAX, block_store_allocate(clone));
+    ASSERT_EQ(501, block_store_get_used_blocks(clone));
+
+    // Snapshots serialize like anything else, and outlive their device
+    block_store_destroy(bs);
+    ASSERT_LT(0, block_store_serialize_ex(snap, "test_snap.bs", BLOCK_STORE_SERIALIZE_COMPRESSED));
+    block_store_t *loaded = block_store_deserialize_ex("test_snap.bs", 1024, 4096);
+    ASSERT_NE(nullptr, loaded);
+    for (size_t id = 0; id < 500; id++) {
+        ASSERT_EQ(4096, block_store_read(loaded, id, buffer));
+        ASSERT_EQ((uint8_t) id, buffer[4095]) << "block " << id;
+    }
+    block_store_destroy(loaded);
+    block_store_destroy(snap);
+    ASSERT_EQ(4096, block_store_read(clone, 499, buffer));
+    ASSERT_EQ((uint8_t) 499, buffer[0]);
+    block_store_destroy(clone);
+    remove("test_snap.bs");
+
+    // Deduplicated payloads are shared as they are, even once the device stops deduplicating
+    bs = block_store_create_ex(1024, 4096);
+    ASSERT_EQ(true, block_store_set_dedup(bs, true));
+    memset(buffer, 'd', sizeof(buffer));
+    for (size_t id = 0; id < 10; id++) {
+        ASSERT_EQ(true, block_store_request(bs, id));
+        ASSERT_EQ(4096, block_store_write(bs, id, buffer));
+    }
+    snap = block_store_snapshot(bs);
+    ASSERT_NE(nullptr, snap);
+    ASSERT_EQ(true, block_store_set_dedup(bs, false));
+    ASSERT_EQ(10, block_store_get_payload_copies(bs));
+    block_store_destroy(bs);
+    ASSERT_EQ(4096, block_store_read(snap, 9, expected));
+    ASSERT_EQ(0, memcmp(expected, buffer, sizeof(buffer)));
+    block_store_destroy(snap);
+
+    // Not while a block is pinned, or of a mapped file
+    bs = block_store_create();
+    ASSERT_EQ(true, block_store_request(bs, 5));
+    ASSERT_NE(nullptr, block_store_pin(bs, 5, BLOCK_STORE_PIN_READ));
+    ASSERT_EQ(nullptr, block_store_snapshot(bs));
+    block_store_unpin(bs, 5);
+    ASSERT_EQ(BLOCK_STORE_NUM_BYTES, block_store_serialize(bs, "test_snap.bs"));
+    block_store_destroy(bs);
+    bs = block_store_open_mmap("test_snap.bs", false);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(nullptr, block_store_clone(bs));
+    block_store_destroy(bs);
+    remove("test_snap.bs");
+}
+
 TEST(block_store_serialize, valid_serialize) 
 {
     block_store_t *bs = NULL;
@@ -411,6 +858,144 @@ TEST(block_store_serialize, null_bs)
     score += 2;
 }
 
+TEST(block_store_serialize, incremental_flush) 
+{
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(0, block_store_flush(bs, nullptr));
+    ASSERT_EQ(0, block_store_flush(nullptr, "test_flush.bs"));
+
+    // First flush of a new store is the whole image
+    remove("test_flush.bs");
+    uint8_t buffer[BLOCK_SIZE_BYTES];
+    memset(buffer, 'f', BLOCK_SIZE_BYTES);
+    for (size_t id = 0; id < 5; id++) {
+        ASSERT_EQ(true, block_store_request(bs, id * 10));
+        ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, id * 10, buffer));
+    }
+    ASSERT_EQ(BLOCK_STORE_NUM_BYTES, block_store_flush(bs, "test_flush.bs"));
+
+    // Nothing changed, so just the FBM
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_flush(bs, "test_flush.bs"));
+
+    // A write, a release and an allocation since then
+    memset(buffer, 'g', BLOCK_SIZE_BYTES);
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 20, buffer));
+    block_store_release(bs, 40);
+    ASSERT_EQ(1, block_store_allocate(bs));
+    ASSERT_EQ(4 * BLOCK_SIZE_BYTES, block_store_flush(bs, "test_flush.bs"));
+
+    // The file is the same as a full serialize would have made
+    ASSERT_EQ(BLOCK_STORE_NUM_BYTES, block_store_serialize(bs, "test_full.bs"));
+    FILE *flushed = fopen("test_flush.bs", "rb"), *full = fopen("test_full.bs", "rb");
+    ASSERT_NE(nullptr, flushed);
+    ASSERT_NE(nullptr, full);
+    std::vector<uint8_t> a(BLOCK_STORE_NUM_BYTES + 1), b(BLOCK_STORE_NUM_BYTES + 1);
+    ASSERT_EQ(BLOCK_STORE_NUM_BYTES, fread(a.data(), 1, a.size(), flushed));
+    ASSERT_EQ(BLOCK_STORE_NUM_BYTES, fread(b.data(), 1, b.size(), full));
+    ASSERT_EQ(a, b);
+    fclose(flushed);
+    fclose(full);
+
+    // A loaded store starts out clean, pinned blocks stay dirty
+    block_store_t *loaded = block_store_deserialize("test_flush.bs");
+    ASSERT_NE(nullptr, loaded);
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_flush(loaded, "test_flush.bs"));
+    ASSERT_NE(nullptr, block_store_pin(loaded, 20, BLOCK_STORE_PIN_WRITE));
+    ASSERT_EQ(2 * BLOCK_SIZE_BYTES, block_store_flush(loaded, "test_flush.bs"));
+    ASSERT_EQ(2 * BLOCK_SIZE_BYTES, block_store_flush(loaded, "test_flush.bs"));
+    block_store_unpin(loaded, 20);
+
+    // Any other file gets everything, whether it's new or some other image
+    remove("test_flush_other.bs");
+    ASSERT_EQ(BLOCK_STORE_NUM_BYTES, block_store_flush(loaded, "test_flush_other.bs"));
+    ASSERT_EQ(BLOCK_STORE_NUM_BYTES, block_store_flush(loaded, "test_full.bs"));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_flush(loaded, "test_full.bs"));
+    block_store_destroy(loaded);
+    loaded = block_store_deserialize("test_flush_other.bs");
+    ASSERT_NE(nullptr, loaded);
+    ASSERT_EQ(5, block_store_get_used_blocks(loaded));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(loaded, 10, buffer));
+    ASSERT_EQ('f', buffer[0]);
+    block_store_destroy(loaded);
+    block_store_destroy(bs);
+    remove("test_flush.bs");
+    remove("test_flush_other.bs");
+    remove("test_full.bs");
+}
+
+TEST(block_store_serialize, background_writeback) 
+{
+    block_store_writeback_policy_t policy = { 0, 5 };
+    block_store_t *memory = block_store_create();
+    ASSERT_NE(nullptr, memory);
+    ASSERT_EQ(false, block_store_set_writeback_policy(memory, &policy));
+    ASSERT_EQ(false, block_store_barrier(memory));
+    ASSERT_EQ(false, block_store_barrier(nullptr));
+    block_store_destroy(memory);
+
+    // A barrier gets everything to the file, after which the journal has nothing left to redo
+    remove("test_writeback.bs");
+    block_store_t *bs = block_store_open_mmap("test_writeback.bs", true);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(true, block_store_set_journal(bs, true));
+    struct stat st;
+    uint8_t buffer[BLOCK_SIZE_BYTES];
+    memset(buffer, 'w', BLOCK_SIZE_BYTES);
+    ASSERT_EQ(true, block_store_request(bs, 7));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 7, buffer));
+    ASSERT_EQ(0, stat("test_writeback.bs.journal", &st));
+    ASSERT_LT(0, st.st_size);
+    ASSERT_EQ(true, block_store_barrier(bs));
+    ASSERT_EQ(0, stat("test_writeback.bs.journal", &st));
+    ASSERT_EQ(0, st.st_size);
+
+    // Flushing a copy elsewhere writes all of it every time, and leaves writeback's work alone
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 7, buffer));
+    ASSERT_EQ(BLOCK_STORE_NUM_BYTES, block_store_flush(bs, "test_writeback_copy.bs"));
+    ASSERT_EQ(BLOCK_STORE_NUM_BYTES, block_store_flush(bs, "test_writeback_copy.bs"));
+    ASSERT_EQ(true, block_store_barrier(bs));
+    ASSERT_EQ(0, stat("test_writeback.bs.journal", &st));
+    ASSERT_EQ(0, st.st_size);
+
+    // The worker empties it too, given time
+    ASSERT_EQ(true, block_store_set_writeback_policy(bs, &policy));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 7, buffer));
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    ASSERT_EQ(0, stat("test_writeback.bs.journal", &st));
+    ASSERT_EQ(0, st.st_size);
+    ASSERT_EQ(true, block_store_set_journal(bs, false));
+
+    // And a dirty-count limit, with writers going at it meanwhile
+    policy = { 8, 0 };
+    ASSERT_EQ(true, block_store_set_writeback_policy(bs, &policy));
+    std::vector<std::thread> writers;
+    for (size_t t = 0; t < 4; t++) {
+        writers.emplace_back([bs, t]() {
+            uint8_t data[BLOCK_SIZE_BYTES];
+            for (size_t i = 0; i < 32; i++) {
+                size_t id = block_store_allocate(bs);
+                memset(data, (int) (t + i), BLOCK_SIZE_BYTES);
+                block_store_write(bs, id, data);
+            }
+        });
+    }
+    for (std::thread &writer : writers) {
+        writer.join();
+    }
+    ASSERT_EQ(true, block_store_set_writeback_policy(bs, nullptr));
+    ASSERT_EQ(true, block_store_barrier(bs));
+    block_store_destroy(bs);
+
+    // Everything made it to the file
+    bs = block_store_open_mmap("test_writeback.bs", false);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(129, block_store_get_used_blocks(bs));
+    block_store_destroy(bs);
+    remove("test_writeback.bs");
+    remove("test_writeback_copy.bs");
+}
+
 TEST(block_store_deserialize, valid_deserialize) 
 {
     block_store_t *bsWrite = NULL;
@@ -476,7 +1061,6 @@ TEST(block_store_deserialize, valid_deserialize)
     score += 12;
 }
 
-
 TEST(block_store_deserialize, null_filename) 
 {
     // Try to call deserialize...
@@ -486,3 +1070,1148 @@ TEST(block_store_deserialize, null_filename)
     score += 2;
 }
 
+TEST(block_store_deserialize, valid_deserialize_ex) 
+{
+    const size_t num_blocks = 4096, block_size = 1024;
+    block_store_t *bsWrite = block_store_create_ex(num_blocks, block_size);
+    ASSERT_NE(nullptr, bsWrite) << "block_store_create_ex returned NULL when it should not have\n";
+
+    // Blocks at both ends of the user range
+    const size_t last = block_store_get_total_blocks_ex(bsWrite) - 1;
+    uint8_t write_buffer[block_size];
+    memset(write_buffer, 'Q', block_size);
+    ASSERT_EQ(true, block_store_request(bsWrite, 3));
+    ASSERT_EQ(true, block_store_request(bsWrite, last));
+    ASSERT_EQ(block_size, block_store_write(bsWrite, 3, write_buffer));
+    ASSERT_EQ(block_size, block_store_write(bsWrite, last, write_buffer));
+    ASSERT_EQ(num_blocks * block_size, block_store_serialize(bsWrite, "test_ex.bs"));
+    block_store_destroy(bsWrite);
+
+    struct stat st;
+    stat("test_ex.bs", &st);
+    ASSERT_EQ(st.st_size, num_blocks * block_size);
+
+    block_store_t *bsRead = block_store_deserialize_ex("test_ex.bs", num_blocks, block_size);
+    ASSERT_NE(nullptr, bsRead);
+    ASSERT_EQ(2, block_store_get_used_blocks(bsRead));
+    ASSERT_EQ(false, block_store_request(bsRead, last));
+
+    uint8_t read_buffer[block_size];
+    ASSERT_EQ(block_size, block_store_read(bsRead, 3, read_buffer));
+    ASSERT_EQ(memcmp(read_buffer, write_buffer, block_size), 0);
+    ASSERT_EQ(block_size, block_store_read(bsRead, last, read_buffer));
+    ASSERT_EQ(memcmp(read_buffer, write_buffer, block_size), 0);
+    block_store_destroy(bsRead);
+}
+
+// Enough alternating runs to need several writevs, and gaps both sides of the
+// size deserialize reads straight through.
+TEST(block_store_deserialize, fragmented_round_trip) 
+{
+    block_store_t *bs = block_store_create_ex(16384, 256);
+    ASSERT_NE(nullptr, bs);
+    const size_t avail = block_store_get_free_blocks(bs);
+    uint8_t buffer[256];
+    size_t used = 0;
+    for (size_t id = 0; id < avail; id += (id < 8000 ? 3 : 400)) {
+        ASSERT_EQ(true, block_store_request(bs, id));
+        memset(buffer, (int) (id % 251), sizeof(buffer));
+        memcpy(buffer, &id, sizeof(id));
+        ASSERT_EQ(256, block_store_write(bs, id, buffer));
+        used++;
+    }
+    ASSERT_EQ(16384 * 256, block_store_serialize(bs, "test_frag.bs"));
+
+    block_store_t *loaded = block_store_deserialize_ex("test_frag.bs", 16384, 256);
+    ASSERT_NE(nullptr, loaded);
+    ASSERT_EQ(used, block_store_get_used_blocks(loaded));
+    uint8_t expected[256];
+    for (size_t id = 0; id < avail; id++) {
+        ASSERT_EQ(256, block_store_read(bs, id, expected));
+        ASSERT_EQ(256, block_store_read(loaded, id, buffer));
+        ASSERT_EQ(0, memcmp(expected, buffer, sizeof(buffer))) << "block " << id;
+    }
+    block_store_destroy(loaded);
+
+    // Short images don't load
+    ASSERT_EQ(nullptr, block_store_deserialize_ex("test_frag.bs", 32768, 256));
+    block_store_destroy(bs);
+    remove("test_frag.bs");
+}
+
+TEST(block_store_deserialize, sparse_round_trip) 
+{
+    // 16 MiB device with a handful of blocks in use
+    block_store_t *bs = block_store_create_ex(4096, 4096);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(0, block_store_serialize_ex(bs, "test_sparse.bs", 0x80));
+    uint8_t buffer[4096];
+    const size_t ids[] = {0, 1, 17, 18, 19, 2000, 4094};
+    for (size_t id : ids) {
+        ASSERT_EQ(true, block_store_request(bs, id));
+        memset(buffer, (int) (id % 200 + 1), sizeof(buffer));
+        ASSERT_EQ(4096, block_store_write(bs, id, buffer));
+    }
+    ASSERT_EQ(4096 * 4096, block_store_serialize_ex(bs, "test_sparse.bs", BLOCK_STORE_SERIALIZE_SPARSE));
+
+    // Full size, but free blocks are holes. Allow the file system some slack.
+    struct stat st;
+    ASSERT_EQ(0, stat("test_sparse.bs", &st));
+    ASSERT_EQ(4096 * 4096, st.st_size);
+    ASSERT_GT(4096 * 4096 / 4, st.st_blocks * 512);
+
+    block_store_t *loaded = block_store_deserialize_ex("test_sparse.bs", 4096, 4096);
+    ASSERT_NE(nullptr, loaded);
+    ASSERT_EQ(7, block_store_get_used_blocks(loaded));
+    uint8_t expected[4096];
+    for (size_t id : ids) {
+        ASSERT_EQ(4096, block_store_read(bs, id, expected));
+        ASSERT_EQ(4096, block_store_read(loaded, id, buffer));
+        ASSERT_EQ(0, memcmp(expected, buffer, sizeof(buffer))) << "block " << id;
+    }
+    ASSERT_EQ(false, block_store_request(loaded, 4094));
+    ASSERT_EQ(true, block_store_request(loaded, 4093));
+    block_store_destroy(loaded);
+    block_store_destroy(bs);
+    remove("test_sparse.bs");
+}
+
+TEST(block_store_deserialize, checksums) 
+{
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs);
+    uint8_t buffer[BLOCK_SIZE_BYTES];
+    for (size_t id = 0; id < 8; id++) {
+        ASSERT_EQ(true, block_store_request(bs, id));
+        memset(buffer, (int) ('a' + id), BLOCK_SIZE_BYTES);
+        ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, id, buffer));
+    }
+    const size_t trailer = BLOCK_STORE_AVAIL_BLOCKS * sizeof(uint32_t) + 24;
+    ASSERT_EQ(BLOCK_STORE_NUM_BYTES + trailer, block_store_serialize_ex(bs, "test_crc.bs", BLOCK_STORE_SERIALIZE_CHECKSUMS));
+    block_store_destroy(bs);
+
+    // Flip a byte of block 3: the load still works, block 3 doesn't
+    FILE *file = fopen("test_crc.bs", "r+b");
+    ASSERT_NE(nullptr, file);
+    fseek(file, 3 * BLOCK_SIZE_BYTES + 17, SEEK_SET);
+    fputc('!', file);
+    fclose(file);
+    bs = block_store_deserialize("test_crc.bs");
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(8, block_store_get_used_blocks(bs));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 2, buffer));
+    ASSERT_EQ('c', buffer[17]);
+    ASSERT_EQ(0, block_store_read(bs, 3, buffer));
+    ASSERT_EQ(0, block_store_pread(bs, 3, 0, 4, buffer));
+    ASSERT_EQ(0, block_store_pwrite(bs, 3, 0, 4, "abcd"));
+    ASSERT_EQ(nullptr, block_store_pin(bs, 3, BLOCK_STORE_PIN_READ));
+    const size_t ids[] = {2, 3};
+    uint8_t both[2 * BLOCK_SIZE_BYTES];
+    ASSERT_EQ(0, block_store_readv(bs, ids, 2, both));
+
+    // Still bad in a new image, until it's overwritten
+    ASSERT_EQ(BLOCK_STORE_NUM_BYTES + trailer, block_store_serialize_ex(bs, "test_crc2.bs", BLOCK_STORE_SERIALIZE_CHECKSUMS));
+    block_store_t *copy = block_store_deserialize("test_crc2.bs");
+    ASSERT_NE(nullptr, copy);
+    ASSERT_EQ(0, block_store_read(copy, 3, buffer));
+    block_store_destroy(copy);
+    memset(buffer, 'z', BLOCK_SIZE_BYTES);
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 3, buffer));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 3, buffer));
+    ASSERT_EQ(2 * BLOCK_SIZE_BYTES, block_store_readv(bs, ids, 2, both));
+    block_store_destroy(bs);
+
+    // A bad FBM doesn't load at all
+    file = fopen("test_crc.bs", "r+b");
+    ASSERT_NE(nullptr, file);
+    fseek(file, BLOCK_STORE_AVAIL_BLOCKS * BLOCK_SIZE_BYTES, SEEK_SET);
+    fputc(0x7F, file);
+    fclose(file);
+    ASSERT_EQ(nullptr, block_store_deserialize("test_crc.bs"));
+
+    // A flush leaves a plain image
+    bs = block_store_create();
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(BLOCK_STORE_NUM_BYTES, block_store_flush(bs, "test_crc2.bs"));
+    struct stat st;
+    ASSERT_EQ(0, stat("test_crc2.bs", &st));
+    ASSERT_EQ(BLOCK_STORE_NUM_BYTES, st.st_size);
+    block_store_destroy(bs);
+    remove("test_crc.bs");
+    remove("test_crc2.bs");
+}
+
+TEST(block_store_deserialize, compressed_round_trip) 
+{
+    // 16 MiB device: zeroed blocks, filled ones, mostly-zero ones and incompressible ones
+    block_store_t *bs = block_store_create_ex(4096, 4096);
+    ASSERT_NE(nullptr, bs);
+    std::mt19937_64 rng(520);
+    uint8_t buffer[4096];
+    for (size_t id = 0; id < 400; id += 1 + id % 3) {
+        ASSERT_EQ(true, block_store_request(bs, id));
+        memset(buffer, 0, sizeof(buffer));
+        if (id % 4 == 1) {
+            memset(buffer, (int) id, sizeof(buffer));
+        } else if (id % 4 == 2) {
+            buffer[id] = 'x';
+            memcpy(buffer + 1000, "some header", 11);
+        } else if (id % 4 == 3) {
+            for (uint8_t &byte : buffer) {
+                byte = (uint8_t) rng();
+            }
+        }
+        ASSERT_EQ(4096, block_store_write(bs, id, buffer));
+    }
+    ASSERT_EQ(true, block_store_request(bs, 4094));
+    for (uint8_t &byte : buffer) {
+        byte = (uint8_t) rng();
+    }
+    ASSERT_EQ(4096, block_store_write(bs, 4094, buffer));
+
+    // A fraction of the raw size, and it loads back the same
+    for (unsigned flags : {0U, (unsigned) BLOCK_STORE_SERIALIZE_CHECKSUMS}) {
+        const size_t size = block_store_serialize_ex(bs, "test_packed.bs", BLOCK_STORE_SERIALIZE_COMPRESSED | flags);
+        ASSERT_LT(0, size);
+        ASSERT_GT(4096 * 4096 / 8, size);
+        struct stat st;
+        ASSERT_EQ(0, stat("test_packed.bs", &st));
+        ASSERT_EQ(size, st.st_size);
+        block_store_t *loaded = block_store_deserialize_ex("test_packed.bs", 4096, 4096);
+        ASSERT_NE(nullptr, loaded);
+        ASSERT_EQ(block_store_get_used_blocks(bs), block_store_get_used_blocks(loaded));
+        uint8_t expected[4096];
+        for (size_t id = 0; id < 4095; id++) {
+            ASSERT_EQ(4096, block_store_read(bs, id, expected));
+            ASSERT_EQ(4096, block_store_read(loaded, id, buffer));
+            ASSERT_EQ(0, memcmp(expected, buffer, sizeof(buffer))) << "block " << id;
+        }
+        block_store_destroy(loaded);
+        ASSERT_EQ(nullptr, block_store_deserialize_ex("test_packed.bs", 8192, 2048));
+        ASSERT_EQ(0, block_store_flush(bs, "test_packed.bs"));
+    }
+
+    // The last block in the file is stored raw, damage to it shows up when it's read
+    FILE *file = fopen("test_packed.bs", "r+b");
+    ASSERT_NE(nullptr, file);
+    fseek(file, -1, SEEK_END);
+    fputc(~buffer[4095] & 0xFF, file);
+    fclose(file);
+    block_store_t *loaded = block_store_deserialize_ex("test_packed.bs", 4096, 4096);
+    ASSERT_NE(nullptr, loaded);
+    ASSERT_EQ(4096, block_store_read(loaded, 3, buffer));
+    ASSERT_EQ(0, block_store_read(loaded, 4094, buffer));
+    block_store_destroy(loaded);
+
+    // Truncated, it doesn't load at all
+    ASSERT_EQ(0, truncate("test_packed.bs", 4096));
+    ASSERT_EQ(nullptr, block_store_deserialize_ex("test_packed.bs", 4096, 4096));
+    block_store_destroy(bs);
+    remove("test_packed.bs");
+}
+
+// Compressed images whose contents add up to exactly a plain image's size.
+TEST(block_store_deserialize, compressed_plain_sizes) 
+{
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs);
+    std::mt19937_64 rng(520);
+    uint8_t buffer[BLOCK_SIZE_BYTES] = { 0 }, loaded_block[BLOCK_SIZE_BYTES];
+    ASSERT_EQ(true, block_store_request(bs, 0));
+    const size_t plain[2] = { BLOCK_STORE_NUM_BYTES, BLOCK_STORE_NUM_BYTES + BLOCK_STORE_AVAIL_BLOCKS * 4 + 24 };
+    for (unsigned flags : { 0U, (unsigned) BLOCK_STORE_SERIALIZE_CHECKSUMS }) {
+        // Random blocks to just short of the size, then one that grows a byte at a time past it
+        const size_t target = plain[flags ? 1 : 0];
+        memset(buffer, 0, sizeof(buffer));
+        buffer[0] = 1;
+        ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 0, buffer));
+        size_t size = block_store_serialize_ex(bs, "test_plain_size.bs", BLOCK_STORE_SERIALIZE_COMPRESSED | flags);
+        for (size_t id = block_store_get_used_blocks(bs); size + 2 * BLOCK_SIZE_BYTES / 3 < target; id++) {
+            const size_t random = target - size > 2 * BLOCK_SIZE_BYTES ? BLOCK_SIZE_BYTES : BLOCK_SIZE_BYTES / 2;
+            memset(buffer, 0, sizeof(buffer));
+            for (size_t i = 0; i < random; i++) {
+                buffer[i] = (uint8_t) rng();
+            }
+            ASSERT_EQ(true, block_store_request(bs, id));
+            ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, id, buffer));
+            size = block_store_serialize_ex(bs, "test_plain_size.bs", BLOCK_STORE_SERIALIZE_COMPRESSED | flags);
+        }
+        ASSERT_LT(size, target);
+        memset(buffer, 0, sizeof(buffer));
+        for (size_t literals = 1; size < target; literals++) {
+            buffer[literals - 1] = (uint8_t) (literals | 1);
+            ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 0, buffer));
+            size = block_store_serialize_ex(bs, "test_plain_size.bs", BLOCK_STORE_SERIALIZE_COMPRESSED | flags);
+            ASSERT_NE(target, size);
+            block_store_t *loaded = block_store_deserialize("test_plain_size.bs");
+            ASSERT_NE(nullptr, loaded);
+            ASSERT_EQ(block_store_get_used_blocks(bs), block_store_get_used_blocks(loaded));
+            ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(loaded, 0, loaded_block));
+            ASSERT_EQ(0, memcmp(buffer, loaded_block, sizeof(buffer)));
+            block_store_destroy(loaded);
+        }
+    }
+    block_store_destroy(bs);
+    remove("test_plain_size.bs");
+}
+
+TEST(block_store_deserialize, open_mmap) 
+{
+    // Nothing there yet, and no image to open
+    remove("test_mmap.bs");
+    ASSERT_EQ(nullptr, block_store_open_mmap("test_mmap.bs", false));
+    ASSERT_EQ(nullptr, block_store_open_mmap(nullptr, true));
+    ASSERT_EQ(false, block_store_sync(nullptr));
+
+    block_store_t *bs = block_store_open_mmap("test_mmap.bs", true);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(0, block_store_get_used_blocks(bs));
+    uint8_t buffer[BLOCK_SIZE_BYTES];
+    for (size_t i = 0; i < 10; i++) {
+        ASSERT_EQ(i * 3, block_store_allocate_near(bs, i * 3));
+        memset(buffer, 'a' + i, BLOCK_SIZE_BYTES);
+        ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, i * 3, buffer));
+    }
+    block_store_release(bs, 6);
+    ASSERT_EQ(true, block_store_sync(bs));
+    block_store_destroy(bs);
+
+    // It's a regular image, so it opens and loads either way
+    struct stat st;
+    ASSERT_EQ(0, stat("test_mmap.bs", &st));
+    ASSERT_EQ(BLOCK_STORE_NUM_BYTES, st.st_size);
+    block_store_t *loaded = block_store_deserialize("test_mmap.bs");
+    bs = block_store_open_mmap("test_mmap.bs", false);
+    ASSERT_NE(nullptr, loaded);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(9, block_store_get_used_blocks(bs));
+    ASSERT_EQ(9, block_store_get_used_blocks(loaded));
+    for (size_t i = 0; i < 10; i++) {
+        if (i == 2) {
+            continue;
+        }
+        memset(buffer, 0, BLOCK_SIZE_BYTES);
+        ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, i * 3, buffer));
+        ASSERT_EQ('a' + i, buffer[BLOCK_SIZE_BYTES - 1]);
+        ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(loaded, i * 3, buffer));
+        ASSERT_EQ('a' + i, buffer[0]);
+    }
+    ASSERT_EQ(false, block_store_request(bs, 27));
+    ASSERT_EQ(1, block_store_allocate(bs));
+    ASSERT_EQ(false, block_store_sync(loaded));  // Not file-backed
+    block_store_destroy(bs);
+    block_store_destroy(loaded);
+
+    // Geometry has to match the file
+    ASSERT_EQ(nullptr, block_store_open_mmap_ex("test_mmap.bs", false, 512, 256));
+    remove("test_mmap.bs");
+}
+
+TEST(block_store_deserialize, journal_replay) 
+{
+    block_store_t *memory = block_store_create();
+    ASSERT_EQ(false, block_store_set_journal(memory, true));
+    ASSERT_EQ(false, block_store_set_journal(nullptr, true));
+    block_store_destroy(memory);
+
+    // Writers on several threads, all journaled
+    remove("test_journal.bs");
+    block_store_t *bs = block_store_open_mmap("test_journal.bs", true);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(true, block_store_set_journal(bs, true));
+    std::vector<std::thread> writers;
+    for (size_t t = 0; t < 4; t++) {
+        writers.emplace_back([bs, t]() {
+            uint8_t data[BLOCK_SIZE_BYTES];
+            for (size_t i = 0; i < 16; i++) {
+                size_t id = t * 16 + i;
+                ASSERT_EQ(true, block_store_request(bs, id));
+                memset(data, (int) id, BLOCK_SIZE_BYTES);
+                ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, id, data));
+            }
+        });
+    }
+    for (std::thread &writer : writers) {
+        writer.join();
+    }
+    ASSERT_EQ(3, block_store_pwrite(bs, 5, 10, 3, "abc"));
+    block_store_release(bs, 63);
+
+    // Crash before any of it reached the image, cut off partway through a record
+    std::vector<uint8_t> journal(1 << 20);
+    FILE *file = fopen("test_journal.bs.journal", "rb");
+    ASSERT_NE(nullptr, file);
+    journal.resize(fread(journal.data(), 1, journal.size(), file));
+    fclose(file);
+    ASSERT_LT(64 * BLOCK_SIZE_BYTES, journal.size());
+    block_store_destroy(bs);
+    std::vector<uint8_t> zeros(BLOCK_STORE_NUM_BYTES);
+    file = fopen("test_journal.bs", "wb");
+    ASSERT_EQ(zeros.size(), fwrite(zeros.data(), 1, zeros.size(), file));
+    fclose(file);
+    file = fopen("test_journal.bs.journal", "wb");
+    ASSERT_EQ(journal.size(), fwrite(journal.data(), 1, journal.size(), file));
+    ASSERT_EQ(40, fwrite(journal.data(), 1, 40, file));
+    fclose(file);
+
+    // Opening redoes it all and empties the journal
+    bs = block_store_open_mmap("test_journal.bs", false);
+    ASSERT_NE(nullptr, bs);
+    struct stat st;
+    ASSERT_EQ(0, stat("test_journal.bs.journal", &st));
+    ASSERT_EQ(0, st.st_size);
+    ASSERT_EQ(63, block_store_get_used_blocks(bs));
+    uint8_t buffer[BLOCK_SIZE_BYTES];
+    for (size_t id = 0; id < 63; id++) {
+        ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, id, buffer));
+        ASSERT_EQ(id, buffer[0]);
+        ASSERT_EQ(id == 5 ? 'a' : id, buffer[10]);
+    }
+
+    // A sync leaves nothing to redo
+    ASSERT_EQ(true, block_store_set_journal(bs, true));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 0, buffer));
+    ASSERT_EQ(0, stat("test_journal.bs.journal", &st));
+    ASSERT_LT(0, st.st_size);
+    ASSERT_EQ(true, block_store_sync(bs));
+    ASSERT_EQ(0, stat("test_journal.bs.journal", &st));
+    ASSERT_EQ(0, st.st_size);
+    ASSERT_EQ(true, block_store_set_journal(bs, false));
+    ASSERT_NE(0, stat("test_journal.bs.journal", &st));
+    block_store_destroy(bs);
+    remove("test_journal.bs");
+}
+
+TEST(block_store_deserialize, old_fbm_location) 
+{
+    // The original layout: free blocks are '0's and the FBM is in block 127, 
+    // followed by whatever was left in the write buffer
+    std::vector<uint8_t> image(BLOCK_STORE_NUM_BYTES, '0');
+    memset(&image[0], 'a', BLOCK_SIZE_BYTES);
+    memset(&image[BLOCK_SIZE_BYTES], 'b', BLOCK_SIZE_BYTES);
+    memset(&image[127 * BLOCK_SIZE_BYTES], 0, BITMAP_SIZE_BYTES);
+    image[127 * BLOCK_SIZE_BYTES] = 0x03;
+    FILE *file = fopen("test_old.bs", "wb");
+    ASSERT_NE(nullptr, file);
+    ASSERT_EQ(image.size(), fwrite(image.data(), 1, image.size(), file));
+    fclose(file);
+
+    // Same size as an image with the FBM at the end, but it can't pass for one
+    ASSERT_EQ(nullptr, block_store_deserialize("test_old.bs"));
+    ASSERT_EQ(nullptr, block_store_open_mmap("test_old.bs", false));
+
+    // One that does still loads
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(true, block_store_request(bs, BLOCK_STORE_AVAIL_BLOCKS - 1));
+    ASSERT_EQ(BLOCK_STORE_NUM_BYTES, block_store_serialize(bs, "test_old.bs"));
+    block_store_destroy(bs);
+    bs = block_store_deserialize("test_old.bs");
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(1, block_store_get_used_blocks(bs));
+    block_store_destroy(bs);
+    bs = block_store_open_mmap("test_old.bs", false);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(false, block_store_request(bs, BLOCK_STORE_AVAIL_BLOCKS - 1));
+    block_store_destroy(bs);
+    remove("test_old.bs");
+    remove("test_old.bs.journal");
+}
+
+
+
+TEST(bitmap, word_scans_and_byte_export)
+{
+    // 200 bits leaves a partial last word and a partial last byte
+    bitmap_t *bitmap = bitmap_create(200);
+    ASSERT_NE(nullptr, bitmap);
+    ASSERT_EQ(25, bitmap_get_bytes(bitmap));
+    ASSERT_EQ(SIZE_MAX, bitmap_ffs(bitmap));
+    ASSERT_EQ(0, bitmap_ffz(bitmap));
+
+    bitmap_set(bitmap, 9);
+    bitmap_set(bitmap, 130);
+    ASSERT_EQ(9, bitmap_ffs(bitmap));
+    ASSERT_EQ(2, bitmap_total_set(bitmap));
+    // Export keeps the byte-wise layout: bit n lives in byte n / 8
+    ASSERT_EQ(0x02, bitmap_export(bitmap)[1]);
+    ASSERT_EQ(0x04, bitmap_export(bitmap)[16]);
+
+    // The padding past bit 199 must never show up as a zero or a set bit
+    bitmap_invert(bitmap);
+    ASSERT_EQ(198, bitmap_total_set(bitmap));
+    ASSERT_EQ(9, bitmap_ffz(bitmap));
+    bitmap_format(bitmap, 0xFF);
+    ASSERT_EQ(200, bitmap_total_set(bitmap));
+    ASSERT_EQ(SIZE_MAX, bitmap_ffz(bitmap));
+
+    bitmap_t *copy = bitmap_import(200, bitmap_export(bitmap));
+    ASSERT_NE(nullptr, copy);
+    ASSERT_EQ(200, bitmap_total_set(copy));
+    bitmap_destroy(copy);
+    bitmap_destroy(bitmap);
+}
+
+TEST(bitmap, summary_matches_plain_scans)
+{
+    // Enough words for three summary levels, with a ragged tail
+    const size_t n_bits = 300000 + 17;
+    bitmap_t *plain = bitmap_create(n_bits);
+    bitmap_t *summary = bitmap_create(n_bits);
+    ASSERT_NE(nullptr, plain);
+    ASSERT_NE(nullptr, summary);
+    ASSERT_EQ(true, bitmap_enable_summary(summary));
+
+    std::mt19937 rng(520);
+    for (int round = 0; round < 4; ++round) {
+        if (round == 2) {
+            // Nearly full: the state the FBM lives in
+            bitmap_format(plain, 0xFF);
+            bitmap_format(summary, 0xFF);
+        }
+        for (int i = 0; i < 20000; ++i) {
+            const size_t bit = rng() % n_bits;
+            switch (rng() % 3) {
+                case 0: bitmap_set(plain, bit); bitmap_set(summary, bit); break;
+                case 1: bitmap_reset(plain, bit); bitmap_reset(summary, bit); break;
+                default: bitmap_flip(plain, bit); bitmap_flip(summary, bit); break;
+            }
+            if (i % 97 == 0) {
+                ASSERT_EQ(bitmap_ffz(plain), bitmap_ffz(summary));
+                ASSERT_EQ(bitmap_ffs(plain), bitmap_ffs(summary));
+            }
+        }
+        // The incrementally kept count has to agree with a real walk of the bits
+        size_t walked = 0;
+        bitmap_for_each(plain, [](size_t, void *arg) { ++*(size_t *) arg; }, &walked);
+        ASSERT_EQ(walked, bitmap_total_set(plain));
+        ASSERT_EQ(walked, bitmap_total_set(summary));
+
+        bitmap_invert(plain);
+        bitmap_invert(summary);
+        ASSERT_EQ(bitmap_ffz(plain), bitmap_ffz(summary));
+        ASSERT_EQ(bitmap_ffs(plain), bitmap_ffs(summary));
+        ASSERT_EQ(n_bits - walked, bitmap_total_set(summary));
+    }
+
+    // Only the last bit left clear/set
+    bitmap_format(summary, 0xFF);
+    bitmap_reset(summary, n_bits - 1);
+    ASSERT_EQ(n_bits - 1, bitmap_ffz(summary));
+    bitmap_set(summary, n_bits - 1);
+    ASSERT_EQ(SIZE_MAX, bitmap_ffz(summary));
+    bitmap_format(summary, 0x00);
+    ASSERT_EQ(SIZE_MAX, bitmap_ffs(summary));
+    bitmap_set(summary, n_bits - 1);
+    ASSERT_EQ(n_bits - 1, bitmap_ffs(summary));
+
+    bitmap_destroy(plain);
+    bitmap_destroy(summary);
+}
+
+TEST(bitmap, simd_kernels_match_scalar)
+{
+    const bitmap_kernels_t *scalar = bitmap_kernels_get("scalar");
+    ASSERT_NE(nullptr, scalar);
+    ASSERT_NE(nullptr, bitmap_kernels_select());
+
+    std::mt19937_64 rng(520);
+    uint64_t words[67], expect[67];
+    for (const char *name : {"sse4.2", "avx2"}) {
+        const bitmap_kernels_t *kernels = bitmap_kernels_get(name);
+        if (!kernels) {
+            continue;  // Not on this CPU
+        }
+        // Every length, so every vector/scalar tail split gets hit
+        for (size_t count = 0; count <= 67; ++count) {
+            for (size_t i = 0; i < count; ++i) {
+                words[i] = rng();
+            }
+            ASSERT_EQ(scalar->popcount(words, count), kernels->popcount(words, count)) << name;
+
+            // Plant a single interesting word somewhere in a zero/full run
+            for (size_t pos = 0; pos <= count; ++pos) {
+                memset(words, 0, sizeof(words));
+                if (pos < count) {
+                    words[pos] = UINT64_C(1) << (pos % 64);
+                }
+                ASSERT_EQ(pos, kernels->find_nonzero(words, count)) << name;
+                memset(words, 0xFF, sizeof(words));
+                if (pos < count) {
+                    words[pos] = ~(UINT64_C(1) << (pos % 64));
+                }
+                ASSERT_EQ(pos, kernels->find_nonfull(words, count)) << name;
+            }
+
+            for (size_t i = 0; i < count; ++i) {
+                words[i] = expect[i] = rng();
+            }
+            scalar->invert(expect, count);
+            kernels->invert(words, count);
+            ASSERT_EQ(0, memcmp(expect, words, count * sizeof(uint64_t))) << name;
+        }
+    }
+}
+
+TEST(bitmap, ffz_from_wraps)
+{
+    for (bool summary : {false, true}) {
+        // Big enough for two summary levels
+        const size_t n_bits = 64 * 64 * 5 + 3;
+        bitmap_t *bitmap = bitmap_create(n_bits);
+        ASSERT_NE(nullptr, bitmap);
+        if (summary) {
+            ASSERT_EQ(true, bitmap_enable_summary(bitmap));
+        }
+        bitmap_format(bitmap, 0xFF);
+        ASSERT_EQ(SIZE_MAX, bitmap_ffz_from(bitmap, 100));
+
+        bitmap_reset(bitmap, 10);
+        bitmap_reset(bitmap, 5000);
+        bitmap_reset(bitmap, n_bits - 1);
+        ASSERT_EQ(10, bitmap_ffz_from(bitmap, 0));
+        ASSERT_EQ(10, bitmap_ffz_from(bitmap, 10));
+        ASSERT_EQ(5000, bitmap_ffz_from(bitmap, 11));
+        ASSERT_EQ(5000, bitmap_ffz_from(bitmap, 4999));
+        ASSERT_EQ(n_bits - 1, bitmap_ffz_from(bitmap, 5001));
+        ASSERT_EQ(10, bitmap_ffz_from(bitmap, n_bits));
+        bitmap_set(bitmap, n_bits - 1);
+        ASSERT_EQ(10, bitmap_ffz_from(bitmap, 5001));
+        bitmap_destroy(bitmap);
+    }
+}
+
+TEST(bitmap, ranges_and_zero_runs)
+{
+    for (bool summary : {false, true}) {
+        const size_t n_bits = 64 * 64 * 3 + 40;
+        bitmap_t *bitmap = bitmap_create(n_bits);
+        ASSERT_NE(nullptr, bitmap);
+        if (summary) {
+            ASSERT_EQ(true, bitmap_enable_summary(bitmap));
+        }
+        // Within a word, across words, and out to the very last bit
+        bitmap_set_range(bitmap, 3, 5);
+        ASSERT_EQ(5, bitmap_total_set(bitmap));
+        ASSERT_EQ(true, bitmap_test(bitmap, 7));
+        ASSERT_EQ(false, bitmap_test(bitmap, 8));
+        bitmap_set_range(bitmap, 60, 200);
+        ASSERT_EQ(205, bitmap_total_set(bitmap));
+        bitmap_set_range(bitmap, n_bits - 100, 100);
+        ASSERT_EQ(305, bitmap_total_set(bitmap));
+        // Out of range is ignored
+        bitmap_set_range(bitmap, n_bits - 1, 2);
+        ASSERT_EQ(305, bitmap_total_set(bitmap));
+
+        ASSERT_EQ(0, bitmap_find_zero_run(bitmap, 0, 3));
+        ASSERT_EQ(8, bitmap_find_zero_run(bitmap, 0, 4));
+        ASSERT_EQ(260, bitmap_find_zero_run(bitmap, 0, 53));
+        ASSERT_EQ(260, bitmap_find_zero_run(bitmap, 100, 1000));
+        ASSERT_EQ(SIZE_MAX, bitmap_find_zero_run(bitmap, 0, n_bits - 359));
+        ASSERT_EQ(260, bitmap_find_zero_run(bitmap, 0, n_bits - 360));
+        ASSERT_EQ(SIZE_MAX, bitmap_find_zero_run(bitmap, n_bits - 100, 1));
+
+        bitmap_reset_range(bitmap, 0, n_bits);
+        ASSERT_EQ(0, bitmap_total_set(bitmap));
+        ASSERT_EQ(SIZE_MAX, bitmap_ffs(bitmap));
+        ASSERT_EQ(0, bitmap_find_zero_run(bitmap, 0, n_bits));
+        bitmap_set_range(bitmap, 0, n_bits);
+        ASSERT_EQ(SIZE_MAX, bitmap_ffz(bitmap));
+        ASSERT_EQ(n_bits, bitmap_total_set(bitmap));
+        bitmap_destroy(bitmap);
+    }
+}
+
+TEST(bitmap, atomic_claims) {
+    bitmap_t *bitmap = bitmap_create(1000);
+    ASSERT_NE(nullptr, bitmap);
+    ASSERT_EQ(true, bitmap_enable_summary(bitmap));
+    ASSERT_EQ(false, bitmap_test_and_set(bitmap, 5));
+    ASSERT_EQ(true, bitmap_test_and_set(bitmap, 5));
+    ASSERT_EQ(1, bitmap_total_set(bitmap));
+    ASSERT_EQ(true, bitmap_test_and_reset(bitmap, 5));
+    ASSERT_EQ(false, bitmap_test_and_reset(bitmap, 5));
+    ASSERT_EQ(0, bitmap_total_set(bitmap));
+
+    // Claims go from the start bit and wrap, like bitmap_ffz_from
+    ASSERT_EQ(990, bitmap_claim_first_zero(bitmap, 990));
+    ASSERT_EQ(0, bitmap_claim_first_zero(bitmap, 1000));
+    bitmap_set_range(bitmap, 991, 9);
+    ASSERT_EQ(1, bitmap_claim_first_zero(bitmap, 995));
+
+    // All or nothing
+    ASSERT_EQ(false, bitmap_claim_range(bitmap, 60, 940));
+    ASSERT_EQ(true, bitmap_claim_range(bitmap, 60, 100));
+    ASSERT_EQ(false, bitmap_claim_range(bitmap, 2, 59));
+    ASSERT_EQ(2, bitmap_ffz(bitmap));
+    ASSERT_EQ(160, bitmap_ffz_from(bitmap, 60));
+    ASSERT_EQ(112, bitmap_total_set(bitmap));
+
+    // Many threads fighting over every bit: each one gets claimed exactly once
+    bitmap_format(bitmap, 0);
+    std::vector<std::thread> workers;
+    std::vector<std::vector<size_t>> claimed(8);
+    std::vector<std::atomic<bool>> given_back(1000);
+    for (size_t t = 0; t < 8; t++) {
+        workers.emplace_back([&, t]() {
+            for (size_t bit; (bit = bitmap_claim_first_zero(bitmap, t * 125)) != SIZE_MAX; ) {
+                claimed[t].push_back(bit);
+                // Give some back (once) to keep the summary levels busy
+                if (bit % 7 == 0 && !given_back[bit].exchange(true)) {
+                    ASSERT_EQ(true, bitmap_test_and_reset(bitmap, bit));
+                    claimed[t].pop_back();
+                }
+            }
+        });
+    }
+    for (auto &worker : workers) {
+        worker.join();
+    }
+    std::vector<int> seen(1000, 0);
+    for (const auto &bits : claimed) {
+        for (size_t bit : bits) {
+            seen[bit]++;
+        }
+    }
+    for (size_t bit = 0; bit < 1000; bit++) {
+        ASSERT_EQ(1, seen[bit]) << "bit " << bit;
+    }
+    ASSERT_EQ(1000, bitmap_total_set(bitmap));
+    ASSERT_EQ(SIZE_MAX, bitmap_ffz(bitmap));
+    bitmap_destroy(bitmap);
+}
+
+TEST(crc32c, kernels_match_scalar)
+{
+    ASSERT_EQ(0xE3069283U, crc32c(0, "123456789", 9));
+    ASSERT_EQ(0xE3069283U, crc32c(crc32c(0, "1234", 4), "56789", 5));
+    const crc32c_kernel_t *scalar = crc32c_kernel_get("scalar");
+    ASSERT_NE(nullptr, scalar);
+    ASSERT_NE(nullptr, crc32c_kernel_select());
+
+    // Every alignment and a spread of lengths, so every head/body/tail split gets hit
+    std::mt19937_64 rng(520);
+    uint8_t data[1024];
+    for (uint8_t &byte : data) {
+        byte = (uint8_t) rng();
+    }
+    const crc32c_kernel_t *sse42 = crc32c_kernel_get("sse4.2");
+    for (size_t offset = 0; sse42 && offset < 16; ++offset) {
+        for (size_t len = 0; len + offset <= sizeof(data); len += 1 + len / 4) {
+            ASSERT_EQ(scalar->update(~0U, data + offset, len), sse42->update(~0U, data + offset, len)) << offset << " " << len;
+        }
+    }
+}
+
+TEST(rle, round_trip)
+{
+    std::mt19937_64 rng(520);
+    std::vector<uint8_t> src(70000), packed(rle_bound(src.size())), out(src.size());
+    for (int pattern = 0; pattern < 4; ++pattern) {
+        // Zeros with a little data, short runs, noise, and one long run past the 16-bit count
+        for (size_t i = 0; i < src.size(); ++i) {
+            src[i] = pattern == 0 ? (i % 997 == 0 ? (uint8_t) i : 0) 
+                   : pattern == 1 ? (uint8_t) (i / 3) 
+                   : pattern == 2 ? (uint8_t) rng() : '0';
+        }
+        for (size_t len : {(size_t) 0, (size_t) 1, (size_t) 2, (size_t) 3, (size_t) 129, (size_t) 130, (size_t) 4096, src.size()}) {
+            const size_t n = rle_encode(src.data(), len, packed.data(), packed.size());
+            ASSERT_NE(SIZE_MAX, n);
+            ASSERT_GE(rle_bound(len), n);
+            ASSERT_EQ(true, rle_decode(packed.data(), n, out.data(), len)) << pattern << " " << len;
+            ASSERT_EQ(0, memcmp(src.data(), out.data(), len));
+            if (len > 1) {
+                ASSERT_EQ(false, rle_decode(packed.data(), n, out.data(), len - 1));
+                ASSERT_EQ(false, rle_decode(packed.data(), n - 1, out.data(), len));
+            }
+        }
+    }
+    ASSERT_GT(64, rle_encode(src.data(), src.size(), packed.data(), packed.size()));
+    ASSERT_EQ(SIZE_MAX, rle_encode(src.data(), src.size(), packed.data(), 4));
+}
+
+// Each thread allocates a block, stamps it with its own pattern, checks nobody
+// else wrote over it, then gives it back. Any double allocation shows up as a
+// corrupted stamp.
+TEST(block_store_threads, allocate_write_release) {
+    block_store_t *bs = block_store_create_ex(4096, 256);
+    ASSERT_NE(nullptr, bs);
+    const size_t threads = 8, rounds = 2000;
+    std::atomic<size_t> failures(0);
+    std::vector<std::thread> workers;
+    for (size_t t = 0; t < threads; t++) {
+        workers.emplace_back([&, t]() {
+            uint8_t mine[256], seen[256];
+            std::vector<size_t> held;
+            for (size_t r = 0; r < rounds; r++) {
+                const size_t id = block_store_allocate(bs);
+                if (id == SIZE_MAX) {
+                    failures++;
+                    continue;
+                }
+                memset(mine, (int) (t * 31 + r), sizeof(mine));
+                memcpy(mine, &id, sizeof(id));
+                block_store_write(bs, id, mine);
+                held.push_back(id);
+                // Hang on to a few so the FBM stays busy
+                if (held.size() > 16) {
+                    for (size_t held_id : held) {
+                        block_store_read(bs, held_id, seen);
+                        if (memcmp(seen, &held_id, sizeof(held_id)) != 0) {
+                            failures++;
+                        }
+                        block_store_release(bs, held_id);
+                    }
+                    held.clear();
+                }
+            }
+            for (size_t held_id : held) {
+                block_store_release(bs, held_id);
+            }
+        });
+    }
+    for (auto &worker : workers) {
+        worker.join();
+    }
+    ASSERT_EQ(0, failures.load());
+    ASSERT_EQ(0, block_store_get_used_blocks(bs));
+    ASSERT_EQ(4094, block_store_get_free_blocks(bs));  // Two blocks hold the FBM
+    block_store_destroy(bs);
+}
+
+// Writers sharing and unsharing the same few payloads while blocks come and go.
+TEST(block_store_threads, dedup_churn) {
+    block_store_t *bs = block_store_create_ex(1024, 4096);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(true, block_store_set_dedup(bs, true));
+    const size_t threads = 8, rounds = 2000;
+    std::atomic<size_t> failures(0);
+    std::vector<std::thread> workers;
+    for (size_t t = 0; t < threads; t++) {
+        workers.emplace_back([&, t]() {
+            uint8_t mine[4096], seen[4096];
+            for (size_t r = 0; r < rounds; r++) {
+                const size_t id = block_store_allocate(bs);
+                if (id == SIZE_MAX) {
+                    failures++;
+                    continue;
+                }
+                memset(mine, (int) ((t + r) % 3), sizeof(mine));
+                block_store_write(bs, id, mine);
+                if (r % 5 == 0) {
+                    block_store_pwrite(bs, id, 0, 1, "x");
+                    mine[0] = 'x';
+                }
+                block_store_read(bs, id, seen);
+                if (memcmp(seen, mine, sizeof(mine)) != 0) {
+                    failures++;
+                }
+                block_store_release(bs, id);
+            }
+        });
+    }
+    for (auto &worker : workers) {
+        worker.join();
+    }
+    ASSERT_EQ(0, failures.load());
+    ASSERT_EQ(0, block_store_get_payload_copies(bs));
+    block_store_destroy(bs);
+}
+
+// Snapshots taken while writers keep going must only hold whole writes.
+TEST(block_store_threads, snapshots_under_writes) {
+    block_store_t *bs = block_store_create_ex(4096, 256);
+    ASSERT_NE(nullptr, bs);
+    for (size_t id = 0; id < 64; id++) {
+        ASSERT_EQ(true, block_store_request(bs, id));
+    }
+    std::atomic<bool> done(false);
+    std::vector<std::thread> writers;
+    for (size_t t = 0; t < 4; t++) {
+        writers.emplace_back([&, t]() {
+            uint8_t mine[256];
+            for (size_t r = 0; !done; r++) {
+                memset(mine, (int) (t * 64 + r), sizeof(mine));
+                if (r % 3 == 0) {
+                    block_store_pwrite(bs, t * 16 + r % 16, 0, sizeof(mine), mine);
+                } else {
+                    block_store_write(bs, t * 16 + r % 16, mine);
+                }
+            }
+        });
+    }
+    size_t torn = 0;
+    uint8_t seen[256];
+    for (size_t round = 0; round < 50; round++) {
+        block_store_t *snap = block_store_snapshot(bs);
+        ASSERT_NE(nullptr, snap);
+        for (size_t id = 0; id < 64; id++) {
+            block_store_read(snap, id, seen);
+            torn += seen[0] != seen[255];
+        }
+        block_store_destroy(snap);
+    }
+    done = true;
+    for (std::thread &writer : writers) {
+        writer.join();
+    }
+    ASSERT_EQ(0, torn);
+    block_store_destroy(bs);
+}
+
+// Readers of fixed blocks must only ever see one writer's whole block, never a mix.
+TEST(block_store_threads, readers_see_whole_writes) {
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs);
+    for (size_t id = 0; id < 8; id++) {
+        ASSERT_EQ(true, block_store_request(bs, id));
+    }
+    std::atomic<bool> done(false);
+    std::atomic<size_t> torn(0);
+    std::vector<std::thread> workers;
+    for (size_t t = 0; t < 2; t++) {
+        workers.emplace_back([&, t]() {
+            uint8_t buffer[BLOCK_SIZE_BYTES];
+            for (size_t r = 0; r < 20000; r++) {
+                memset(buffer, (int) ('A' + (r + t) % 26), sizeof(buffer));
+                block_store_write(bs, r % 8, buffer);
+            }
+            done = true;
+        });
+    }
+    for (size_t t = 0; t < 4; t++) {
+        workers.emplace_back([&]() {
+            uint8_t buffer[2 * BLOCK_SIZE_BYTES];
+            const size_t ids[] = {3, 4};
+            while (!done) {
+                block_store_readv(bs, ids, 2, buffer);
+                for (size_t i = 1; i < sizeof(buffer); i++) {
+                    if (i % BLOCK_SIZE_BYTES && buffer[i] != buffer[i - 1]) {
+                        torn++;
+                        break;
+                    }
+                }
+            }
+        });
+    }
+    for (auto &worker : workers) {
+        worker.join();
+    }
+    ASSERT_EQ(0, torn.load());
+    block_store_destroy(bs);
+}
+
+// Extents, batches and single blocks all fighting over the same FBM.
+TEST(block_store_threads, mixed_allocators) {
+    block_store_t *bs = block_store_create_ex(8192, 256);
+    ASSERT_NE(nullptr, bs);
+    std::atomic<size_t> failures(0);
+    std::vector<std::thread> workers;
+    for (size_t t = 0; t < 6; t++) {
+        workers.emplace_back([&, t]() {
+            size_t ids[8];
+            for (size_t r = 0; r < 1000; r++) {
+                switch (t % 3) {
+                    case 0: {
+                        size_t first = 0;
+                        if (block_store_allocate_extent(bs, 5, &first)) {
+                            block_store_release_extent(bs, first, 5);
+                        }
+                        break;
+                    }
+                    case 1:
+                        if (block_store_allocate_many(bs, 8, ids) == 8) {
+                            block_store_release_many(bs, ids, 8);
+                        }
+                        break;
+                    default: {
+                        const size_t id = block_store_allocate(bs);
+                        if (block_store_pin(bs, id, BLOCK_STORE_PIN_READ) == nullptr) {
+                            failures++;
+                        }
+                        block_store_release(bs, id);
+                        block_store_unpin(bs, id);
+                        block_store_release(bs, id);
+                    }
+                }
+            }
+        });
+    }
+    for (auto &worker : workers) {
+        worker.join();
+    }
+    ASSERT_EQ(0, failures.load());
+    ASSERT_EQ(0, block_store_get_used_blocks(bs));
+    block_store_destroy(bs);
+}
+
+TEST(block_store_threads, thread_cache) {
+    block_store_t *bs = block_store_create_ex(4096, 256);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(false, block_store_set_thread_cache(nullptr, 16));
+    ASSERT_EQ(false, block_store_set_thread_cache(bs, BLOCK_STORE_MAX_THREAD_CACHE + 1));
+    ASSERT_EQ(true, block_store_set_thread_cache(bs, 16));
+
+    // Refills pull in extra blocks, but those still count as free
+    const size_t first = block_store_allocate(bs);
+    ASSERT_NE(SIZE_MAX, first);
+    ASSERT_EQ(1, block_store_get_used_blocks(bs));
+    ASSERT_EQ(4093, block_store_get_free_blocks(bs));
+
+    // A released block comes straight back out of the cache, zeroed
+    uint8_t buffer[256];
+    memset(buffer, 'x', sizeof(buffer));
+    ASSERT_EQ(256, block_store_write(bs, first, buffer));
+    block_store_release(bs, first);
+    block_store_release(bs, first);
+    ASSERT_EQ(0, block_store_get_used_blocks(bs));
+    ASSERT_EQ(first, block_store_allocate(bs));
+    ASSERT_EQ(256, block_store_read(bs, first, buffer));
+    ASSERT_EQ(0, buffer[0]);
+
+    // Cached blocks can still be requested, and don't stop the caches handing out the rest
+    const size_t cached = block_store_allocate(bs);
+    block_store_release(bs, cached);
+    ASSERT_EQ(true, block_store_request(bs, cached));
+    ASSERT_EQ(false, block_store_request(bs, cached));
+    ASSERT_NE(cached, block_store_allocate(bs));
+    ASSERT_EQ(3, block_store_get_used_blocks(bs));
+
+    // Everything fits even when the caches hold some of it
+    size_t ids[4091];
+    ASSERT_EQ(4091, block_store_allocate_many(bs, 4091, ids));
+    ASSERT_EQ(0, block_store_get_free_blocks(bs));
+    ASSERT_EQ(SIZE_MAX, block_store_allocate(bs));
+    block_store_release_many(bs, ids, 4091);
+    block_store_release(bs, cached);
+    ASSERT_EQ(2, block_store_get_used_blocks(bs));
+
+    // Turning the cache off hands everything back
+    ASSERT_EQ(true, block_store_set_thread_cache(bs, 0));
+    ASSERT_EQ(2, block_store_get_used_blocks(bs));
+    size_t extent = 0;
+    ASSERT_EQ(true, block_store_allocate_extent(bs, 4000, &extent));
+    block_store_destroy(bs);
+}
+
+// Same churn as allocate_write_release, but through the thread caches.
+TEST(block_store_threads, thread_cache_churn) {
+    block_store_t *bs = block_store_create_ex(1024, 256);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(true, block_store_set_thread_cache(bs, 32));
+    std::atomic<size_t> failures(0);
+    std::vector<std::thread> workers;
+    for (size_t t = 0; t < 8; t++) {
+        workers.emplace_back([&]() {
+            uint8_t mine[256], seen[256];
+            std::vector<size_t> held;
+            for (size_t r = 0; r < 5000; r++) {
+                const size_t id = block_store_allocate(bs);
+                if (id == SIZE_MAX) {
+                    failures++;
+                    continue;
+                }
+                memset(mine, (int) r, sizeof(mine));
+                memcpy(mine, &id, sizeof(id));
+                block_store_write(bs, id, mine);
+                held.push_back(id);
+                if (held.size() > (r % 64)) {
+                    for (size_t held_id : held) {
+                        block_store_read(bs, held_id, seen);
+                        if (memcmp(seen, &held_id, sizeof(held_id)) != 0) {
+                            failures++;
+                        }
+                        block_store_release(bs, held_id);
+                    }
+                    held.clear();
+                }
+            }
+            for (size_t held_id : held) {
+                block_store_release(bs, held_id);
+            }
+        });
+    }
+    for (auto &worker : workers) {
+        worker.join();
+    }
+    ASSERT_EQ(0, failures.load());
+    ASSERT_EQ(0, block_store_get_used_blocks(bs));
+    ASSERT_EQ(1023, block_store_get_free_blocks(bs));
+    block_store_destroy(bs);
+}
+
+// Snapshots taken while other threads claim and give back blocks, which flips FBM
+// bits without any shard lock. Every block starts out full of 0xFF and the threads
+// never write, so a block the snapshot has must be all zeros, never the old 0xFF.
+TEST(block_store_threads, snapshots_under_allocation) {
+    block_store_t *bs = block_store_create_ex(4096, 256);
+    ASSERT_NE(nullptr, bs);
+    uint8_t old[256], seen[256];
+    memset(old, 0xFF, sizeof(old));
+    for (size_t id = 0; id < 64; id++) {
+        ASSERT_EQ(true, block_store_request(bs, id));
+        ASSERT_EQ(256, block_store_write(bs, id, old));
+        block_store_release(bs, id);
+    }
+    std::atomic<bool> done(false);
+    std::vector<std::thread> workers;
+    for (size_t t = 0; t < 4; t++) {
+        workers.emplace_back([&]() {
+            while (!done) {
+                const size_t id = block_store_allocate(bs);
+                if (id != SIZE_MAX) {
+                    block_store_release(bs, id);
+                }
+            }
+        });
+    }
+    size_t stale = 0;
+    for (size_t round = 0; round < 500; round++) {
+        block_store_t *snap = block_store_snapshot(bs);
+        ASSERT_NE(nullptr, snap);
+        ASSERT_GE(4, block_store_get_used_blocks(snap));
+        for (size_t id = 0; id < 64; id++) {
+            // Free blocks leave the buffer alone
+            memset(seen, 0x5A, sizeof(seen));
+            block_store_read(snap, id, seen);
+            stale += seen[0] == 0xFF;
+        }
+        block_store_destroy(snap);
+    }
+    done = true;
+    for (std::thread &worker : workers) {
+        worker.join();
+    }
+    ASSERT_EQ(0, stale);
+    ASSERT_EQ(0, block_store_get_used_blocks(bs));
+    block_store_destroy(bs);
+}
+
+// A mapped store can't cache blocks: its FBM would still have them in use in the
+// file after a crash, even right after a sync, and nothing would ever free them.
+TEST(block_store_threads, thread_cache_mapped) {
+    block_store_t *bs = block_store_open_mmap("test_cache.bs", true);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(true, block_store_set_journal(bs, true));
+    ASSERT_EQ(false, block_store_set_thread_cache(bs, 64));
+
+    // Crash straight after a sync, with nothing torn down
+    const pid_t child = fork();
+    ASSERT_NE(-1, child);
+    if (child == 0) {
+        block_store_allocate(bs);
+        block_store_sync(bs);
+        _exit(0);
+    }
+    int status = 0;
+    ASSERT_EQ(child, waitpid(child, &status, 0));
+    ASSERT_EQ(0, status);
+    block_store_destroy(bs);
+
+    bs = block_store_open_mmap("test_cache.bs", false);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(1, block_store_get_used_blocks(bs));
+    block_store_destroy(bs);
+    remove("test_cache.bs");
+    remove("test_cache.bs.journal");
+}